@@ -43,8 +43,10 @@
  */
 
 #include <linux/acpi.h>
+#include <linux/cache.h>
 #include <linux/device.h>
 #include <linux/hid.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/mfd/core.h>
 #include <linux/module.h>
@@ -54,9 +56,15 @@
 #include <linux/srcu.h>
 #include <linux/usb.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
 #include <asm/barrier.h>
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+#include <linux/static_call.h>
+#define APPLEIB_HAVE_STATIC_CALL
+#endif
+
 #include "apple-ibridge.h"
 
 #ifdef UPSTREAM
@@ -71,14 +79,22 @@
 
 #define APPLETB_BASIC_CONFIG	1
 
+/* a T1 that keeps failing after a reset is not reset again before this */
+#define APPLEIB_RESET_INTERVAL_MS	10000
+
 #define	LOG_DEV(ib_dev)		(&(ib_dev)->acpi_dev->dev)
 
 #define PLAT_NAME_IB_TB		"apple-ib-tb"
 #define PLAT_NAME_IB_ALS	"apple-ib-als"
 
+static unsigned int appleib_connect_mask;
+module_param_named(connect_mask, appleib_connect_mask, uint, 0644);
+MODULE_PARM_DESC(connect_mask,
+		 "HID_CONNECT_* mask for every interface (0: as needed)");
+
 static const struct mfd_cell appleib_subdevs[] = {
-	{ .name = PLAT_NAME_IB_TB },
-	{ .name = PLAT_NAME_IB_ALS },
+	[APPLEIB_CELL_TB]	= { .name = PLAT_NAME_IB_TB },
+	[APPLEIB_CELL_ALS]	= { .name = PLAT_NAME_IB_ALS },
 };
 
 static const struct hid_device_id appleib_hid_ids[] = {
@@ -92,6 +108,8 @@ struct appleib_device {
 	struct list_head		hid_drivers;
 	struct list_head		hid_devices;
 	struct mfd_cell			subdevs[ARRAY_SIZE(appleib_subdevs)];
+	/* the hid driver registered for each cell, or NULL */
+	struct hid_driver		*cell_owner[APPLEIB_NUM_CELLS];
 	/* protect updates to all lists */
 	struct mutex			update_lock;
 	struct srcu_struct		lists_srcu;
@@ -99,39 +117,313 @@ struct appleib_device {
 	struct appleib_device_data	dev_data;
 	struct hid_driver		ib_driver;
 	struct hid_device_id		ib_dev_ids[ARRAY_SIZE(appleib_hid_ids)];
+	int				socw_state;
+	/* socw_state at freeze, for thaw and restore to return to */
+	int				frozen_socw_state;
+	ktime_t				last_detach;
+	struct work_struct		reset_work;
+	/* protect last_reset and removing, taken by the cells' work */
+	spinlock_t			reset_lock;
+	ktime_t				last_reset;
+	bool				removing;
 };
 
 struct appleib_hid_drv_info {
 	struct list_head	entry;
 	struct hid_driver	*driver;
 	void			*driver_data;
+	enum appleib_cell	cell;
+	/* the static call its ->event goes through, or APPLEIB_CELL_NONE */
+	enum appleib_cell	static_cell;
+};
+
+struct appleib_hid_attach {
+	struct hid_driver	*driver;
+	void			*driver_data;
+	enum appleib_cell	static_cell;
 };
 
+/*
+ * The drivers attached to a hid device, as one flat array. A table is
+ * never modified once published: attaching or detaching a driver builds
+ * a new one and swaps it in under update_lock, so the per-report path
+ * reads a single small, cache-line aligned allocation instead of walking
+ * a list of separately allocated entries.
+ */
+struct appleib_hid_dispatch {
+	struct rcu_head			rcu;
+	unsigned int			num_attached;
+	unsigned int			max_attached;
+	struct appleib_hid_attach	attach[];
+};
+
+/*
+ * One per iBridge hid interface, and its hid drvdata: the event path gets
+ * from the hid device to its dispatch table without a list lookup.
+ */
 struct appleib_hid_dev_info {
-	struct list_head		entry;
-	struct list_head		drivers;
-	struct hid_device		*device;
-	const struct hid_device_id	*device_id;
-	bool				started;
+	struct appleib_hid_dispatch __rcu	*dispatch;
+	struct appleib_device			*ib_dev;
+	struct list_head			entry;
+	struct hid_device			*device;
+	const struct hid_device_id		*device_id;
+	/* unpublished table for detaching without allocating, or NULL */
+	struct appleib_hid_dispatch		*spare;
+	bool					listed;
+	bool					started;
 };
 
+/*
+ * The ->event callback runs for every usage of every report, so for the
+ * known cells it is dispatched through a static call rather than through
+ * the hid_driver function pointer; on retpoline-mitigated CPUs that makes
+ * it a direct call. Drivers registered without a cell go through the
+ * generic pointer.
+ */
+#ifdef APPLEIB_HAVE_STATIC_CALL
+static int appleib_nop_event(struct hid_device *hdev, struct hid_field *field,
+			     struct hid_usage *usage, __s32 value)
+{
+	return 0;
+}
+
+DEFINE_STATIC_CALL(appleib_tb_event, appleib_nop_event);
+DEFINE_STATIC_CALL(appleib_als_event, appleib_nop_event);
+
+/*
+ * Unlike the cells, the static calls are shared by every iBridge: each
+ * points at the ->event of the drivers registered for its cell, counted
+ * in appleib_static_users. A driver with a different ->event for the same
+ * cell goes through the generic pointer.
+ */
+static DEFINE_MUTEX(appleib_static_lock);
+static typeof(appleib_nop_event) *appleib_static_event[APPLEIB_NUM_CELLS];
+static unsigned int appleib_static_users[APPLEIB_NUM_CELLS];
+
+static void appleib_update_static_call(enum appleib_cell cell,
+				       typeof(appleib_nop_event) *func)
+{
+	if (cell == APPLEIB_CELL_TB)
+		static_call_update(appleib_tb_event, func);
+	else
+		static_call_update(appleib_als_event, func);
+}
+
+static enum appleib_cell appleib_get_static_call(enum appleib_cell cell,
+						 struct hid_driver *driver)
+{
+	enum appleib_cell static_cell = APPLEIB_CELL_NONE;
+
+	if (cell == APPLEIB_CELL_NONE || !driver->event)
+		return APPLEIB_CELL_NONE;
+
+	mutex_lock(&appleib_static_lock);
+
+	if (!appleib_static_users[cell]) {
+		appleib_update_static_call(cell, driver->event);
+		appleib_static_event[cell] = driver->event;
+	}
+
+	if (appleib_static_event[cell] == driver->event) {
+		appleib_static_users[cell]++;
+		static_cell = cell;
+	}
+
+	mutex_unlock(&appleib_static_lock);
+
+	return static_cell;
+}
+
+static void appleib_put_static_call(enum appleib_cell static_cell)
+{
+	if (static_cell == APPLEIB_CELL_NONE)
+		return;
+
+	mutex_lock(&appleib_static_lock);
+
+	if (!--appleib_static_users[static_cell]) {
+		appleib_update_static_call(static_cell, appleib_nop_event);
+		appleib_static_event[static_cell] = NULL;
+	}
+
+	mutex_unlock(&appleib_static_lock);
+}
+#else
+static enum appleib_cell appleib_get_static_call(enum appleib_cell cell,
+						 struct hid_driver *driver)
+{
+	return APPLEIB_CELL_NONE;
+}
+
+static void appleib_put_static_call(enum appleib_cell static_cell)
+{
+}
+#endif
+
+static __always_inline int
+appleib_call_event(const struct appleib_hid_attach *attach,
+		   struct hid_device *hdev, struct hid_field *field,
+		   struct hid_usage *usage, __s32 value)
+{
+#ifdef APPLEIB_HAVE_STATIC_CALL
+	if (attach->static_cell == APPLEIB_CELL_TB)
+		return static_call(appleib_tb_event)(hdev, field, usage, value);
+	if (attach->static_cell == APPLEIB_CELL_ALS)
+		return static_call(appleib_als_event)(hdev, field, usage,
+						      value);
+#endif
+
+	if (attach->driver->event)
+		return attach->driver->event(hdev, field, usage, value);
+
+	return 0;
+}
+
+static void appleib_free_dispatch(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct appleib_hid_dispatch, rcu));
+}
+
+static struct appleib_hid_dispatch *
+appleib_get_dispatch(struct appleib_device *ib_dev,
+		     struct appleib_hid_dev_info *dev_info)
+{
+	return rcu_dereference_protected(dev_info->dispatch,
+					 lockdep_is_held(&ib_dev->update_lock));
+}
+
+static bool appleib_is_attached(struct appleib_hid_dispatch *disp,
+				struct hid_driver *driver)
+{
+	unsigned int i;
+
+	for (i = 0; disp && i < disp->num_attached; i++) {
+		if (disp->attach[i].driver == driver)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Rounding up to a cache line gives a power-of-two kmalloc size for the
+ * usual one or two attachments, which kmalloc aligns naturally.
+ */
+static struct appleib_hid_dispatch *appleib_alloc_dispatch(unsigned int num)
+{
+	struct appleib_hid_dispatch *disp;
+	size_t size = sizeof(*disp) + num * sizeof(disp->attach[0]);
+
+	size = ALIGN(size, L1_CACHE_BYTES);
+	disp = kzalloc(size, GFP_KERNEL);
+	if (disp)
+		disp->max_attached = (size - sizeof(*disp)) /
+				     sizeof(disp->attach[0]);
+
+	return disp;
+}
+
+/*
+ * Replace the device's dispatch table with a copy that has @drop removed
+ * or @add appended.
+ *
+ * Detaching must not fail, so it never allocates: attaching keeps a
+ * spare table large enough for the next detach, and a detach builds the
+ * new table in the spare, waits out the readers of the old one and keeps
+ * that as the next spare. A detach thus returns once no reader can reach
+ * @drop any more. Without @drop the old table is freed after an SRCU
+ * grace period, asynchronously.
+ */
+static int appleib_update_dispatch(struct appleib_device *ib_dev,
+				   struct appleib_hid_dev_info *dev_info,
+				   const struct appleib_hid_drv_info *add,
+				   struct hid_driver *drop)
+{
+	struct appleib_hid_dispatch *old = appleib_get_dispatch(ib_dev,
+								dev_info);
+	struct appleib_hid_dispatch *new = NULL;
+	unsigned int num = old ? old->num_attached : 0;
+	unsigned int i;
+
+	if (drop && !appleib_is_attached(old, drop))
+		return 0;
+
+	if (add)
+		num++;
+	if (drop)
+		num--;
+
+	if (drop && num) {
+		new = dev_info->spare;
+		if (WARN_ON(!new || new->max_attached < num))
+			return -ENOMEM;
+		dev_info->spare = NULL;
+		new->num_attached = 0;
+	} else if (num) {
+		new = appleib_alloc_dispatch(num);
+		if (!new)
+			return -ENOMEM;
+
+		/* what the next detach will need */
+		if (num > 1 && (!dev_info->spare ||
+				dev_info->spare->max_attached < num - 1)) {
+			kfree(dev_info->spare);
+			dev_info->spare = appleib_alloc_dispatch(num - 1);
+			if (!dev_info->spare) {
+				kfree(new);
+				return -ENOMEM;
+			}
+		}
+	}
+
+	if (new) {
+		for (i = 0; old && i < old->num_attached; i++) {
+			if (old->attach[i].driver != drop)
+				new->attach[new->num_attached++] =
+								old->attach[i];
+		}
+
+		if (add) {
+			new->attach[new->num_attached].driver = add->driver;
+			new->attach[new->num_attached].driver_data =
+							add->driver_data;
+			new->attach[new->num_attached].static_cell =
+							add->static_cell;
+			new->num_attached++;
+		}
+	}
+
+	rcu_assign_pointer(dev_info->dispatch, new);
+
+	if (!old)
+		return 0;
+
+	if (drop) {
+		synchronize_srcu(&ib_dev->lists_srcu);
+		kfree(dev_info->spare);
+		dev_info->spare = old;
+	} else {
+		call_srcu(&ib_dev->lists_srcu, &old->rcu,
+			  appleib_free_dispatch);
+	}
+
+	return 0;
+}
+
 static void appleib_remove_driver(struct appleib_device *ib_dev,
-				  struct appleib_hid_drv_info *drv_info,
+				  struct hid_driver *driver,
 				  struct appleib_hid_dev_info *dev_info)
 {
-	list_del_rcu(&drv_info->entry);
-	synchronize_srcu(&ib_dev->lists_srcu);
-
-	if (drv_info->driver->remove)
-		drv_info->driver->remove(dev_info->device);
+	appleib_update_dispatch(ib_dev, dev_info, NULL, driver);
 
-	kfree(drv_info);
+	if (driver->remove)
+		driver->remove(dev_info->device);
 }
 
-static int appleib_probe_driver(struct appleib_hid_drv_info *drv_info,
+static int appleib_probe_driver(struct appleib_device *ib_dev,
+				struct appleib_hid_drv_info *drv_info,
 				struct appleib_hid_dev_info *dev_info)
 {
-	struct appleib_hid_drv_info *d;
 	int rc = 0;
 
 	if (drv_info->driver->probe)
@@ -140,28 +432,11 @@ static int appleib_probe_driver(struct appleib_hid_drv_info *drv_info,
 	if (rc)
 		return rc;
 
-	d = kmemdup(drv_info, sizeof(*drv_info), GFP_KERNEL);
-	if (!d) {
-		if (drv_info->driver->remove)
-			drv_info->driver->remove(dev_info->device);
-		return -ENOMEM;
-	}
-
-	list_add_tail_rcu(&d->entry, &dev_info->drivers);
-	return 0;
-}
-
-static void appleib_remove_driver_attachments(struct appleib_device *ib_dev,
-					struct appleib_hid_dev_info *dev_info,
-					struct hid_driver *driver)
-{
-	struct appleib_hid_drv_info *drv_info;
-	struct appleib_hid_drv_info *tmp;
+	rc = appleib_update_dispatch(ib_dev, dev_info, drv_info, NULL);
+	if (rc && drv_info->driver->remove)
+		drv_info->driver->remove(dev_info->device);
 
-	list_for_each_entry_safe(drv_info, tmp, &dev_info->drivers, entry) {
-		if (!driver || drv_info->driver == driver)
-			appleib_remove_driver(ib_dev, drv_info, dev_info);
-	}
+	return rc;
 }
 
 static void appleib_detach_devices(struct appleib_device *ib_dev,
@@ -169,19 +444,44 @@ static void appleib_detach_devices(struct appleib_device *ib_dev,
 {
 	struct appleib_hid_dev_info *dev_info;
 
-	list_for_each_entry(dev_info, &ib_dev->hid_devices, entry)
-		appleib_remove_driver_attachments(ib_dev, dev_info, driver);
+	list_for_each_entry(dev_info, &ib_dev->hid_devices, entry) {
+		if (appleib_is_attached(appleib_get_dispatch(ib_dev, dev_info),
+					driver))
+			appleib_remove_driver(ib_dev, driver, dev_info);
+	}
 }
 
 static void appleib_remove_device(struct appleib_device *ib_dev,
 				  struct appleib_hid_dev_info *dev_info)
 {
+	struct appleib_hid_dispatch *disp = appleib_get_dispatch(ib_dev,
+								 dev_info);
+	unsigned int i;
+
+	/*
+	 * The hid core stops calling ->event and ->report once the events
+	 * are stopped, but the other callbacks reach the table through the
+	 * hid drvdata, not the device list. So the table is unpublished
+	 * along with the list entry, and after one grace period no reader
+	 * holds either; the attached drivers are then torn down together,
+	 * keeping the remove half of a T1 re-enumeration to a single SRCU
+	 * wait.
+	 */
+	WARN_ON(dev_info->started);
+
+	RCU_INIT_POINTER(dev_info->dispatch, NULL);
 	list_del_rcu(&dev_info->entry);
+	dev_info->listed = false;
 	synchronize_srcu(&ib_dev->lists_srcu);
 
-	appleib_remove_driver_attachments(ib_dev, dev_info, NULL);
+	for (i = 0; disp && i < disp->num_attached; i++) {
+		if (disp->attach[i].driver->remove)
+			disp->attach[i].driver->remove(dev_info->device);
+	}
 
-	kfree(dev_info);
+	kfree(disp);
+	kfree(dev_info->spare);
+	dev_info->spare = NULL;
 }
 
 void appleib_detach_and_free_hid_driver(struct appleib_device *ib_dev,
@@ -190,6 +490,9 @@ void appleib_detach_and_free_hid_driver(struct appleib_device *ib_dev,
 	appleib_detach_devices(ib_dev, drv_info->driver);
 	list_del_rcu(&drv_info->entry);
 	synchronize_srcu(&ib_dev->lists_srcu);
+	appleib_put_static_call(drv_info->static_cell);
+	if (drv_info->cell != APPLEIB_CELL_NONE)
+		ib_dev->cell_owner[drv_info->cell] = NULL;
 	kfree(drv_info);
 }
 
@@ -222,12 +525,55 @@ int appleib_unregister_hid_driver(struct appleib_device *ib_dev,
 }
 EXPORT_SYMBOL_GPL(appleib_unregister_hid_driver);
 
+static bool appleib_has_keys(struct hid_device *hdev)
+{
+	struct hid_report_enum *report_enum =
+		&hdev->report_enum[HID_INPUT_REPORT];
+	struct hid_report *report;
+	unsigned int i;
+
+	list_for_each_entry(report, &report_enum->report_list, list) {
+		for (i = 0; i < report->maxfield; i++) {
+			switch (report->field[i]->application) {
+			case HID_GD_KEYBOARD:
+			case HID_CP_CONSUMER_CONTROL:
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Only the touch bar keys need hid-input, the digitizer and sensor
+ * reports are consumed by the cells through ->event and by userspace
+ * through hidraw, and nothing uses hiddev. Every consumer attached costs
+ * per-report work and a device node, so attach just those. The driver
+ * claim keeps reports flowing to ->event on interfaces hidraw alone
+ * would otherwise keep to itself.
+ */
+static unsigned int appleib_connect_mask_for(struct hid_device *hdev)
+{
+	unsigned int mask = HID_CONNECT_HIDRAW;
+
+	if (appleib_connect_mask)
+		mask = appleib_connect_mask;
+	else if (appleib_has_keys(hdev))
+		mask |= HID_CONNECT_HIDINPUT;
+
+	return mask | HID_CONNECT_DRIVER;
+}
+
 static int appleib_start_hid_events(struct appleib_hid_dev_info *dev_info)
 {
 	struct hid_device *hdev = dev_info->device;
+	unsigned int connect_mask = appleib_connect_mask_for(hdev);
 	int rc;
 
-	rc = hid_connect(hdev, HID_CONNECT_DEFAULT);
+	hid_dbg(hdev, "ib: connecting with mask %#x\n", connect_mask);
+
+	rc = hid_connect(hdev, connect_mask);
 	if (rc) {
 		hid_err(hdev, "ib: hid connect failed (%d)\n", rc);
 		return rc;
@@ -254,15 +600,27 @@ static void appleib_stop_hid_events(struct appleib_hid_dev_info *dev_info)
 	}
 }
 
+/**
+ * appleib_register_hid_driver() - attach a hid driver to the interfaces
+ * @ib_dev: the iBridge
+ * @driver: the hid driver
+ * @cell: the cell @driver implements, or APPLEIB_CELL_NONE
+ * @data: returned by appleib_get_drvdata() and appleib_hid_get_drvdata()
+ *
+ * Each cell can be registered once per iBridge; its events are delivered
+ * through a static call. Returns -EBUSY if @cell is already registered.
+ */
 int appleib_register_hid_driver(struct appleib_device *ib_dev,
-				struct hid_driver *driver, void *data)
+				struct hid_driver *driver,
+				enum appleib_cell cell, void *data)
 {
 	struct appleib_hid_drv_info *drv_info;
 	struct appleib_hid_dev_info *dev_info;
 	struct appleib_hid_dev_info *tmp;
 	int rc;
 
-	if (!driver->probe)
+	if (!driver->probe || cell < APPLEIB_CELL_NONE ||
+	    cell >= APPLEIB_NUM_CELLS)
 		return -EINVAL;
 
 	drv_info = kzalloc(sizeof(*drv_info), GFP_KERNEL);
@@ -274,12 +632,25 @@ int appleib_register_hid_driver(struct appleib_device *ib_dev,
 
 	mutex_lock(&ib_dev->update_lock);
 
+	if (cell != APPLEIB_CELL_NONE) {
+		if (ib_dev->cell_owner[cell]) {
+			mutex_unlock(&ib_dev->update_lock);
+			kfree(drv_info);
+			return -EBUSY;
+		}
+
+		ib_dev->cell_owner[cell] = driver;
+	}
+
+	drv_info->cell = cell;
+	drv_info->static_cell = appleib_get_static_call(cell, driver);
+
 	list_add_tail_rcu(&drv_info->entry, &ib_dev->hid_drivers);
 
 	list_for_each_entry_safe(dev_info, tmp, &ib_dev->hid_devices, entry) {
 		appleib_stop_hid_events(dev_info);
 
-		appleib_probe_driver(drv_info, dev_info);
+		appleib_probe_driver(ib_dev, drv_info, dev_info);
 
 		rc = appleib_start_hid_events(dev_info);
 		if (rc)
@@ -316,30 +687,39 @@ void *appleib_get_drvdata(struct appleib_device *ib_dev,
 }
 EXPORT_SYMBOL_GPL(appleib_get_drvdata);
 
+/*
+ * The hid drvdata of an iBridge interface belongs to this driver; the
+ * cells look up their own data through the hid device with this.
+ */
+void *appleib_hid_get_drvdata(struct hid_device *hdev,
+			      struct hid_driver *driver)
+{
+	struct appleib_hid_dev_info *dev_info = hid_get_drvdata(hdev);
+
+	return appleib_get_drvdata(dev_info->ib_dev, driver);
+}
+EXPORT_SYMBOL_GPL(appleib_hid_get_drvdata);
+
 static int appleib_forward_int_op(struct hid_device *hdev,
-				  int (*forward)(struct appleib_hid_drv_info *,
+				  int (*forward)(const struct appleib_hid_attach *,
 						 struct hid_device *, void *),
 				  void *args)
 {
-	struct appleib_device *ib_dev = hid_get_drvdata(hdev);
-	struct appleib_hid_dev_info *dev_info;
-	struct appleib_hid_drv_info *drv_info;
+	struct appleib_hid_dev_info *dev_info = hid_get_drvdata(hdev);
+	struct appleib_device *ib_dev = dev_info->ib_dev;
+	struct appleib_hid_dispatch *disp;
+	unsigned int i;
 	int idx;
 	int rc = 0;
 
 	idx = srcu_read_lock(&ib_dev->lists_srcu);
 
-	list_for_each_entry_rcu(dev_info, &ib_dev->hid_devices, entry) {
-		if (dev_info->device != hdev)
-			continue;
+	disp = srcu_dereference(dev_info->dispatch, &ib_dev->lists_srcu);
 
-		list_for_each_entry_rcu(drv_info, &dev_info->drivers, entry) {
-			rc = forward(drv_info, hdev, args);
-			if (rc)
-				break;
-		}
-
-		break;
+	for (i = 0; disp && i < disp->num_attached; i++) {
+		rc = forward(&disp->attach[i], hdev, args);
+		if (rc)
+			break;
 	}
 
 	srcu_read_unlock(&ib_dev->lists_srcu, idx);
@@ -347,35 +727,47 @@ static int appleib_forward_int_op(struct hid_device *hdev,
 	return rc;
 }
 
-struct appleib_hid_event_args {
-	struct hid_field *field;
-	struct hid_usage *usage;
-	__s32 value;
-};
-
-static int appleib_hid_event_fwd(struct appleib_hid_drv_info *drv_info,
-				 struct hid_device *hdev, void *args)
+static int appleib_hid_event(struct hid_device *hdev, struct hid_field *field,
+			     struct hid_usage *usage, __s32 value)
 {
-	struct appleib_hid_event_args *evt_args = args;
+	struct appleib_hid_dev_info *dev_info = hid_get_drvdata(hdev);
+	struct appleib_device *ib_dev = dev_info->ib_dev;
+	struct appleib_hid_dispatch *disp;
+	unsigned int i;
+	int idx;
 	int rc = 0;
 
-	if (drv_info->driver->event)
-		rc = drv_info->driver->event(hdev, evt_args->field,
-					     evt_args->usage, evt_args->value);
+	/* open-coded appleib_forward_int_op(), to keep this path direct */
+	idx = srcu_read_lock(&ib_dev->lists_srcu);
+
+	disp = srcu_dereference(dev_info->dispatch, &ib_dev->lists_srcu);
+
+	for (i = 0; disp && i < disp->num_attached; i++) {
+		rc = appleib_call_event(&disp->attach[i], hdev, field, usage,
+					value);
+		if (rc)
+			break;
+	}
+
+	srcu_read_unlock(&ib_dev->lists_srcu, idx);
 
 	return rc;
 }
 
-static int appleib_hid_event(struct hid_device *hdev, struct hid_field *field,
-			     struct hid_usage *usage, __s32 value)
+static int appleib_hid_report_fwd(const struct appleib_hid_attach *attach,
+				  struct hid_device *hdev, void *args)
 {
-	struct appleib_hid_event_args args = {
-		.field = field,
-		.usage = usage,
-		.value = value,
-	};
+	if (attach->driver->report)
+		attach->driver->report(hdev, args);
 
-	return appleib_forward_int_op(hdev, appleib_hid_event_fwd, &args);
+	return 0;
+}
+
+/* once per report, after the ->event calls for all its usages */
+static void appleib_hid_report(struct hid_device *hdev,
+			       struct hid_report *report)
+{
+	appleib_forward_int_op(hdev, appleib_hid_report_fwd, report);
 }
 
 static __u8 *appleib_report_fixup(struct hid_device *hdev, __u8 *rdesc,
@@ -412,14 +804,15 @@ static __u8 *appleib_report_fixup(struct hid_device *hdev, __u8 *rdesc,
 	return rdesc;
 }
 
-static int appleib_input_configured_fwd(struct appleib_hid_drv_info *drv_info,
-					struct hid_device *hdev, void *args)
+static int
+appleib_input_configured_fwd(const struct appleib_hid_attach *attach,
+			     struct hid_device *hdev, void *args)
 {
 	struct hid_input *inp = args;
 	int rc = 0;
 
-	if (drv_info->driver->input_configured)
-		rc = drv_info->driver->input_configured(hdev, inp);
+	if (attach->driver->input_configured)
+		rc = attach->driver->input_configured(hdev, inp);
 
 	return rc;
 }
@@ -432,13 +825,13 @@ static int appleib_input_configured(struct hid_device *hdev,
 }
 
 #ifdef CONFIG_PM
-static int appleib_hid_suspend_fwd(struct appleib_hid_drv_info *drv_info,
+static int appleib_hid_suspend_fwd(const struct appleib_hid_attach *attach,
 				   struct hid_device *hdev, void *args)
 {
 	int rc = 0;
 
-	if (drv_info->driver->suspend)
-		rc = drv_info->driver->suspend(hdev, *(pm_message_t *)args);
+	if (attach->driver->suspend)
+		rc = attach->driver->suspend(hdev, *(pm_message_t *)args);
 
 	return rc;
 }
@@ -448,13 +841,13 @@ static int appleib_hid_suspend(struct hid_device *hdev, pm_message_t message)
 	return appleib_forward_int_op(hdev, appleib_hid_suspend_fwd, &message);
 }
 
-static int appleib_hid_resume_fwd(struct appleib_hid_drv_info *drv_info,
+static int appleib_hid_resume_fwd(const struct appleib_hid_attach *attach,
 				  struct hid_device *hdev, void *args)
 {
 	int rc = 0;
 
-	if (drv_info->driver->resume)
-		rc = drv_info->driver->resume(hdev);
+	if (attach->driver->resume)
+		rc = attach->driver->resume(hdev);
 
 	return rc;
 }
@@ -464,13 +857,14 @@ static int appleib_hid_resume(struct hid_device *hdev)
 	return appleib_forward_int_op(hdev, appleib_hid_resume_fwd, NULL);
 }
 
-static int appleib_hid_reset_resume_fwd(struct appleib_hid_drv_info *drv_info,
-					struct hid_device *hdev, void *args)
+static int
+appleib_hid_reset_resume_fwd(const struct appleib_hid_attach *attach,
+			     struct hid_device *hdev, void *args)
 {
 	int rc = 0;
 
-	if (drv_info->driver->reset_resume)
-		rc = drv_info->driver->reset_resume(hdev);
+	if (attach->driver->reset_resume)
+		rc = attach->driver->reset_resume(hdev);
 
 	return rc;
 }
@@ -479,7 +873,121 @@ static int appleib_hid_reset_resume(struct hid_device *hdev)
 {
 	return appleib_forward_int_op(hdev, appleib_hid_reset_resume_fwd, NULL);
 }
+
+/*
+ * For the cells a USB reset of the T1 is a suspend followed by a
+ * reset-resume: they quiesce before it, and replay their cached state
+ * into the device after it. usbhid keeps the hid devices bound across the
+ * reset as long as the report descriptors do not change, so the cells
+ * keep their state and nothing is re-parsed or re-probed.
+ */
+static void appleib_forward_reset(struct appleib_device *ib_dev, bool pre)
+{
+	pm_message_t message = PMSG_SUSPEND;
+	struct appleib_hid_dev_info *dev_info;
+
+	list_for_each_entry(dev_info, &ib_dev->hid_devices, entry) {
+		if (pre)
+			appleib_forward_int_op(dev_info->device,
+					       appleib_hid_suspend_fwd,
+					       &message);
+		else
+			appleib_forward_int_op(dev_info->device,
+					       appleib_hid_reset_resume_fwd,
+					       NULL);
+	}
+}
+
+static void appleib_reset_work(struct work_struct *work)
+{
+	struct appleib_device *ib_dev =
+		container_of(work, struct appleib_device, reset_work);
+	struct appleib_hid_dev_info *dev_info;
+	struct usb_device *udev;
+	ktime_t start = ktime_get(), end;
+	int rc;
+
+	mutex_lock(&ib_dev->update_lock);
+
+	dev_info = list_first_entry_or_null(&ib_dev->hid_devices,
+					    struct appleib_hid_dev_info, entry);
+	if (!dev_info) {
+		mutex_unlock(&ib_dev->update_lock);
+		return;
+	}
+
+	udev = usb_get_dev(hid_to_usb_dev(dev_info->device));
+	appleib_forward_reset(ib_dev, true);
+
+	mutex_unlock(&ib_dev->update_lock);
+
+	/*
+	 * Not under update_lock: should the descriptors have changed, the
+	 * usb core unbinds and re-probes the interfaces from within the
+	 * reset, and that path takes the lock itself.
+	 */
+	rc = usb_lock_device_for_reset(udev, NULL);
+	if (!rc) {
+		rc = usb_reset_device(udev);
+		usb_unlock_device(udev);
+	}
+	usb_put_dev(udev);
+
+	mutex_lock(&ib_dev->update_lock);
+	appleib_forward_reset(ib_dev, false);
+	mutex_unlock(&ib_dev->update_lock);
+
+	end = ktime_get();
+	spin_lock(&ib_dev->reset_lock);
+	ib_dev->last_reset = end;
+	spin_unlock(&ib_dev->reset_lock);
+
+	if (rc)
+		dev_err(LOG_DEV(ib_dev), "Error resetting iBridge: %d\n", rc);
+	else
+		dev_notice(LOG_DEV(ib_dev),
+			   "iBridge reset, recovered in %lld us\n",
+			   ktime_us_delta(end, start));
+}
+
+/**
+ * appleib_reset_device() - reset an iBridge that stopped responding
+ * @hdev: any hid device of the iBridge
+ *
+ * Resets the T1 asynchronously while keeping the cells bound; see
+ * appleib_forward_reset(). Requests within APPLEIB_RESET_INTERVAL_MS of
+ * the last reset are ignored, so a chip that stays dead is not reset in
+ * a loop, and so are requests while a reset is under way.
+ *
+ * Not under update_lock: the cells call this from work that their
+ * suspend, and hence the reset work holding update_lock, waits for.
+ */
+void appleib_reset_device(struct hid_device *hdev)
+{
+	struct appleib_hid_dev_info *dev_info = hid_get_drvdata(hdev);
+	struct appleib_device *ib_dev = dev_info->ib_dev;
+	ktime_t now = ktime_get();
+
+	spin_lock(&ib_dev->reset_lock);
+
+	if (!ib_dev->removing &&
+	    (!ib_dev->last_reset ||
+	     ktime_ms_delta(now, ib_dev->last_reset) >=
+						APPLEIB_RESET_INTERVAL_MS)) {
+		/* claim the interval now, the work restarts it when done */
+		ib_dev->last_reset = now;
+		schedule_work(&ib_dev->reset_work);
+	}
+
+	spin_unlock(&ib_dev->reset_lock);
+}
+#else
+void appleib_reset_device(struct hid_device *hdev)
+{
+	usb_queue_reset_device(to_usb_interface(hdev->dev.parent));
+}
 #endif /* CONFIG_PM */
+EXPORT_SYMBOL_GPL(appleib_reset_device);
 
 struct hid_field *appleib_find_report_field(struct hid_report *report,
 					    unsigned int field_usage)
@@ -538,37 +1046,26 @@ bool appleib_needs_io_start(struct appleib_device *ib_dev,
 }
 EXPORT_SYMBOL_GPL(appleib_needs_io_start);
 
-static struct appleib_hid_dev_info *
-appleib_add_device(struct appleib_device *ib_dev, struct hid_device *hdev,
-		   const struct hid_device_id *id)
+static void appleib_add_device(struct appleib_device *ib_dev,
+			       struct appleib_hid_dev_info *dev_info)
 {
-	struct appleib_hid_dev_info *dev_info;
+	struct hid_device *hdev = dev_info->device;
 	struct appleib_hid_drv_info *drv_info;
 
-	dev_info = kzalloc(sizeof(*dev_info), GFP_KERNEL);
-	if (!dev_info)
-		return NULL;
-
-	INIT_LIST_HEAD(&dev_info->drivers);
-
-	dev_info->device = hdev;
-	dev_info->device_id = id;
-
 	mutex_lock(&ib_dev->update_lock);
 
 	smp_store_release(&ib_dev->needs_io_start, hdev);
 
 	list_for_each_entry(drv_info, &ib_dev->hid_drivers, entry) {
-		appleib_probe_driver(drv_info, dev_info);
+		appleib_probe_driver(ib_dev, drv_info, dev_info);
 	}
 
 	smp_store_release(&ib_dev->needs_io_start, NULL);
 
 	list_add_tail_rcu(&dev_info->entry, &ib_dev->hid_devices);
+	dev_info->listed = true;
 
 	mutex_unlock(&ib_dev->update_lock);
-
-	return dev_info;
 }
 
 static int appleib_hid_probe(struct hid_device *hdev,
@@ -587,7 +1084,15 @@ static int appleib_hid_probe(struct hid_device *hdev,
 	}
 
 	ib_dev = (void *)id->driver_data;
-	hid_set_drvdata(hdev, ib_dev);
+
+	dev_info = kzalloc(sizeof(*dev_info), GFP_KERNEL);
+	if (!dev_info)
+		return -ENOMEM;
+
+	dev_info->ib_dev = ib_dev;
+	dev_info->device = hdev;
+	dev_info->device_id = id;
+	hid_set_drvdata(hdev, dev_info);
 
 	rc = hid_parse(hdev);
 	if (rc) {
@@ -601,47 +1106,50 @@ static int appleib_hid_probe(struct hid_device *hdev,
 		goto error;
 	}
 
-	dev_info = appleib_add_device(ib_dev, hdev, id);
-	if (!dev_info) {
-		rc = -ENOMEM;
-		goto stop_hw;
-	}
+	appleib_add_device(ib_dev, dev_info);
 
 	rc = appleib_start_hid_events(dev_info);
 	if (rc)
 		goto remove_device;
 
+	if (ib_dev->last_detach)
+		hid_dbg(hdev, "ib: re-attached %lld us after detach\n",
+			ktime_us_delta(ktime_get(), ib_dev->last_detach));
+
 	return 0;
 
 remove_device:
+	mutex_lock(&ib_dev->update_lock);
 	appleib_remove_device(ib_dev, dev_info);
-stop_hw:
+	mutex_unlock(&ib_dev->update_lock);
 	hid_hw_stop(hdev);
 error:
+	kfree(dev_info);
 	return rc;
 }
 
 static void appleib_hid_remove(struct hid_device *hdev)
 {
-	struct appleib_device *ib_dev = hid_get_drvdata(hdev);
-	struct appleib_hid_dev_info *dev_info;
-	struct appleib_hid_dev_info *tmp;
+	struct appleib_hid_dev_info *dev_info = hid_get_drvdata(hdev);
+	struct appleib_device *ib_dev = dev_info->ib_dev;
 
 	mutex_lock(&ib_dev->update_lock);
 
-	list_for_each_entry_safe(dev_info, tmp, &ib_dev->hid_devices, entry) {
-		if (dev_info->device == hdev) {
-			appleib_stop_hid_events(dev_info);
-			appleib_remove_device(ib_dev, dev_info);
-			break;
-		}
+	/* a failed restart in appleib_register_hid_driver() may have done it */
+	if (dev_info->listed) {
+		appleib_stop_hid_events(dev_info);
+		appleib_remove_device(ib_dev, dev_info);
 	}
 
 	smp_store_release(&ib_dev->needs_io_start, NULL);
 
+	ib_dev->last_detach = ktime_get();
+
 	mutex_unlock(&ib_dev->update_lock);
 
 	hid_hw_stop(hdev);
+
+	kfree(dev_info);
 }
 
 static const struct hid_driver appleib_hid_driver = {
@@ -650,6 +1158,7 @@ static const struct hid_driver appleib_hid_driver = {
 	.probe = appleib_hid_probe,
 	.remove = appleib_hid_remove,
 	.event = appleib_hid_event,
+	.report = appleib_hid_report,
 	.report_fixup = appleib_report_fixup,
 	.input_configured = appleib_input_configured,
 #ifdef CONFIG_PM
@@ -659,6 +1168,20 @@ static const struct hid_driver appleib_hid_driver = {
 #endif
 };
 
+static void appleib_set_socw(struct appleib_device *ib_dev, int state)
+{
+	acpi_status sts;
+
+	sts = acpi_execute_simple_method(ib_dev->asoc_socw, NULL, state);
+	if (ACPI_FAILURE(sts)) {
+		dev_warn(LOG_DEV(ib_dev), "SOCW(%d) failed: %s\n", state,
+			 acpi_format_exception(sts));
+		return;
+	}
+
+	ib_dev->socw_state = state;
+}
+
 static struct appleib_device *appleib_alloc_device(struct acpi_device *acpi_dev)
 {
 	struct appleib_device *ib_dev;
@@ -672,6 +1195,10 @@ static struct appleib_device *appleib_alloc_device(struct acpi_device *acpi_dev)
 	INIT_LIST_HEAD(&ib_dev->hid_devices);
 	mutex_init(&ib_dev->update_lock);
 	init_srcu_struct(&ib_dev->lists_srcu);
+#ifdef CONFIG_PM
+	INIT_WORK(&ib_dev->reset_work, appleib_reset_work);
+	spin_lock_init(&ib_dev->reset_lock);
+#endif
 
 	ib_dev->acpi_dev = acpi_dev;
 
@@ -683,10 +1210,7 @@ static struct appleib_device *appleib_alloc_device(struct acpi_device *acpi_dev)
 		return ERR_PTR(-ENXIO);
 	}
 
-	sts = acpi_execute_simple_method(ib_dev->asoc_socw, NULL, 1);
-	if (ACPI_FAILURE(sts))
-		dev_warn(LOG_DEV(ib_dev), "SOCW(1) failed: %s\n",
-			 acpi_format_exception(sts));
+	appleib_set_socw(ib_dev, 1);
 
 	return ib_dev;
 }
@@ -746,7 +1270,23 @@ static int appleib_remove(struct acpi_device *acpi)
 {
 	struct appleib_device *ib_dev = acpi_driver_data(acpi);
 
+#ifdef CONFIG_PM
+	/*
+	 * The cells are devm children and outlive this function, so stop
+	 * them queuing resets before tearing down the interfaces, and
+	 * cancel the last one only once no cell can reach an interface.
+	 */
+	spin_lock(&ib_dev->reset_lock);
+	ib_dev->removing = true;
+	spin_unlock(&ib_dev->reset_lock);
+#endif
 	hid_unregister_driver(&ib_dev->ib_driver);
+#ifdef CONFIG_PM
+	cancel_work_sync(&ib_dev->reset_work);
+#endif
+
+	/* wait for retired dispatch tables to be freed */
+	srcu_barrier(&ib_dev->lists_srcu);
 
 	return 0;
 }
@@ -754,14 +1294,10 @@ static int appleib_remove(struct acpi_device *acpi)
 static int appleib_suspend(struct device *dev)
 {
 	struct appleib_device *ib_dev;
-	int rc;
 
 	ib_dev = acpi_driver_data(to_acpi_device(dev));
 
-	rc = acpi_execute_simple_method(ib_dev->asoc_socw, NULL, 0);
-	if (ACPI_FAILURE(rc))
-		dev_warn(dev, "SOCW(0) failed: %s\n",
-			 acpi_format_exception(rc));
+	appleib_set_socw(ib_dev, 0);
 
 	return 0;
 }
@@ -769,14 +1305,58 @@ static int appleib_suspend(struct device *dev)
 static int appleib_resume(struct device *dev)
 {
 	struct appleib_device *ib_dev;
-	int rc;
 
 	ib_dev = acpi_driver_data(to_acpi_device(dev));
 
-	rc = acpi_execute_simple_method(ib_dev->asoc_socw, NULL, 1);
-	if (ACPI_FAILURE(rc))
-		dev_warn(dev, "SOCW(1) failed: %s\n",
-			 acpi_format_exception(rc));
+	appleib_set_socw(ib_dev, 1);
+
+	return 0;
+}
+
+/*
+ * The hibernation image is created between freeze and thaw, with the
+ * iBridge still serving the touch bar. freeze only records the SOCW state
+ * the image is taken with; cycling it here would make the subdrivers
+ * re-sync the touch bar twice for a snapshot that may not even be
+ * written. Power is only cut in poweroff, after the image is on disk.
+ */
+static int appleib_freeze(struct device *dev)
+{
+	struct appleib_device *ib_dev;
+
+	ib_dev = acpi_driver_data(to_acpi_device(dev));
+
+	ib_dev->frozen_socw_state = ib_dev->socw_state;
+
+	return 0;
+}
+
+static int appleib_thaw(struct device *dev)
+{
+	struct appleib_device *ib_dev;
+
+	ib_dev = acpi_driver_data(to_acpi_device(dev));
+
+	/* freeze left SOCW alone, so normally there is nothing to do */
+	if (ib_dev->socw_state != ib_dev->frozen_socw_state)
+		appleib_set_socw(ib_dev, ib_dev->frozen_socw_state);
+
+	return 0;
+}
+
+/*
+ * On restore both SOCW fields come from the image, while the hardware
+ * state is whatever the boot kernel or the firmware left behind. Set the
+ * state recorded at freeze once unconditionally; the subdrivers then
+ * replay their cached state from reset_resume.
+ */
+static int appleib_restore(struct device *dev)
+{
+	struct appleib_device *ib_dev;
+
+	ib_dev = acpi_driver_data(to_acpi_device(dev));
+
+	appleib_set_socw(ib_dev, ib_dev->frozen_socw_state);
 
 	return 0;
 }
@@ -784,7 +1364,10 @@ static int appleib_resume(struct device *dev)
 static const struct dev_pm_ops appleib_pm = {
 	.suspend = appleib_suspend,
 	.resume = appleib_resume,
-	.restore = appleib_resume,
+	.freeze = appleib_freeze,
+	.thaw = appleib_thaw,
+	.poweroff = appleib_suspend,
+	.restore = appleib_restore,
 };
 
 static const struct acpi_device_id appleib_acpi_match[] = {
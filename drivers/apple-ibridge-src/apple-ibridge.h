@@ -16,20 +16,32 @@
 
 struct appleib_device;
 
+/* the functions of the iBridge, one mfd cell each */
+enum appleib_cell {
+	APPLEIB_CELL_NONE = -1,
+	APPLEIB_CELL_TB,
+	APPLEIB_CELL_ALS,
+	APPLEIB_NUM_CELLS,
+};
+
 struct appleib_device_data {
 	struct appleib_device *ib_dev;
 	struct device *log_dev;
 };
 
 int appleib_register_hid_driver(struct appleib_device *ib_dev,
-				struct hid_driver *driver, void *data);
+				struct hid_driver *driver,
+				enum appleib_cell cell, void *data);
 int appleib_unregister_hid_driver(struct appleib_device *ib_dev,
 				  struct hid_driver *driver);
 
 void *appleib_get_drvdata(struct appleib_device *ib_dev,
 			  struct hid_driver *driver);
+void *appleib_hid_get_drvdata(struct hid_device *hdev,
+			      struct hid_driver *driver);
 bool appleib_needs_io_start(struct appleib_device *ib_dev,
 			    struct hid_device *hdev);
+void appleib_reset_device(struct hid_device *hdev);
 
 struct hid_field *appleib_find_report_field(struct hid_report *report,
 					    unsigned int field_usage);
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Apple Touch Bar contact assembly
+ *
+ * The touch bar reports each finger as a logical collection holding its
+ * TipSwitch, ContactID, X and Y, in descriptor order. hid-core hands the
+ * fields over one by one, so a contact is complete only once the next
+ * finger's collection starts or the report ends. Keying the flush on
+ * ContactID alone is not enough: TipSwitch comes first in the collection,
+ * and would overwrite the previous finger's tip before it is flushed.
+ *
+ * A contact is complete when a field arrives from another collection, or
+ * a field it already has arrives again, for descriptors that list every
+ * finger in one collection. It has no kernel dependencies, so host tools
+ * can replay field sequences through it.
+ */
+
+#ifndef _APPLE_IB_TB_CONTACT_H
+#define _APPLE_IB_TB_CONTACT_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#endif
+
+#define APPLETB_CONTACT_ID	0
+#define APPLETB_CONTACT_TIP	1
+#define APPLETB_CONTACT_X	2
+#define APPLETB_CONTACT_Y	3
+
+struct appletb_contact {
+	unsigned int	id;
+	int		tip;
+	int		x;
+	int		y;
+};
+
+struct appletb_contact_asm {
+	struct appletb_contact	cur;
+	unsigned int		collection;	/* of the fields in cur */
+	unsigned int		seen;		/* bit n: APPLETB_CONTACT_n */
+};
+
+static inline void appletb_contact_reset(struct appletb_contact_asm *ca)
+{
+	ca->cur.id = 0;
+	ca->cur.tip = 0;
+	ca->cur.x = 0;
+	ca->cur.y = 0;
+	ca->seen = 0;
+}
+
+/*
+ * Complete the contact being assembled into @done, if it has any fields.
+ * Called at the end of each report.
+ */
+static inline bool appletb_contact_end(struct appletb_contact_asm *ca,
+				       struct appletb_contact *done)
+{
+	if (!ca->seen)
+		return false;
+
+	*done = ca->cur;
+	appletb_contact_reset(ca);
+	return true;
+}
+
+/*
+ * Add @field (APPLETB_CONTACT_*) of logical collection @collection. If it
+ * starts a new contact, the previous one is completed into @done first and
+ * true returned.
+ */
+static inline bool appletb_contact_field(struct appletb_contact_asm *ca,
+					 unsigned int collection,
+					 unsigned int field, int value,
+					 struct appletb_contact *done)
+{
+	bool completed = false;
+
+	if (ca->seen && (collection != ca->collection ||
+			 (ca->seen & (1u << field))))
+		completed = appletb_contact_end(ca, done);
+
+	ca->collection = collection;
+	ca->seen |= 1u << field;
+
+	switch (field) {
+	case APPLETB_CONTACT_ID:
+		ca->cur.id = value;
+		break;
+	case APPLETB_CONTACT_TIP:
+		ca->cur.tip = value;
+		break;
+	case APPLETB_CONTACT_X:
+		ca->cur.x = value;
+		break;
+	case APPLETB_CONTACT_Y:
+		ca->cur.y = value;
+		break;
+	}
+
+	return completed;
+}
+
+#endif
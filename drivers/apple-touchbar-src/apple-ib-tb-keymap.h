@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Apple Touch Bar keymap
+ *
+ * The one description of the touch bar keys. apple-ib-tb generates one
+ * key code table per layer from it and reports the codes of the layer
+ * the bar is in; tiny-dfr generates its built-in layout from it. Both
+ * happen at compile time, so the labels drawn by default are those of
+ * the codes sent. A tiny-dfr layout may give the positions other codes,
+ * those of the layers and APPLETB_KEYMAP_EXTRA, loaded into the driver
+ * with APPLETB_IOC_SET_KEYMAP.
+ *
+ * Each layer lists its keys left to right as
+ *
+ *	K(usage, code, label, repeat)
+ *
+ *	usage	keyboard page usage the touch bar reports for the position
+ *	code	input key code the key sends on this layer
+ *	label	what tiny-dfr draws on the key
+ *	repeat	whether holding the key autorepeats
+ *
+ * and is expanded by passing a K of the user's choosing. The includer
+ * provides the KEY_* codes; there are no other dependencies.
+ */
+
+#ifndef _APPLE_IB_TB_KEYMAP_H
+#define _APPLE_IB_TB_KEYMAP_H
+
+#define APPLETB_KEYMAP_USAGE_ESC	0x29
+#define APPLETB_KEYMAP_USAGE_F1		0x3a
+
+/* Usages the touch bar reports: ESC, F1-F12 */
+#define APPLETB_KEYMAP_MAX_KEYS		13
+
+/* Dense index of a usage, for tables and key bitmaps: F1-F12, then ESC */
+#define APPLETB_KEYMAP_SLOT(usage)					\
+	((usage) == APPLETB_KEYMAP_USAGE_ESC ?				\
+	 APPLETB_KEYMAP_MAX_KEYS - 1 : (usage) - APPLETB_KEYMAP_USAGE_F1)
+
+/* Shown while Fn is held in normal mode, or always in fkeys mode */
+#define APPLETB_KEYMAP_FKEYS(K)						\
+	K(0x29, KEY_ESC,		"esc",		0)		\
+	K(0x3a, KEY_F1,			"F1",		1)		\
+	K(0x3b, KEY_F2,			"F2",		1)		\
+	K(0x3c, KEY_F3,			"F3",		1)		\
+	K(0x3d, KEY_F4,			"F4",		1)		\
+	K(0x3e, KEY_F5,			"F5",		1)		\
+	K(0x3f, KEY_F6,			"F6",		1)		\
+	K(0x40, KEY_F7,			"F7",		1)		\
+	K(0x41, KEY_F8,			"F8",		1)		\
+	K(0x42, KEY_F9,			"F9",		1)		\
+	K(0x43, KEY_F10,		"F10",		1)		\
+	K(0x44, KEY_F11,		"F11",		1)		\
+	K(0x45, KEY_F12,		"F12",		1)
+
+/*
+ * The media and brightness keys, where the F-row of Apple keyboards has
+ * them. Only the keys stepping a level repeat; repeating mute or play
+ * would toggle. Every code appears once, so a code also identifies its
+ * position.
+ */
+#define APPLETB_KEYMAP_SPECIAL(K)					\
+	K(0x29, KEY_ESC,		"esc",		0)		\
+	K(0x3a, KEY_BRIGHTNESSDOWN,	"bri-",		1)		\
+	K(0x3b, KEY_BRIGHTNESSUP,	"bri+",		1)		\
+	K(0x3c, KEY_SCALE,		"scale",	0)		\
+	K(0x3d, KEY_DASHBOARD,		"dash",		0)		\
+	K(0x3e, KEY_KBDILLUMDOWN,	"kbd-",		1)		\
+	K(0x3f, KEY_KBDILLUMUP,		"kbd+",		1)		\
+	K(0x40, KEY_PREVIOUSSONG,	"prev",		0)		\
+	K(0x41, KEY_PLAYPAUSE,		"play",		0)		\
+	K(0x42, KEY_NEXTSONG,		"next",		0)		\
+	K(0x43, KEY_MUTE,		"mute",		0)		\
+	K(0x44, KEY_VOLUMEDOWN,		"vol-",		1)		\
+	K(0x45, KEY_VOLUMEUP,		"vol+",		1)
+
+/*
+ * Further codes a layout may give a position, as
+ *
+ *	C(code, repeat)
+ *
+ * apple-ib-tb advertises them along with those of the layers, and
+ * tiny-dfr accepts their names (KEY_ dropped) in its configuration.
+ */
+#define APPLETB_KEYMAP_EXTRA(C)						\
+	C(KEY_F13, 1)	C(KEY_F14, 1)	C(KEY_F15, 1)	C(KEY_F16, 1)	\
+	C(KEY_F17, 1)	C(KEY_F18, 1)	C(KEY_F19, 1)	C(KEY_F20, 1)	\
+	C(KEY_F21, 1)	C(KEY_F22, 1)	C(KEY_F23, 1)	C(KEY_F24, 1)	\
+	C(KEY_KBDILLUMTOGGLE, 0)					\
+	C(KEY_STOPCD, 0)						\
+	C(KEY_EJECTCD, 0)						\
+	C(KEY_POWER, 0)							\
+	C(KEY_SLEEP, 0)							\
+	C(KEY_SEARCH, 0)						\
+	C(KEY_MICMUTE, 0)						\
+	C(KEY_PRINT, 0)							\
+	C(KEY_HOME, 0)							\
+	C(KEY_END, 0)							\
+	C(KEY_PAGEUP, 1)						\
+	C(KEY_PAGEDOWN, 1)						\
+	C(KEY_DELETE, 1)						\
+	C(KEY_INSERT, 0)
+
+/* Expands to the number of keys of a layer */
+#define APPLETB_KEYMAP_COUNT_KEY(usage, code, label, repeat)	+ 1
+#define APPLETB_KEYMAP_NKEYS(layer)					\
+	(0 layer(APPLETB_KEYMAP_COUNT_KEY))
+
+#endif
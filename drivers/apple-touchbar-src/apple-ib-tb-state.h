@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Apple Touch Bar mode and dim state machine
+ *
+ * Decides which mode the touch bar should be in and whether its display
+ * is on, dimmed or off, from user activity, the Fn key and the timeouts.
+ * It has no kernel dependencies: time comes from ops->now() and decisions
+ * leave through ops->output() and ops->arm(), so the same code runs in
+ * apple-ib-tb and in host tools replaying activity against a fake clock.
+ *
+ * Callers serialize all calls for one state machine; the callbacks run
+ * under that serialization.
+ *
+ * Timer coalescing: activity only moves last_activity. A deadline already
+ * armed is left alone, it fires early, finds nothing due and is re-armed
+ * for the real deadline, so a stream of touches costs no timer updates.
+ */
+
+#ifndef _APPLE_IB_TB_STATE_H
+#define _APPLE_IB_TB_STATE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#endif
+
+/* must match the APPLETB_FN_MODE_* and APPLETB_CMD_* values of the driver */
+#define APPLETB_SM_FN_MODE_NORM		0
+#define APPLETB_SM_FN_MODE_FKEYS	1
+
+#define APPLETB_SM_MODE_FN		1
+#define APPLETB_SM_MODE_SPCL		2
+#define APPLETB_SM_MODE_OFF		3
+
+#define APPLETB_SM_DISP_ON		1
+#define APPLETB_SM_DISP_DIM		2
+#define APPLETB_SM_DISP_OFF		4
+
+struct appletb_sm_ops {
+	/* monotonic milliseconds, never 0 */
+	unsigned long long	(*now)(void *ctx);
+	/* the touch bar should now be in @mode with display @disp */
+	void			(*output)(void *ctx, unsigned int mode,
+					  unsigned int disp);
+	/* call appletb_sm_timer() at @deadline (ms), or never if 0 */
+	void			(*arm)(void *ctx, unsigned long long deadline);
+};
+
+struct appletb_sm {
+	const struct appletb_sm_ops	*ops;
+	void				*ctx;
+
+	unsigned int		fn_mode;	/* APPLETB_SM_FN_MODE_* */
+	unsigned int		dim_timeout;	/* seconds, 0: never */
+	unsigned int		idle_timeout;	/* seconds, 0: never */
+
+	bool			fn_pressed;
+	unsigned long long	last_activity;
+
+	unsigned int		mode;		/* last output */
+	unsigned int		disp;
+	unsigned long long	deadline;	/* armed, 0: none */
+
+	unsigned long		wakeups;	/* appletb_sm_timer() calls */
+	unsigned long		outputs;	/* ops->output() calls */
+};
+
+static inline unsigned long long
+appletb_sm_ms(unsigned int timeout)
+{
+	return (unsigned long long)timeout * 1000;
+}
+
+static inline unsigned int appletb_sm_disp(struct appletb_sm *sm,
+					   unsigned long long now)
+{
+	unsigned long long idle = now - sm->last_activity;
+
+	if (sm->idle_timeout && idle >= appletb_sm_ms(sm->idle_timeout))
+		return APPLETB_SM_DISP_OFF;
+	if (sm->dim_timeout && idle >= appletb_sm_ms(sm->dim_timeout))
+		return APPLETB_SM_DISP_DIM;
+
+	return APPLETB_SM_DISP_ON;
+}
+
+/* Holding Fn flips to the other set of keys; a dark touch bar has none */
+static inline unsigned int appletb_sm_mode(struct appletb_sm *sm,
+					   unsigned int disp)
+{
+	bool fkeys = (sm->fn_mode == APPLETB_SM_FN_MODE_FKEYS) !=
+		     sm->fn_pressed;
+
+	if (disp == APPLETB_SM_DISP_OFF)
+		return APPLETB_SM_MODE_OFF;
+
+	return fkeys ? APPLETB_SM_MODE_FN : APPLETB_SM_MODE_SPCL;
+}
+
+/* When the display state next changes without activity, or 0 for never */
+static inline unsigned long long appletb_sm_next(struct appletb_sm *sm,
+						 unsigned long long now)
+{
+	unsigned long long idle = now - sm->last_activity;
+	unsigned long long next = 0;
+	unsigned int timeouts[] = { sm->dim_timeout, sm->idle_timeout };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++) {
+		unsigned long long at = appletb_sm_ms(timeouts[i]);
+
+		if (!timeouts[i] || at <= idle)
+			continue;
+		if (!next || sm->last_activity + at < next)
+			next = sm->last_activity + at;
+	}
+
+	return next;
+}
+
+/*
+ * Re-evaluate everything. With @rearm the armed deadline is replaced,
+ * otherwise it is only moved earlier, see the coalescing note above.
+ */
+static inline void appletb_sm_update(struct appletb_sm *sm, bool rearm)
+{
+	unsigned long long now = sm->ops->now(sm->ctx);
+	unsigned int disp = appletb_sm_disp(sm, now);
+	unsigned int mode = appletb_sm_mode(sm, disp);
+	unsigned long long next = appletb_sm_next(sm, now);
+
+	if (mode != sm->mode || disp != sm->disp) {
+		sm->mode = mode;
+		sm->disp = disp;
+		sm->outputs++;
+		sm->ops->output(sm->ctx, mode, disp);
+	}
+
+	if (next == sm->deadline)
+		return;
+
+	if (rearm || !sm->deadline || (next && next < sm->deadline)) {
+		sm->deadline = next;
+		sm->ops->arm(sm->ctx, next);
+	}
+}
+
+/* Start out on, as if the user had just been active; outputs nothing */
+static inline void appletb_sm_init(struct appletb_sm *sm,
+				   const struct appletb_sm_ops *ops, void *ctx,
+				   unsigned int fn_mode,
+				   unsigned int dim_timeout,
+				   unsigned int idle_timeout)
+{
+	*sm = (struct appletb_sm){
+		.ops = ops,
+		.ctx = ctx,
+		.fn_mode = fn_mode,
+		.dim_timeout = dim_timeout,
+		.idle_timeout = idle_timeout,
+		.last_activity = ops->now(ctx),
+	};
+
+	sm->disp = APPLETB_SM_DISP_ON;
+	sm->mode = appletb_sm_mode(sm, sm->disp);
+}
+
+/* The user touched the touch bar or pressed a key */
+static inline void appletb_sm_activity(struct appletb_sm *sm)
+{
+	sm->last_activity = sm->ops->now(sm->ctx);
+
+	/* on and armed is the common case: nothing can change */
+	if (sm->disp == APPLETB_SM_DISP_ON && sm->deadline)
+		return;
+
+	appletb_sm_update(sm, false);
+}
+
+static inline void appletb_sm_fn_key(struct appletb_sm *sm, bool pressed)
+{
+	sm->fn_pressed = pressed;
+	sm->last_activity = sm->ops->now(sm->ctx);
+	appletb_sm_update(sm, false);
+}
+
+static inline void appletb_sm_set_fn_mode(struct appletb_sm *sm,
+					  unsigned int fn_mode)
+{
+	sm->fn_mode = fn_mode;
+	appletb_sm_update(sm, false);
+}
+
+static inline void appletb_sm_set_timeouts(struct appletb_sm *sm,
+					   unsigned int dim_timeout,
+					   unsigned int idle_timeout)
+{
+	sm->dim_timeout = dim_timeout;
+	sm->idle_timeout = idle_timeout;
+	appletb_sm_update(sm, true);
+}
+
+/*
+ * Start over as if the user had just been active, forgetting the armed
+ * deadline; for when the timer was dropped, e.g. across suspend.
+ */
+static inline void appletb_sm_restart(struct appletb_sm *sm)
+{
+	sm->deadline = 0;
+	sm->last_activity = sm->ops->now(sm->ctx);
+	appletb_sm_update(sm, true);
+}
+
+/* The armed deadline passed (or the timer fired early, which is fine) */
+static inline void appletb_sm_timer(struct appletb_sm *sm)
+{
+	sm->wakeups++;
+	sm->deadline = 0;
+	appletb_sm_update(sm, true);
+}
+
+#endif
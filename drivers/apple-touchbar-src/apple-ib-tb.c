@@ -7,105 +7,1273 @@
 
 #define dev_fmt(fmt) "tb: " fmt
 
+#include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/eventfd.h>
+#include <linux/fs.h>
 #include <linux/hid.h>
+#include <linux/hrtimer.h>
 #include <linux/input.h>
+#include <linux/input/mt.h>
 #include <linux/jiffies.h>
+#include <linux/kref.h>
 #include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/sysfs.h>
+#include <linux/uaccess.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 
 #include "apple-ibridge/apple-ibridge.h"
+#include "apple-ib-tb.h"
+#include "apple-ib-tb-contact.h"
+#include "apple-ib-tb-keymap.h"
+#include "apple-ib-tb-state.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define appletb_eventfd_signal(ctx)	eventfd_signal(ctx)
+#else
+#define appletb_eventfd_signal(ctx)	eventfd_signal(ctx, 1)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+#define appletb_hrtimer_setup(timer, fn, clock, mode) \
+	hrtimer_setup(timer, fn, clock, mode)
+#else
+#define appletb_hrtimer_setup(timer, fn, clock, mode) \
+	do { \
+		hrtimer_init(timer, clock, mode); \
+		(timer)->function = fn; \
+	} while (0)
+#endif
+
+#define HID_UP_APPLE		0xff120000
+#define HID_USAGE_MODE		(HID_UP_CUSTOM | 0x0004)
+#define HID_USAGE_APPLE_APP	(HID_UP_APPLE  | 0x0001)
+#define HID_USAGE_DISP		(HID_UP_APPLE  | 0x0021)
+
+#define APPLETB_MAX_TB_KEYS	APPLETB_KEYMAP_MAX_KEYS	/* ESC, F1-F12 */
+#define APPLETB_MAX_CONTACTS	10
+#define APPLETB_MAX_IFACES	2	/* hid interfaces of the iBridge */
+
+#define APPLETB_DEVID_KEYBOARD	0x01
+#define APPLETB_DEVID_TOUCHPAD	0x02
+#define APPLETB_DEVID_TOUCHBAR	0x03
+
+#define APPLETB_FN_MODE_NORM	0
+#define APPLETB_FN_MODE_FKEYS	1
+#define APPLETB_FN_MODE_MAX	APPLETB_FN_MODE_FKEYS
+
+#define APPLETB_CMD_MODE_ESC	0
+#define APPLETB_CMD_MODE_FN	1
+#define APPLETB_CMD_MODE_SPCL	2
+#define APPLETB_CMD_MODE_OFF	3
+
+#define APPLETB_CMD_DISP_ON	1
+#define APPLETB_CMD_DISP_DIM	2
+#define APPLETB_CMD_DISP_OFF	4
+
+static unsigned int appletb_tb_def_fn_mode = APPLETB_FN_MODE_NORM;
+module_param(appletb_tb_def_fn_mode, uint, 0644);
+MODULE_PARM_DESC(appletb_tb_def_fn_mode, "Default Function key mode");
+
+static unsigned int appletb_tb_idle_timeout = 60;
+module_param(appletb_tb_idle_timeout, uint, 0644);
+MODULE_PARM_DESC(appletb_tb_idle_timeout, "Idle timeout in seconds");
+
+static unsigned int appletb_tb_dim_timeout = 5;
+module_param(appletb_tb_dim_timeout, uint, 0644);
+MODULE_PARM_DESC(appletb_tb_dim_timeout, "Dim timeout in seconds");
+
+static unsigned int appletb_tb_repeat_delay = 250;
+module_param(appletb_tb_repeat_delay, uint, 0644);
+MODULE_PARM_DESC(appletb_tb_repeat_delay, "Key repeat delay in milliseconds");
+
+static unsigned int appletb_tb_repeat_period = 33;
+module_param(appletb_tb_repeat_period, uint, 0644);
+MODULE_PARM_DESC(appletb_tb_repeat_period,
+		 "Key repeat period in milliseconds (0: no repeat)");
+
+/* Key tables generated from apple-ib-tb-keymap.h, indexed by slot */
+#define APPLETB_KEY_CODE(usage, code, label, repeat)			\
+	[APPLETB_KEYMAP_SLOT(usage)] = code,
+#define APPLETB_KEY_REPEAT(usage, code, label, repeat)			\
+	| ((repeat) ? BIT(APPLETB_KEYMAP_SLOT(usage)) : 0)
+
+/* What each slot sends per APPLETB_LAYER_*, and the slots that repeat */
+struct appletb_keytable {
+	u16	codes[APPLETB_LAYERS][APPLETB_MAX_TB_KEYS];
+	u16	repeat[APPLETB_LAYERS];
+};
+
+static const struct appletb_keytable appletb_default_keytable = {
+	.codes = {
+		[APPLETB_LAYER_SPECIAL] = {
+			APPLETB_KEYMAP_SPECIAL(APPLETB_KEY_CODE)
+		},
+		[APPLETB_LAYER_FKEYS] = {
+			APPLETB_KEYMAP_FKEYS(APPLETB_KEY_CODE)
+		},
+	},
+	.repeat = {
+		[APPLETB_LAYER_SPECIAL] =
+			0 APPLETB_KEYMAP_SPECIAL(APPLETB_KEY_REPEAT),
+		[APPLETB_LAYER_FKEYS] =
+			0 APPLETB_KEYMAP_FKEYS(APPLETB_KEY_REPEAT),
+	},
+};
+
+/* Slot of each APPLETB_IOC_SET_KEYMAP position, left to right */
+#define APPLETB_KEY_SLOT(usage, code, label, repeat)			\
+	APPLETB_KEYMAP_SLOT(usage),
+
+static const u8 appletb_position_slot[APPLETB_MAX_TB_KEYS] = {
+	APPLETB_KEYMAP_FKEYS(APPLETB_KEY_SLOT)
+};
+
+/* Every code a position may send, and whether it autorepeats */
+#define APPLETB_KEY_ASSIGNABLE(usage, code, label, repeat)		\
+	{ code, repeat },
+#define APPLETB_EXTRA_ASSIGNABLE(code, repeat)				\
+	{ code, repeat },
+
+static const struct appletb_assignable_key {
+	u16	code;
+	bool	repeat;
+} appletb_assignable[] = {
+	APPLETB_KEYMAP_FKEYS(APPLETB_KEY_ASSIGNABLE)
+	APPLETB_KEYMAP_SPECIAL(APPLETB_KEY_ASSIGNABLE)
+	APPLETB_KEYMAP_EXTRA(APPLETB_EXTRA_ASSIGNABLE)
+};
+
+static struct hid_driver appletb_hid_driver;
+
+static const struct input_device_id appletb_input_devices[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_BUS |
+			INPUT_DEVICE_ID_MATCH_KEYBIT,
+		.bustype = BUS_SPI,
+		.keybit = { [BIT_WORD(KEY_FN)] = BIT_MASK(KEY_FN) },
+		.driver_info = APPLETB_DEVID_KEYBOARD,
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_BUS |
+			INPUT_DEVICE_ID_MATCH_KEYBIT,
+		.bustype = BUS_SPI,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.driver_info = APPLETB_DEVID_TOUCHPAD,
+	},
+	{
+		/* narrowed down to kbd_input by appletb_inp_match() */
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+		.driver_info = APPLETB_DEVID_TOUCHBAR,
+	},
+	{ },
+};
+
+struct appletb_device {
+	struct kref		ref;
+	bool			active;
+	struct device		*log_dev;
+
+	struct appletb_report_info {
+		struct hid_device	*hdev;
+		struct usb_interface	*usb_iface;
+		unsigned int		usb_epnum;
+		unsigned int		report_id;
+		unsigned int		report_type;
+		bool			suspended;
+	}			mode_info, disp_info;
+
+	/*
+	 * keyboard and touchpad activity, and the Fn key; and the touch bar
+	 * keys' own device, to learn when it goes away
+	 */
+	struct input_handler	inp_handler;
+	struct input_handle	kbd_handle;
+	struct input_handle	tpd_handle;
+	struct input_handle	tb_handle;
+	bool			inp_registered;
+
+	/* tb_sm decides, tb_work applies; see apple-ib-tb-state.h */
+	spinlock_t		tb_lock;
+	struct appletb_sm	tb_sm;
+	struct delayed_work	tb_idle_work;
+	unsigned int		tb_mode;
+	bool			tb_mode_valid;
+	unsigned int		tb_dim_state;
+	bool			tb_dim_valid;
+	struct delayed_work	tb_work;
+
+	/*
+	 * Decoder state, one per interface: the interfaces deliver their
+	 * reports concurrently. Only touched from the hid event path of its
+	 * hdev, and claimed and released in probe/remove while no events
+	 * flow on that hdev.
+	 */
+	struct appletb_decoder {
+		struct hid_device	*hdev;
+		/* bit n: slot n held, sent as key_code[n] when it went down */
+		u16			key_state;
+		u16			key_code[APPLETB_MAX_TB_KEYS];
+		struct appletb_contact_asm	contact;
+		bool			report_contacts;
+		bool			report_activity;
+	}			decoders[APPLETB_MAX_IFACES];
+
+	/*
+	 * Multitouch surface for the contacts, one frame per report. Created
+	 * and destroyed in probe/remove of mt_hdev, while no events flow.
+	 */
+	struct hid_device	*mt_hdev;
+	struct input_dev	*mt_input;
+
+	/*
+	 * The built-in keymap, or the one the event ring's owner loaded.
+	 * Written under repeat_lock, read locklessly by the event path; a key
+	 * going down during an update is sent with the code of either one.
+	 */
+	struct appletb_keytable	keymap;
+
+	/*
+	 * Autorepeat of held keys, on the input device hid-input created
+	 * for them; one timer serves all keys and is only armed while a
+	 * repeating key is held.
+	 */
+	spinlock_t		repeat_lock;
+	struct hrtimer		repeat_timer;
+	struct hid_device	*kbd_hdev;
+	struct input_dev	*kbd_input;
+	u16			repeat_keys;	/* bit n: slot n repeating */
+	u16			repeat_code[APPLETB_MAX_TB_KEYS];
+	ktime_t			repeat_next[APPLETB_MAX_TB_KEYS];
+	unsigned int		repeat_delay;	/* ms */
+	unsigned int		repeat_period;	/* ms */
+
+	/* /dev/appletb event ring, see apple-ib-tb.h */
+	struct miscdevice	ring_dev;
+	bool			ring_registered;
+	unsigned long		ring_busy;
+	spinlock_t		ring_lock;
+	struct appletb_ring	*ring;
+	u32			ring_head;
+	bool			ring_pending;
+	struct eventfd_ctx	*ring_eventfd;
+};
+
+static int appletb_send_hid_report(struct appletb_report_info *rinfo,
+				   __u8 requesttype, void *data, __u16 size)
+{
+	struct usb_device *udev = interface_to_usbdev(rinfo->usb_iface);
+	u8 ifnum = rinfo->usb_iface->cur_altsetting->desc.bInterfaceNumber;
+	void *buffer;
+	int tries = 0;
+	int rc;
+
+	buffer = kmemdup(data, size, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	do {
+		rc = usb_control_msg(udev,
+				     usb_sndctrlpipe(udev, rinfo->usb_epnum),
+				     HID_REQ_SET_REPORT, requesttype,
+				     rinfo->report_type << 8 | rinfo->report_id,
+				     ifnum, buffer, size, 2000);
+		if (rc != -EPIPE)
+			break;
+
+		usleep_range(1000 << tries, 3000 << tries);
+	} while (++tries < 5);
+
+	kfree(buffer);
+
+	return (rc > 0) ? 0 : rc;
+}
+
+static int appletb_set_tb_mode(struct appletb_device *tb_dev,
+			       unsigned char mode)
+{
+	bool autopm_off;
+	int rc;
+
+	if (!tb_dev->mode_info.usb_iface)
+		return -ENOTCONN;
+
+	autopm_off = !usb_autopm_get_interface(tb_dev->mode_info.usb_iface);
+
+	rc = appletb_send_hid_report(&tb_dev->mode_info,
+				     USB_DIR_OUT | USB_TYPE_VENDOR |
+							USB_RECIP_DEVICE,
+				     &mode, 1);
+	if (rc < 0)
+		dev_err(tb_dev->log_dev,
+			"Failed to set touch bar mode to %u (%d)\n", mode, rc);
+
+	if (autopm_off)
+		usb_autopm_put_interface(tb_dev->mode_info.usb_iface);
+
+	return rc;
+}
+
+static int appletb_set_tb_disp(struct appletb_device *tb_dev,
+			       unsigned char disp)
+{
+	unsigned char report[] = { 0, 0, 0 };
+	bool autopm_off;
+	int rc;
+
+	if (!tb_dev->disp_info.usb_iface)
+		return -ENOTCONN;
+
+	autopm_off = !usb_autopm_get_interface(tb_dev->disp_info.usb_iface);
+
+	report[0] = tb_dev->disp_info.report_id;
+	report[2] = disp;
+
+	rc = appletb_send_hid_report(&tb_dev->disp_info,
+				     USB_DIR_OUT | USB_TYPE_CLASS |
+						USB_RECIP_INTERFACE,
+				     report, sizeof(report));
+	if (rc < 0)
+		dev_err(tb_dev->log_dev,
+			"Failed to set touch bar display to %u (%d)\n", disp,
+			rc);
+
+	if (autopm_off)
+		usb_autopm_put_interface(tb_dev->disp_info.usb_iface);
+
+	return rc;
+}
+
+/*
+ * Push the cached mode and display state to the device, skipping whatever
+ * the device is already known to have. This is the only place that talks
+ * to the touch bar, and it only ever runs from tb_work, so a full replay
+ * (e.g. after resume) is one work item issuing at most two requests.
+ */
+static void appletb_sync_touchbar(struct appletb_device *tb_dev)
+{
+	unsigned int mode, disp;
+	bool send_mode, send_disp;
+	unsigned long flags;
+	int rc = 0;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	mode = tb_dev->tb_mode;
+	disp = tb_dev->tb_dim_state;
+	send_mode = !tb_dev->tb_mode_valid;
+	send_disp = !tb_dev->tb_dim_valid;
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
+	if (send_mode) {
+		rc = appletb_set_tb_mode(tb_dev, mode);
+		if (!rc) {
+			spin_lock_irqsave(&tb_dev->tb_lock, flags);
+			if (tb_dev->tb_mode == mode)
+				tb_dev->tb_mode_valid = true;
+			spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+		}
+	}
+
+	if (send_disp && rc != -ETIMEDOUT) {
+		rc = appletb_set_tb_disp(tb_dev, disp);
+		if (!rc) {
+			spin_lock_irqsave(&tb_dev->tb_lock, flags);
+			if (tb_dev->tb_dim_state == disp)
+				tb_dev->tb_dim_valid = true;
+			spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+		}
+	}
+
+	/*
+	 * The T1 stopped answering control requests: have the iBridge reset
+	 * it. The state stays invalid, and the reset-resume that follows the
+	 * reset replays it.
+	 */
+	if (rc == -ETIMEDOUT)
+		appleib_reset_device(tb_dev->mode_info.hdev);
+}
+
+static void appletb_tb_work(struct work_struct *work)
+{
+	struct appletb_device *tb_dev =
+		container_of(work, struct appletb_device, tb_work.work);
+
+	if (!tb_dev->active)
+		return;
+
+	appletb_sync_touchbar(tb_dev);
+}
+
+static void appletb_invalidate_state(struct appletb_device *tb_dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	tb_dev->tb_mode_valid = false;
+	tb_dev->tb_dim_valid = false;
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+static void appletb_repeat_cancel(struct appletb_device *tb_dev);
+
+/* tb_sm callbacks, all called with tb_lock held */
+static unsigned long long appletb_sm_now(void *ctx)
+{
+	return ktime_to_ms(ktime_get());
+}
+
+static void appletb_sm_output(void *ctx, unsigned int mode, unsigned int disp)
+{
+	struct appletb_device *tb_dev = ctx;
+
+	if (tb_dev->tb_mode != mode) {
+		tb_dev->tb_mode = mode;
+		tb_dev->tb_mode_valid = false;
+	}
+
+	if (tb_dev->tb_dim_state != disp) {
+		tb_dev->tb_dim_state = disp;
+		tb_dev->tb_dim_valid = false;
+	}
+
+	/* what a held key means or whether it can be seen just changed */
+	appletb_repeat_cancel(tb_dev);
+
+	if (tb_dev->active)
+		schedule_delayed_work(&tb_dev->tb_work, 0);
+}
+
+static void appletb_sm_arm(void *ctx, unsigned long long deadline)
+{
+	struct appletb_device *tb_dev = ctx;
+	unsigned long long now = appletb_sm_now(ctx);
+
+	if (!deadline) {
+		cancel_delayed_work(&tb_dev->tb_idle_work);
+		return;
+	}
+
+	mod_delayed_work(system_wq, &tb_dev->tb_idle_work,
+			 deadline > now ? msecs_to_jiffies(deadline - now) : 0);
+}
+
+static const struct appletb_sm_ops appletb_sm_ops = {
+	.now = appletb_sm_now,
+	.output = appletb_sm_output,
+	.arm = appletb_sm_arm,
+};
+
+static void appletb_idle_work(struct work_struct *work)
+{
+	struct appletb_device *tb_dev =
+		container_of(work, struct appletb_device, tb_idle_work.work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	appletb_sm_timer(&tb_dev->tb_sm);
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+static void appletb_activity(struct appletb_device *tb_dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	appletb_sm_activity(&tb_dev->tb_sm);
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+/* The idle timer was not running; start the timeouts over */
+static void appletb_restart_timeouts(struct appletb_device *tb_dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	appletb_sm_restart(&tb_dev->tb_sm);
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+/*
+ * Append an entry to the event ring, if it is open. Runs from the hid
+ * event path, possibly for two interfaces at once, so producers are
+ * serialized by ring_lock; the consumer side is lock-free. The head is
+ * kept privately so a consumer scribbling on the shared header can only
+ * confuse itself.
+ */
+static void appletb_ring_push(struct appletb_device *tb_dev, u16 type,
+			      u16 code, s32 value, s32 x, s32 y)
+{
+	struct appletb_ring_event *ev;
+	struct appletb_ring *ring;
+	unsigned long flags;
+	u32 tail;
+
+	spin_lock_irqsave(&tb_dev->ring_lock, flags);
+
+	ring = tb_dev->ring;
+	if (!ring)
+		goto out;
+
+	tail = smp_load_acquire(&ring->hdr.tail);
+	if (tb_dev->ring_head - tail >= APPLETB_RING_ENTRIES) {
+		WRITE_ONCE(ring->hdr.dropped, ring->hdr.dropped + 1);
+		goto out;
+	}
+
+	ev = &ring->events[tb_dev->ring_head & (APPLETB_RING_ENTRIES - 1)];
+	ev->time_ns = ktime_get_ns();
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+	ev->x = x;
+	ev->y = y;
+
+	smp_store_release(&ring->hdr.head, ++tb_dev->ring_head);
+	tb_dev->ring_pending = true;
+
+out:
+	spin_unlock_irqrestore(&tb_dev->ring_lock, flags);
+}
+
+/* Wake the consumer once for everything a report produced */
+static void appletb_ring_kick(struct appletb_device *tb_dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->ring_lock, flags);
+
+	if (tb_dev->ring_pending && tb_dev->ring_eventfd)
+		appletb_eventfd_signal(tb_dev->ring_eventfd);
+	tb_dev->ring_pending = false;
+
+	spin_unlock_irqrestore(&tb_dev->ring_lock, flags);
+}
+
+static void appletb_mt_contact(struct appletb_device *tb_dev,
+			       const struct appletb_contact *c)
+{
+	struct input_dev *input = tb_dev->mt_input;
+	int slot = input_mt_get_slot_by_key(input, c->id);
+
+	if (slot < 0)
+		return;
+
+	input_mt_slot(input, slot);
+	input_mt_report_slot_state(input, MT_TOOL_FINGER, c->tip);
+	if (c->tip) {
+		input_report_abs(input, ABS_MT_POSITION_X, c->x);
+		input_report_abs(input, ABS_MT_POSITION_Y, c->y);
+	}
+}
+
+static void appletb_flush_contact(struct appletb_device *tb_dev,
+				  struct appletb_decoder *dec,
+				  const struct appletb_contact *c)
+{
+	if (dec->hdev == tb_dev->mt_hdev)
+		appletb_mt_contact(tb_dev, c);
+
+	appletb_ring_push(tb_dev, APPLETB_EV_CONTACT, c->id, c->tip, c->x, c->y);
+	dec->report_contacts = true;
+	dec->report_activity = true;
+}
+
+/* Slot of a keyboard page usage, or -1 */
+static int appletb_key_slot(unsigned int hid_usage)
+{
+	if (hid_usage == APPLETB_KEYMAP_USAGE_ESC ||
+	    (hid_usage >= APPLETB_KEYMAP_USAGE_F1 &&
+	     hid_usage < APPLETB_KEYMAP_USAGE_F1 + APPLETB_MAX_TB_KEYS - 1))
+		return APPLETB_KEYMAP_SLOT(hid_usage);
+
+	return -1;
+}
+
+/* Slot of a special key the bar reports by its own usage, or -1 */
+static int appletb_special_slot(const struct hid_usage *usage)
+{
+	const u16 *codes =
+		appletb_default_keytable.codes[APPLETB_LAYER_SPECIAL];
+	int slot;
+
+	if (usage->type != EV_KEY)
+		return -1;
+
+	for (slot = 0; slot < APPLETB_MAX_TB_KEYS; slot++) {
+		if (codes[slot] == usage->code)
+			return slot;
+	}
+
+	return -1;
+}
+
+/* What @slot sends in @layer, and whether it autorepeats */
+static bool appletb_keymap_key(struct appletb_device *tb_dev,
+			       unsigned int layer, int slot, u16 *code)
+{
+	*code = READ_ONCE(tb_dev->keymap.codes[layer][slot]);
+	return READ_ONCE(tb_dev->keymap.repeat[layer]) & BIT(slot);
+}
+
+/*
+ * What a key sends and whether it autorepeats is up to the keymap layer
+ * currently shown: the function keys in FN mode, the special keys
+ * otherwise.
+ */
+static bool appletb_layer_key(struct appletb_device *tb_dev, int slot,
+			      u16 *code)
+{
+	unsigned int layer = READ_ONCE(tb_dev->tb_mode) == APPLETB_CMD_MODE_FN ?
+			     APPLETB_LAYER_FKEYS : APPLETB_LAYER_SPECIAL;
+
+	return appletb_keymap_key(tb_dev, layer, slot, code);
+}
+
+static void appletb_keymap_set(struct appletb_device *tb_dev,
+			       const struct appletb_keytable *map)
+{
+	unsigned long flags;
+	int layer, slot;
+
+	spin_lock_irqsave(&tb_dev->repeat_lock, flags);
+
+	for (layer = 0; layer < APPLETB_LAYERS; layer++) {
+		for (slot = 0; slot < APPLETB_MAX_TB_KEYS; slot++)
+			WRITE_ONCE(tb_dev->keymap.codes[layer][slot],
+				   map->codes[layer][slot]);
+		WRITE_ONCE(tb_dev->keymap.repeat[layer], map->repeat[layer]);
+	}
+
+	spin_unlock_irqrestore(&tb_dev->repeat_lock, flags);
+}
+
+static void appletb_keymap_reset(struct appletb_device *tb_dev)
+{
+	appletb_keymap_set(tb_dev, &appletb_default_keytable);
+}
+
+/* (Re)arm the repeat timer for the earliest deadline. repeat_lock held. */
+static void appletb_repeat_arm(struct appletb_device *tb_dev)
+{
+	unsigned long keys = tb_dev->repeat_keys;
+	ktime_t next = KTIME_MAX;
+	int slot;
+
+	if (!keys) {
+		hrtimer_try_to_cancel(&tb_dev->repeat_timer);
+		return;
+	}
+
+	for_each_set_bit(slot, &keys, APPLETB_MAX_TB_KEYS)
+		next = min(next, tb_dev->repeat_next[slot]);
+
+	hrtimer_start(&tb_dev->repeat_timer, next, HRTIMER_MODE_ABS_SOFT);
+}
+
+/* @slot went down as @code, if @repeat, or was released */
+static void appletb_repeat_key(struct appletb_device *tb_dev, int slot,
+			       u16 code, bool repeat)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->repeat_lock, flags);
+
+	if (repeat && tb_dev->kbd_input && tb_dev->repeat_period) {
+		tb_dev->repeat_keys |= BIT(slot);
+		tb_dev->repeat_code[slot] = code;
+		tb_dev->repeat_next[slot] =
+			ktime_add_ms(ktime_get(), tb_dev->repeat_delay);
+	} else if (!(tb_dev->repeat_keys & BIT(slot))) {
+		goto out;
+	} else {
+		tb_dev->repeat_keys &= ~BIT(slot);
+	}
+
+	appletb_repeat_arm(tb_dev);
+
+out:
+	spin_unlock_irqrestore(&tb_dev->repeat_lock, flags);
+}
+
+/*
+ * The repeats are reported after dropping repeat_lock: the output path of
+ * tb_sm cancels repeats under tb_lock, which the input handler takes with
+ * an input device's event_lock held. The input device stays around until
+ * appletb_repeat_stop() has waited for us.
+ */
+static enum hrtimer_restart appletb_repeat_timer(struct hrtimer *timer)
+{
+	struct appletb_device *tb_dev =
+		container_of(timer, struct appletb_device, repeat_timer);
+	ktime_t now = ktime_get();
+	u16 codes[APPLETB_MAX_TB_KEYS];
+	struct input_dev *input;
+	unsigned long flags, keys, due = 0;
+	int slot;
+
+	spin_lock_irqsave(&tb_dev->repeat_lock, flags);
+
+	input = tb_dev->kbd_input;
+	keys = tb_dev->repeat_keys;
+	for_each_set_bit(slot, &keys, APPLETB_MAX_TB_KEYS) {
+		ktime_t *next = &tb_dev->repeat_next[slot];
+
+		if (ktime_after(*next, now))
+			continue;
+
+		due |= BIT(slot);
+		codes[slot] = tb_dev->repeat_code[slot];
+
+		/* keep the cadence, but never catch up with a burst */
+		*next = ktime_add_ms(*next, tb_dev->repeat_period);
+		if (!ktime_after(*next, now))
+			*next = ktime_add_ms(now, tb_dev->repeat_period);
+	}
+
+	if (keys)
+		appletb_repeat_arm(tb_dev);
+
+	spin_unlock_irqrestore(&tb_dev->repeat_lock, flags);
+
+	if (!due || !input)
+		return HRTIMER_NORESTART;
+
+	for_each_set_bit(slot, &due, APPLETB_MAX_TB_KEYS)
+		input_event(input, EV_KEY, codes[slot], 2);
+	input_sync(input);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Stop repeating every key, e.g. because what the keys mean changed. The
+ * keys stay held and their release is still reported as usual. Does not
+ * wait for a running timer, which will find nothing left to repeat.
+ */
+static void appletb_repeat_cancel(struct appletb_device *tb_dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->repeat_lock, flags);
+	tb_dev->repeat_keys = 0;
+	hrtimer_try_to_cancel(&tb_dev->repeat_timer);
+	spin_unlock_irqrestore(&tb_dev->repeat_lock, flags);
+}
+
+/* As appletb_repeat_cancel(), and the timer is idle on return */
+static void appletb_repeat_stop(struct appletb_device *tb_dev)
+{
+	appletb_repeat_cancel(tb_dev);
+	hrtimer_cancel(&tb_dev->repeat_timer);
+}
+
+/*
+ * A touch bar key report. The key is reported here, as @code and
+ * repeating if @repeat when it goes down and as that same code when it is
+ * released, whatever the layer or keymap is by then; and kept from
+ * hid-input, which would only ever send the function keys for the
+ * keyboard usages. Returns whether it was. KEY_RESERVED positions only
+ * reach the event ring.
+ */
+static int appletb_decode_key(struct appletb_device *tb_dev,
+			      struct appletb_decoder *dec, int slot,
+			      __s32 value, u16 code, bool repeat)
+{
+	struct input_dev *input = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->repeat_lock, flags);
+	if (tb_dev->kbd_hdev == dec->hdev)
+		input = tb_dev->kbd_input;
+	spin_unlock_irqrestore(&tb_dev->repeat_lock, flags);
+
+	if (!!(dec->key_state & BIT(slot)) == !!value)
+		return input != NULL;
+
+	if (value)
+		dec->key_code[slot] = code;
+	else
+		code = dec->key_code[slot];
+
+	dec->key_state ^= BIT(slot);
+	dec->report_activity = true;
+	appletb_repeat_key(tb_dev, slot, code, value && repeat);
+	appletb_ring_push(tb_dev, APPLETB_EV_KEY, code, !!value, 0, 0);
+
+	/* hid-input syncs its devices at the end of the report */
+	if (input && code != KEY_RESERVED)
+		input_report_key(input, code, value);
+
+	return input != NULL;
+}
+
+static int appletb_decode_usage(struct appletb_device *tb_dev,
+				struct appletb_decoder *dec,
+				struct hid_field *field,
+				struct hid_usage *usage, __s32 value)
+{
+	struct appletb_contact done;
+	unsigned int cfield;
+	bool repeat;
+	u16 code;
+	int slot;
+
+	/* a position, whose code depends on the layer */
+	if ((usage->hid & HID_USAGE_PAGE) == HID_UP_KEYBOARD) {
+		slot = appletb_key_slot(usage->hid & HID_USAGE);
+		if (slot < 0)
+			return 0;
+
+		repeat = appletb_layer_key(tb_dev, slot, &code);
+		return appletb_decode_key(tb_dev, dec, slot, value, code,
+					  repeat);
+	}
+
+	/* a special key by its own usage, as the special layer has it */
+	if ((usage->hid & HID_USAGE_PAGE) == HID_UP_CONSUMER) {
+		slot = appletb_special_slot(usage);
+		if (slot < 0)
+			return 0;
+
+		repeat = appletb_keymap_key(tb_dev, APPLETB_LAYER_SPECIAL, slot,
+					    &code);
+		return appletb_decode_key(tb_dev, dec, slot, value, code,
+					  repeat);
+	}
+
+	if ((field->application & HID_USAGE_PAGE) != HID_UP_DIGITIZER)
+		return 0;
+
+	switch (usage->hid) {
+	case HID_DG_CONTACTID:
+		cfield = APPLETB_CONTACT_ID;
+		break;
+	case HID_DG_TIPSWITCH:
+		cfield = APPLETB_CONTACT_TIP;
+		break;
+	case HID_GD_X:
+		cfield = APPLETB_CONTACT_X;
+		break;
+	case HID_GD_Y:
+		cfield = APPLETB_CONTACT_Y;
+		break;
+	default:
+		return 0;
+	}
+
+	/* the first field of the next finger completes the previous one */
+	if (appletb_contact_field(&dec->contact, usage->collection_index,
+				  cfield, value, &done))
+		appletb_flush_contact(tb_dev, dec, &done);
+
+	return 0;
+}
+
+static struct appletb_decoder *
+appletb_get_decoder(struct appletb_device *tb_dev, struct hid_device *hdev)
+{
+	int i;
+
+	for (i = 0; i < APPLETB_MAX_IFACES; i++) {
+		if (tb_dev->decoders[i].hdev == hdev)
+			return &tb_dev->decoders[i];
+	}
+
+	return NULL;
+}
+
+static int appletb_hid_event(struct hid_device *hdev, struct hid_field *field,
+			     struct hid_usage *usage, __s32 value)
+{
+	struct appletb_device *tb_dev =
+		appleib_hid_get_drvdata(hdev, &appletb_hid_driver);
+	struct appletb_decoder *dec;
+
+	if (!tb_dev)
+		return 0;
+
+	dec = appletb_get_decoder(tb_dev, hdev);
+	if (!dec)
+		return 0;
+
+	return appletb_decode_usage(tb_dev, dec, field, usage, value);
+}
+
+/*
+ * The end of a report: complete the last contact, and publish and signal
+ * everything the report produced at once. hid-core calls this after the
+ * ->event calls for the report, including reports whose last field is an
+ * array that ->event only sees changes of.
+ */
+static void appletb_hid_report(struct hid_device *hdev,
+			       struct hid_report *report)
+{
+	struct appletb_device *tb_dev =
+		appleib_hid_get_drvdata(hdev, &appletb_hid_driver);
+	struct appletb_contact done;
+	struct appletb_decoder *dec;
+
+	if (!tb_dev)
+		return;
+
+	dec = appletb_get_decoder(tb_dev, hdev);
+	if (!dec)
+		return;
+
+	if (appletb_contact_end(&dec->contact, &done))
+		appletb_flush_contact(tb_dev, dec, &done);
+
+	/* one frame per report; contacts missing from it have been lifted */
+	if (hdev == tb_dev->mt_hdev && report->maxfield &&
+	    (report->field[0]->application & HID_USAGE_PAGE) ==
+							HID_UP_DIGITIZER) {
+		input_mt_sync_frame(tb_dev->mt_input);
+		input_sync(tb_dev->mt_input);
+	}
+
+	if (dec->report_contacts) {
+		appletb_ring_push(tb_dev, APPLETB_EV_SYNC, 0, 0, 0, 0);
+		dec->report_contacts = false;
+	}
+	appletb_ring_kick(tb_dev);
+
+	if (dec->report_activity) {
+		appletb_activity(tb_dev);
+		dec->report_activity = false;
+	}
+}
+
+/* Stop reporting on kbd_input; the repeat timer is idle on return */
+static void appletb_forget_kbd_input(struct appletb_device *tb_dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->repeat_lock, flags);
+	tb_dev->kbd_hdev = NULL;
+	tb_dev->kbd_input = NULL;
+	spin_unlock_irqrestore(&tb_dev->repeat_lock, flags);
+
+	appletb_repeat_stop(tb_dev);
+}
+
+/*
+ * The touch bar keys are reported on the keyboard device hid-input
+ * creates for them. It only knows their function key codes, so add the
+ * special ones before the device is registered. It also enables the
+ * input core's soft autorepeat; turn that off, so held keys are repeated
+ * by us alone.
+ */
+static int appletb_input_configured(struct hid_device *hdev,
+				    struct hid_input *hidinput)
+{
+	struct appletb_device *tb_dev =
+		appleib_hid_get_drvdata(hdev, &appletb_hid_driver);
+	struct input_dev *input = hidinput->input;
+	unsigned long flags;
+	int i;
+
+	if (!tb_dev || hidinput->application != HID_GD_KEYBOARD ||
+	    !test_bit(KEY_F1, input->keybit))
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(appletb_assignable); i++)
+		__set_bit(appletb_assignable[i].code, input->keybit);
+	__clear_bit(EV_REP, input->evbit);
+
+	spin_lock_irqsave(&tb_dev->repeat_lock, flags);
+	tb_dev->kbd_hdev = hdev;
+	tb_dev->kbd_input = input;
+	spin_unlock_irqrestore(&tb_dev->repeat_lock, flags);
+
+	return 0;
+}
+
+/*
+ * Any use of the built-in keyboard or touchpad counts as activity and
+ * wakes a dimmed or dark touch bar; Fn switches the keys it shows.
+ */
+static void appletb_inp_event(struct input_handle *handle, unsigned int type,
+			      unsigned int code, int value)
+{
+	struct appletb_device *tb_dev = handle->private;
+	unsigned long flags;
+
+	if (type != EV_KEY && type != EV_ABS && type != EV_REL)
+		return;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+
+	if (type == EV_KEY && code == KEY_FN)
+		appletb_sm_fn_key(&tb_dev->tb_sm, value != 0);
+	else
+		appletb_sm_activity(&tb_dev->tb_sm);
+
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+/* The built-in keyboard and touchpad, and kbd_input */
+static bool appletb_inp_match(struct input_handler *handler,
+			      struct input_dev *dev)
+{
+	struct appletb_device *tb_dev = handler->private;
+	unsigned long flags;
+	bool match;
+
+	if (dev->id.bustype == BUS_SPI)
+		return true;
+
+	spin_lock_irqsave(&tb_dev->repeat_lock, flags);
+	match = dev == tb_dev->kbd_input;
+	spin_unlock_irqrestore(&tb_dev->repeat_lock, flags);
+
+	return match;
+}
+
+static int appletb_inp_connect(struct input_handler *handler,
+			       struct input_dev *dev,
+			       const struct input_device_id *id)
+{
+	struct appletb_device *tb_dev = handler->private;
+	struct input_handle *handle;
+	int rc;
+
+	if (id->driver_info == APPLETB_DEVID_TOUCHBAR) {
+		handle = &tb_dev->tb_handle;
+		handle->name = "tbkeys";
+	} else if (id->driver_info == APPLETB_DEVID_KEYBOARD) {
+		handle = &tb_dev->kbd_handle;
+		handle->name = "tbkbd";
+	} else if (id->driver_info == APPLETB_DEVID_TOUCHPAD) {
+		handle = &tb_dev->tpd_handle;
+		handle->name = "tbtpad";
+	} else {
+		return -ENOENT;
+	}
+
+	if (handle->dev)
+		return -EEXIST;
 
-#define HID_UP_APPLE		0xff120000
-#define HID_USAGE_MODE		(HID_UP_CUSTOM | 0x0004)
-#define HID_USAGE_APPLE_APP	(HID_UP_APPLE  | 0x0001)
-#define HID_USAGE_DISP		(HID_UP_APPLE  | 0x0021)
+	handle->open = 0;
+	handle->dev = input_get_device(dev);
+	handle->handler = handler;
+	handle->private = tb_dev;
 
-#define APPLETB_MAX_TB_KEYS	13	/* ESC, F1-F12 */
+	rc = input_register_handle(handle);
+	if (rc)
+		goto err_free_dev;
 
-#define APPLETB_DEVID_KEYBOARD	0x01
-#define APPLETB_DEVID_TOUCHPAD	0x02
+	/* only watched for its removal, its events are our own */
+	if (handle == &tb_dev->tb_handle)
+		return 0;
 
-#define APPLETB_FN_MODE_NORM	0
-#define APPLETB_FN_MODE_FKEYS	1
-#define APPLETB_FN_MODE_MAX	APPLETB_FN_MODE_FKEYS
+	rc = input_open_device(handle);
+	if (rc)
+		goto err_unregister_handle;
 
-static unsigned int appletb_tb_def_fn_mode = APPLETB_FN_MODE_NORM;
-module_param(appletb_tb_def_fn_mode, uint, 0644);
-MODULE_PARM_DESC(appletb_tb_def_fn_mode, "Default Function key mode");
+	return 0;
 
-static unsigned int appletb_tb_idle_timeout = 60;
-module_param(appletb_tb_idle_timeout, uint, 0644);
-MODULE_PARM_DESC(appletb_tb_idle_timeout, "Idle timeout in seconds");
+err_unregister_handle:
+	input_unregister_handle(handle);
+err_free_dev:
+	input_put_device(handle->dev);
+	handle->dev = NULL;
+	return rc;
+}
 
-static unsigned int appletb_tb_dim_timeout = 5;
-module_param(appletb_tb_dim_timeout, uint, 0644);
-MODULE_PARM_DESC(appletb_tb_dim_timeout, "Dim timeout in seconds");
+/*
+ * hid-input unregisters kbd_input on its own whenever the hid device is
+ * disconnected, e.g. when the iBridge reconnects it for another cell,
+ * without going through appletb_remove(). Let go of it first, while it
+ * can still be reported on.
+ */
+static void appletb_inp_disconnect(struct input_handle *handle)
+{
+	struct appletb_device *tb_dev = handle->private;
 
-static const unsigned int appletb_fn_remap[] = {
-	KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5, KEY_F6, KEY_F7, KEY_F8,
-	KEY_F9, KEY_F10, KEY_F11, KEY_F12, KEY_ESC,
-};
+	if (handle == &tb_dev->tb_handle)
+		appletb_forget_kbd_input(tb_dev);
+	else
+		input_close_device(handle);
 
-static const unsigned int appletb_fn_to_special[] = {
-	KEY_ESC,	KEY_KBDILLUMDOWN, KEY_KBDILLUMUP, KEY_MUTE,
-	KEY_VOLUMEDOWN, KEY_VOLUMEUP, KEY_PREVIOUSSONG, KEY_PLAYPAUSE,
-	KEY_NEXTSONG, KEY_POWER, KEY_EJECTCD, KEY_MUTE, KEY_ESC,
-};
+	input_unregister_handle(handle);
+	input_put_device(handle->dev);
+	handle->dev = NULL;
+}
 
-static struct hid_driver appletb_hid_driver;
+static void appletb_release_device(struct kref *ref)
+{
+	kfree(container_of(ref, struct appletb_device, ref));
+}
 
-static const struct input_device_id appletb_input_devices[] = {
-	{
-		.flags = INPUT_DEVICE_ID_MATCH_BUS |
-			INPUT_DEVICE_ID_MATCH_KEYBIT,
-		.bustype = BUS_SPI,
-		.keybit = { [BIT_WORD(KEY_FN)] = BIT_MASK(KEY_FN) },
-		.driver_info = APPLETB_DEVID_KEYBOARD,
-	},
-	{
-		.flags = INPUT_DEVICE_ID_MATCH_BUS |
-			INPUT_DEVICE_ID_MATCH_KEYBIT,
-		.bustype = BUS_SPI,
-		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
-		.driver_info = APPLETB_DEVID_TOUCHPAD,
-	},
-	{ },
-};
+static int appletb_ring_open(struct inode *inode, struct file *file)
+{
+	struct appletb_device *tb_dev =
+		container_of(file->private_data, struct appletb_device,
+			     ring_dev);
+	struct appletb_ring *ring;
+	unsigned long flags;
 
-struct appletb_device {
-	bool			active;
-	struct device		*log_dev;
+	if (test_and_set_bit(0, &tb_dev->ring_busy))
+		return -EBUSY;
 
-	struct appletb_report_info {
-		struct hid_device	*hdev;
-		struct usb_interface	*usb_iface;
-		unsigned int		usb_epnum;
-		unsigned int		report_id;
-		unsigned int		report_type;
-		bool			suspended;
-	}			mode_info, disp_info;
+	ring = vmalloc_user(APPLETB_RING_SIZE);
+	if (!ring) {
+		clear_bit(0, &tb_dev->ring_busy);
+		return -ENOMEM;
+	}
 
-	struct input_handler	inp_handler;
-	struct input_handle	kbd_handle;
+	ring->hdr.version = APPLETB_RING_VERSION;
+	ring->hdr.entries = APPLETB_RING_ENTRIES;
+	ring->hdr.entry_size = sizeof(struct appletb_ring_event);
 
-	unsigned int		fn_mode;
-	unsigned int		idle_timeout;
-	unsigned int		dim_timeout;
+	kref_get(&tb_dev->ref);
 
-	spinlock_t		tb_lock;
-	unsigned int		tb_mode;
-	bool			tb_mode_valid;
-	unsigned int		tb_dim_state;
-	ktime_t			tb_last_activity;
-	struct delayed_work	tb_work;
+	spin_lock_irqsave(&tb_dev->ring_lock, flags);
+	tb_dev->ring = ring;
+	tb_dev->ring_head = 0;
+	tb_dev->ring_pending = false;
+	spin_unlock_irqrestore(&tb_dev->ring_lock, flags);
+
+	file->private_data = tb_dev;
+
+	return nonseekable_open(inode, file);
+}
+
+static int appletb_ring_release(struct inode *inode, struct file *file)
+{
+	struct appletb_device *tb_dev = file->private_data;
+	struct eventfd_ctx *ctx;
+	struct appletb_ring *ring;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->ring_lock, flags);
+	ring = tb_dev->ring;
+	ctx = tb_dev->ring_eventfd;
+	tb_dev->ring = NULL;
+	tb_dev->ring_eventfd = NULL;
+	spin_unlock_irqrestore(&tb_dev->ring_lock, flags);
+
+	if (ctx)
+		eventfd_ctx_put(ctx);
+	vfree(ring);
+
+	/* nothing draws the owner's labels any more */
+	appletb_keymap_reset(tb_dev);
+
+	clear_bit(0, &tb_dev->ring_busy);
+	kref_put(&tb_dev->ref, appletb_release_device);
+
+	return 0;
+}
+
+static int appletb_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct appletb_device *tb_dev = file->private_data;
+
+	return remap_vmalloc_range(vma, tb_dev->ring, vma->vm_pgoff);
+}
+
+static int appletb_ring_set_eventfd(struct appletb_device *tb_dev, int fd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	unsigned long flags;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock_irqsave(&tb_dev->ring_lock, flags);
+	old = tb_dev->ring_eventfd;
+	tb_dev->ring_eventfd = ctx;
+	spin_unlock_irqrestore(&tb_dev->ring_lock, flags);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/* Whether @code autorepeats, or -EINVAL if no position may send it */
+static int appletb_code_repeat(u16 code)
+{
+	int i;
+
+	if (code == KEY_RESERVED)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(appletb_assignable); i++) {
+		if (appletb_assignable[i].code == code)
+			return appletb_assignable[i].repeat;
+	}
+
+	return -EINVAL;
+}
+
+static int appletb_ring_set_keymap(struct appletb_device *tb_dev,
+				   const struct appletb_keymap __user *arg)
+{
+	struct appletb_keytable table = { };
+	struct appletb_keymap map;
+	int layer, pos, rc;
+
+	if (copy_from_user(&map, arg, sizeof(map)))
+		return -EFAULT;
+
+	for (layer = 0; layer < APPLETB_LAYERS; layer++) {
+		for (pos = 0; pos < APPLETB_POSITIONS; pos++) {
+			u16 code = map.codes[layer][pos];
+			int slot = appletb_position_slot[pos];
+
+			rc = appletb_code_repeat(code);
+			if (rc < 0)
+				return rc;
+
+			table.codes[layer][slot] = code;
+			if (rc)
+				table.repeat[layer] |= BIT(slot);
+		}
+	}
+
+	appletb_keymap_set(tb_dev, &table);
+
+	return 0;
+}
+
+static long appletb_ring_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct appletb_device *tb_dev = file->private_data;
+
+	switch (cmd) {
+	case APPLETB_IOC_SET_EVENTFD:
+		return appletb_ring_set_eventfd(tb_dev, (int)arg);
+	case APPLETB_IOC_SET_KEYMAP:
+		return appletb_ring_set_keymap(tb_dev, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations appletb_ring_fops = {
+	.owner = THIS_MODULE,
+	.open = appletb_ring_open,
+	.release = appletb_ring_release,
+	.mmap = appletb_ring_mmap,
+	.unlocked_ioctl = appletb_ring_ioctl,
+	.compat_ioctl = appletb_ring_ioctl,
 };
 
 static ssize_t idle_timeout_show(struct device *dev,
@@ -113,7 +1281,7 @@ static ssize_t idle_timeout_show(struct device *dev,
 				 char *buf)
 {
 	struct appletb_device *tb_dev = dev_get_drvdata(dev);
-	return snprintf(buf, PAGE_SIZE, "%u\n", tb_dev->idle_timeout);
+	return snprintf(buf, PAGE_SIZE, "%u\n", tb_dev->tb_sm.idle_timeout);
 }
 
 static ssize_t idle_timeout_store(struct device *dev,
@@ -122,11 +1290,16 @@ static ssize_t idle_timeout_store(struct device *dev,
 {
 	struct appletb_device *tb_dev = dev_get_drvdata(dev);
 	unsigned int idle_timeout;
+	unsigned long flags;
 
 	if (sscanf(buf, "%u", &idle_timeout) != 1)
 		return -EINVAL;
 
-	tb_dev->idle_timeout = idle_timeout;
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	appletb_sm_set_timeouts(&tb_dev->tb_sm, tb_dev->tb_sm.dim_timeout,
+				idle_timeout);
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
 	return size;
 }
 
@@ -137,7 +1310,7 @@ static ssize_t dim_timeout_show(struct device *dev,
 				char *buf)
 {
 	struct appletb_device *tb_dev = dev_get_drvdata(dev);
-	return snprintf(buf, PAGE_SIZE, "%u\n", tb_dev->dim_timeout);
+	return snprintf(buf, PAGE_SIZE, "%u\n", tb_dev->tb_sm.dim_timeout);
 }
 
 static ssize_t dim_timeout_store(struct device *dev,
@@ -146,21 +1319,77 @@ static ssize_t dim_timeout_store(struct device *dev,
 {
 	struct appletb_device *tb_dev = dev_get_drvdata(dev);
 	unsigned int dim_timeout;
+	unsigned long flags;
 
 	if (sscanf(buf, "%u", &dim_timeout) != 1)
 		return -EINVAL;
 
-	tb_dev->dim_timeout = dim_timeout;
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	appletb_sm_set_timeouts(&tb_dev->tb_sm, dim_timeout,
+				tb_dev->tb_sm.idle_timeout);
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
 	return size;
 }
 
 static DEVICE_ATTR_RW(dim_timeout);
 
+static ssize_t repeat_delay_show(struct device *dev,
+				 struct device_attribute *attr,
+				 char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	return snprintf(buf, PAGE_SIZE, "%u\n", tb_dev->repeat_delay);
+}
+
+static ssize_t repeat_delay_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t size)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	unsigned int repeat_delay;
+
+	if (sscanf(buf, "%u", &repeat_delay) != 1)
+		return -EINVAL;
+
+	WRITE_ONCE(tb_dev->repeat_delay, repeat_delay);
+	return size;
+}
+
+static DEVICE_ATTR_RW(repeat_delay);
+
+static ssize_t repeat_period_show(struct device *dev,
+				  struct device_attribute *attr,
+				  char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	return snprintf(buf, PAGE_SIZE, "%u\n", tb_dev->repeat_period);
+}
+
+static ssize_t repeat_period_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t size)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	unsigned int repeat_period;
+
+	if (sscanf(buf, "%u", &repeat_period) != 1)
+		return -EINVAL;
+
+	WRITE_ONCE(tb_dev->repeat_period, repeat_period);
+	if (!repeat_period)
+		appletb_repeat_stop(tb_dev);
+
+	return size;
+}
+
+static DEVICE_ATTR_RW(repeat_period);
+
 static ssize_t fnmode_show(struct device *dev, struct device_attribute *attr,
 			   char *buf)
 {
 	struct appletb_device *tb_dev = dev_get_drvdata(dev);
-	return snprintf(buf, PAGE_SIZE, "%u\n", tb_dev->fn_mode);
+	return snprintf(buf, PAGE_SIZE, "%u\n", tb_dev->tb_sm.fn_mode);
 }
 
 static ssize_t fnmode_store(struct device *dev, struct device_attribute *attr,
@@ -168,12 +1397,16 @@ static ssize_t fnmode_store(struct device *dev, struct device_attribute *attr,
 {
 	struct appletb_device *tb_dev = dev_get_drvdata(dev);
 	unsigned int fn_mode;
+	unsigned long flags;
 
 	if (sscanf(buf, "%u", &fn_mode) != 1 ||
 	    fn_mode > APPLETB_FN_MODE_MAX)
 		return -EINVAL;
 
-	tb_dev->fn_mode = fn_mode;
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	appletb_sm_set_fn_mode(&tb_dev->tb_sm, fn_mode);
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
 	return size;
 }
 
@@ -183,6 +1416,8 @@ static struct attribute *appletb_attrs[] = {
 	&dev_attr_idle_timeout.attr,
 	&dev_attr_dim_timeout.attr,
 	&dev_attr_fnmode.attr,
+	&dev_attr_repeat_delay.attr,
+	&dev_attr_repeat_period.attr,
 	NULL,
 };
 
@@ -190,46 +1425,271 @@ static const struct attribute_group appletb_attr_group = {
 	.attrs = appletb_attrs,
 };
 
+static int appletb_fill_report_info(struct appletb_device *tb_dev,
+				    struct hid_device *hdev)
+{
+	struct appletb_report_info *report_info = NULL;
+	struct usb_interface *usb_iface;
+	struct hid_field *field;
+
+	field = appleib_find_hid_field(hdev, HID_GD_KEYBOARD, HID_USAGE_MODE);
+	if (field) {
+		report_info = &tb_dev->mode_info;
+	} else {
+		field = appleib_find_hid_field(hdev, HID_USAGE_APPLE_APP,
+					       HID_USAGE_DISP);
+		if (field)
+			report_info = &tb_dev->disp_info;
+	}
+
+	if (!report_info)
+		return 0;
+
+	usb_iface = to_usb_interface(hdev->dev.parent);
+	if (!usb_iface) {
+		dev_err(tb_dev->log_dev,
+			"Failed to get usb-interface for hid device\n");
+		return -EINVAL;
+	}
+
+	report_info->hdev = hdev;
+	report_info->usb_iface = usb_get_intf(usb_iface);
+	report_info->usb_epnum = 0;
+	report_info->report_id = field->report->id;
+
+	switch (field->report->type) {
+	case HID_INPUT_REPORT:
+		report_info->report_type = 0x01;
+		break;
+	case HID_OUTPUT_REPORT:
+		report_info->report_type = 0x02;
+		break;
+	case HID_FEATURE_REPORT:
+		report_info->report_type = 0x03;
+		break;
+	}
+
+	return 1;
+}
+
+static void appletb_clear_report_info(struct appletb_report_info *report_info)
+{
+	usb_put_intf(report_info->usb_iface);
+	report_info->usb_iface = NULL;
+	report_info->hdev = NULL;
+}
+
+/* A contact field with @usage, if @hdev reports touch bar contacts */
+static struct hid_field *appletb_find_contact_field(struct hid_device *hdev,
+						    unsigned int usage)
+{
+	struct hid_report_enum *report_enum =
+		&hdev->report_enum[HID_INPUT_REPORT];
+	struct hid_report *report;
+	unsigned int i, j;
+
+	list_for_each_entry(report, &report_enum->report_list, list) {
+		for (i = 0; i < report->maxfield; i++) {
+			struct hid_field *field = report->field[i];
+
+			if ((field->application & HID_USAGE_PAGE) !=
+			    HID_UP_DIGITIZER)
+				continue;
+
+			for (j = 0; j < field->maxusage; j++) {
+				if (field->usage[j].hid == usage)
+					return field;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void appletb_mt_set_axis(struct input_dev *input, unsigned int code,
+				struct hid_field *field)
+{
+	input_set_abs_params(input, code, field->logical_minimum,
+			     field->logical_maximum, 0, 0);
+	input_abs_set_res(input, code, hidinput_calc_abs_res(field, code));
+}
+
+/*
+ * Register the multitouch surface if @hdev carries the contacts. Failing
+ * is not fatal, the event ring and hidraw still see every contact.
+ */
+static void appletb_mt_probe(struct appletb_device *tb_dev,
+			     struct hid_device *hdev)
+{
+	struct hid_field *x_field, *y_field;
+	struct input_dev *input;
+	int rc;
+
+	if (tb_dev->mt_input)
+		return;
+
+	x_field = appletb_find_contact_field(hdev, HID_GD_X);
+	y_field = appletb_find_contact_field(hdev, HID_GD_Y);
+	if (!x_field || !y_field)
+		return;
+
+	input = input_allocate_device();
+	if (!input) {
+		rc = -ENOMEM;
+		goto error;
+	}
+
+	input->name = "Apple Touch Bar";
+	input->phys = hdev->phys;
+	input->uniq = hdev->uniq;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->id.version = hdev->version;
+	input->dev.parent = &hdev->dev;
+
+	appletb_mt_set_axis(input, ABS_MT_POSITION_X, x_field);
+	appletb_mt_set_axis(input, ABS_MT_POSITION_Y, y_field);
+
+	rc = input_mt_init_slots(input, APPLETB_MAX_CONTACTS,
+				 INPUT_MT_DIRECT | INPUT_MT_DROP_UNUSED);
+	if (rc)
+		goto free_input;
+
+	rc = input_register_device(input);
+	if (rc)
+		goto free_input;
+
+	tb_dev->mt_hdev = hdev;
+	tb_dev->mt_input = input;
+
+	return;
+
+free_input:
+	input_free_device(input);
+error:
+	dev_warn(tb_dev->log_dev,
+		 "Failed to register touch surface (%d)\n", rc);
+}
+
+static void appletb_mt_remove(struct appletb_device *tb_dev,
+			      struct hid_device *hdev)
+{
+	if (tb_dev->mt_hdev != hdev)
+		return;
+
+	input_unregister_device(tb_dev->mt_input);
+	tb_dev->mt_input = NULL;
+	tb_dev->mt_hdev = NULL;
+}
+
 static int appletb_probe(struct hid_device *hdev,
 			 const struct hid_device_id *id)
 {
 	struct appletb_device *tb_dev =
-		appleib_get_drvdata(hid_get_drvdata(hdev), &appletb_hid_driver);
+		appleib_hid_get_drvdata(hdev, &appletb_hid_driver);
+	struct appletb_decoder *dec;
+	int rc;
 
 	if (!tb_dev) {
 		hid_err(hdev, "Unable to get drvdata\n");
 		return -ENODEV;
 	}
 
-	if (tb_dev->active)
+	rc = appletb_fill_report_info(tb_dev, hdev);
+	if (rc < 0)
+		return rc;
+
+	dec = appletb_get_decoder(tb_dev, NULL);
+	if (dec) {
+		memset(dec, 0, sizeof(*dec));
+		dec->hdev = hdev;
+	} else {
+		hid_warn(hdev, "No decoder left, ignoring its input\n");
+	}
+
+	appletb_mt_probe(tb_dev, hdev);
+
+	if (tb_dev->active || !tb_dev->mode_info.usb_iface ||
+	    !tb_dev->disp_info.usb_iface)
 		return 0;
 
+	appletb_invalidate_state(tb_dev);
 	tb_dev->active = true;
 
+	appletb_restart_timeouts(tb_dev);
+	schedule_delayed_work(&tb_dev->tb_work, 0);
+
 	return 0;
 }
 
 static void appletb_remove(struct hid_device *hdev)
 {
 	struct appletb_device *tb_dev =
-		appleib_get_drvdata(hid_get_drvdata(hdev), &appletb_hid_driver);
+		appleib_hid_get_drvdata(hdev, &appletb_hid_driver);
+	struct appletb_report_info *report_info;
+	struct appletb_decoder *dec;
 
 	if (!tb_dev)
 		return;
 
+	appletb_mt_remove(tb_dev, hdev);
+
+	dec = appletb_get_decoder(tb_dev, hdev);
+	if (dec)
+		dec->hdev = NULL;
+
+	/* hid-input unregisters the input device once we are done */
+	if (tb_dev->kbd_hdev == hdev)
+		appletb_forget_kbd_input(tb_dev);
+
+	if (tb_dev->mode_info.hdev == hdev)
+		report_info = &tb_dev->mode_info;
+	else if (tb_dev->disp_info.hdev == hdev)
+		report_info = &tb_dev->disp_info;
+	else
+		return;
+
 	tb_dev->active = false;
+	cancel_delayed_work_sync(&tb_dev->tb_work);
+
+	appletb_clear_report_info(report_info);
 }
 
 #ifdef CONFIG_PM
 static int appletb_suspend(struct hid_device *hdev, pm_message_t message)
 {
 	struct appletb_device *tb_dev =
-		appleib_get_drvdata(hid_get_drvdata(hdev), &appletb_hid_driver);
+		appleib_hid_get_drvdata(hdev, &appletb_hid_driver);
 
 	if (!tb_dev)
 		return 0;
 
+	cancel_delayed_work_sync(&tb_dev->tb_idle_work);
 	cancel_delayed_work_sync(&tb_dev->tb_work);
+	appletb_repeat_stop(tb_dev);
+
+	/*
+	 * For the hibernation snapshot the iBridge stays powered (see
+	 * appleib_freeze()), so the device keeps its mode and display state
+	 * and thaw has nothing to replay. Anything else may cut power.
+	 */
+	if (message.event != PM_EVENT_FREEZE)
+		appletb_invalidate_state(tb_dev);
+
+	return 0;
+}
+
+static int appletb_resume(struct hid_device *hdev)
+{
+	struct appletb_device *tb_dev =
+		appleib_hid_get_drvdata(hdev, &appletb_hid_driver);
+
+	if (!tb_dev || !tb_dev->active)
+		return 0;
+
+	appletb_restart_timeouts(tb_dev);
+	schedule_delayed_work(&tb_dev->tb_work, 0);
 
 	return 0;
 }
@@ -237,41 +1697,29 @@ static int appletb_suspend(struct hid_device *hdev, pm_message_t message)
 static int appletb_reset_resume(struct hid_device *hdev)
 {
 	struct appletb_device *tb_dev =
-		appleib_get_drvdata(hid_get_drvdata(hdev), &appletb_hid_driver);
+		appleib_hid_get_drvdata(hdev, &appletb_hid_driver);
 
-	if (!tb_dev)
+	if (!tb_dev || !tb_dev->active)
 		return 0;
 
+	appletb_invalidate_state(tb_dev);
+	appletb_restart_timeouts(tb_dev);
 	schedule_delayed_work(&tb_dev->tb_work, 0);
 
 	return 0;
 }
 #endif
 
-static const struct hid_device_id appletb_input_devices[] = {
-	{
-		.flags = INPUT_DEVICE_ID_MATCH_BUS |
-			INPUT_DEVICE_ID_MATCH_KEYBIT,
-		.bustype = BUS_SPI,
-		.keybit = { [BIT_WORD(KEY_FN)] = BIT_MASK(KEY_FN) },
-		.driver_info = APPLETB_DEVID_KEYBOARD,
-	},
-	{
-		.flags = INPUT_DEVICE_ID_MATCH_BUS |
-			INPUT_DEVICE_ID_MATCH_KEYBIT,
-		.bustype = BUS_SPI,
-		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
-		.driver_info = APPLETB_DEVID_TOUCHPAD,
-	},
-	{ },
-};
-
 static struct hid_driver appletb_hid_driver = {
 	.name = "apple-ib-touchbar",
 	.probe = appletb_probe,
 	.remove = appletb_remove,
+	.event = appletb_hid_event,
+	.report = appletb_hid_report,
+	.input_configured = appletb_input_configured,
 #ifdef CONFIG_PM
 	.suspend = appletb_suspend,
+	.resume = appletb_resume,
 	.reset_resume = appletb_reset_resume,
 #endif
 };
@@ -284,17 +1732,64 @@ static struct appletb_device *appletb_alloc_device(struct device *log_dev)
 	if (!tb_dev)
 		return NULL;
 
+	kref_init(&tb_dev->ref);
 	spin_lock_init(&tb_dev->tb_lock);
-	INIT_DELAYED_WORK(&tb_dev->tb_work, NULL);
+	spin_lock_init(&tb_dev->ring_lock);
+	spin_lock_init(&tb_dev->repeat_lock);
+	appletb_hrtimer_setup(&tb_dev->repeat_timer, appletb_repeat_timer,
+			      CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	INIT_DELAYED_WORK(&tb_dev->tb_work, appletb_tb_work);
+	INIT_DELAYED_WORK(&tb_dev->tb_idle_work, appletb_idle_work);
 	tb_dev->log_dev = log_dev;
 
+	tb_dev->ring_dev.minor = MISC_DYNAMIC_MINOR;
+	tb_dev->ring_dev.name = "appletb";
+	tb_dev->ring_dev.fops = &appletb_ring_fops;
+
+	tb_dev->inp_handler.event = appletb_inp_event;
+	tb_dev->inp_handler.match = appletb_inp_match;
+	tb_dev->inp_handler.connect = appletb_inp_connect;
+	tb_dev->inp_handler.disconnect = appletb_inp_disconnect;
+	tb_dev->inp_handler.name = "appletb";
+	tb_dev->inp_handler.id_table = appletb_input_devices;
+	tb_dev->inp_handler.private = tb_dev;
+
+	tb_dev->repeat_delay = appletb_tb_repeat_delay;
+	tb_dev->repeat_period = appletb_tb_repeat_period;
+	appletb_keymap_reset(tb_dev);
+
+	BUILD_BUG_ON(APPLETB_SM_FN_MODE_FKEYS != APPLETB_FN_MODE_FKEYS);
+	BUILD_BUG_ON(APPLETB_SM_MODE_FN != APPLETB_CMD_MODE_FN);
+	BUILD_BUG_ON(APPLETB_SM_MODE_SPCL != APPLETB_CMD_MODE_SPCL);
+	BUILD_BUG_ON(APPLETB_SM_MODE_OFF != APPLETB_CMD_MODE_OFF);
+	BUILD_BUG_ON(APPLETB_SM_DISP_ON != APPLETB_CMD_DISP_ON);
+	BUILD_BUG_ON(APPLETB_SM_DISP_DIM != APPLETB_CMD_DISP_DIM);
+	BUILD_BUG_ON(APPLETB_SM_DISP_OFF != APPLETB_CMD_DISP_OFF);
+	/* every usage needs a key code, and the key bitmaps are u16 */
+	BUILD_BUG_ON(APPLETB_KEYMAP_NKEYS(APPLETB_KEYMAP_FKEYS) !=
+		     APPLETB_MAX_TB_KEYS);
+	BUILD_BUG_ON(APPLETB_KEYMAP_NKEYS(APPLETB_KEYMAP_SPECIAL) !=
+		     APPLETB_MAX_TB_KEYS);
+	BUILD_BUG_ON(APPLETB_MAX_TB_KEYS > 16);
+	BUILD_BUG_ON(APPLETB_POSITIONS != APPLETB_MAX_TB_KEYS);
+
+	appletb_sm_init(&tb_dev->tb_sm, &appletb_sm_ops, tb_dev,
+			min(appletb_tb_def_fn_mode,
+			    (unsigned int)APPLETB_FN_MODE_MAX),
+			appletb_tb_dim_timeout, appletb_tb_idle_timeout);
+	tb_dev->tb_mode = tb_dev->tb_sm.mode;
+	tb_dev->tb_dim_state = tb_dev->tb_sm.disp;
+
 	return tb_dev;
 }
 
+/* The event ring may still be open, it holds its own reference */
 static void appletb_free_device(struct appletb_device *tb_dev)
 {
+	cancel_delayed_work_sync(&tb_dev->tb_idle_work);
 	cancel_delayed_work_sync(&tb_dev->tb_work);
-	kfree(tb_dev);
+	appletb_repeat_stop(tb_dev);
+	kref_put(&tb_dev->ref, appletb_release_device);
 }
 
 static int appletb_platform_probe(struct platform_device *pdev)
@@ -308,7 +1803,8 @@ static int appletb_platform_probe(struct platform_device *pdev)
 	if (!tb_dev)
 		return -ENOMEM;
 
-	rc = appleib_register_hid_driver(ib_dev, &appletb_hid_driver, tb_dev);
+	rc = appleib_register_hid_driver(ib_dev, &appletb_hid_driver,
+					 APPLEIB_CELL_TB, tb_dev);
 	if (rc)
 		goto error;
 
@@ -316,6 +1812,23 @@ static int appletb_platform_probe(struct platform_device *pdev)
 
 	sysfs_create_group(&pdev->dev.kobj, &appletb_attr_group);
 
+	rc = input_register_handler(&tb_dev->inp_handler);
+	if (rc) {
+		dev_warn(tb_dev->log_dev,
+			 "Failed to watch keyboard activity (%d)\n", rc);
+		/* nothing would tell us when kbd_input goes away */
+		appletb_forget_kbd_input(tb_dev);
+	} else {
+		tb_dev->inp_registered = true;
+	}
+
+	rc = misc_register(&tb_dev->ring_dev);
+	if (rc)
+		dev_warn(tb_dev->log_dev,
+			 "Failed to register event ring device (%d)\n", rc);
+	else
+		tb_dev->ring_registered = true;
+
 	return 0;
 
 error:
@@ -332,6 +1845,16 @@ static int appletb_platform_remove(struct platform_device *pdev)
 
 	sysfs_remove_group(&pdev->dev.kobj, &appletb_attr_group);
 
+	if (tb_dev->inp_registered) {
+		input_unregister_handler(&tb_dev->inp_handler);
+		tb_dev->inp_registered = false;
+	}
+
+	if (tb_dev->ring_registered) {
+		misc_deregister(&tb_dev->ring_dev);
+		tb_dev->ring_registered = false;
+	}
+
 	rc = appleib_unregister_hid_driver(ib_dev, &appletb_hid_driver);
 	if (rc)
 		goto error;
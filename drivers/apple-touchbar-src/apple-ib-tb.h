@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Apple Touch Bar event ring
+ *
+ * /dev/appletb exposes the decoded touch bar input as a single-producer,
+ * single-consumer ring in memory shared with the one process that has the
+ * device open. mmap() the device at offset 0 for APPLETB_RING_SIZE bytes;
+ * the kernel advances head after filling an entry, the consumer advances
+ * tail after reading one (both with release semantics, read with acquire).
+ * Entries that do not fit are dropped and counted, the kernel never waits
+ * for the consumer.
+ *
+ * An eventfd registered with APPLETB_IOC_SET_EVENTFD is signalled once per
+ * input report that produced entries.
+ *
+ * APPLETB_IOC_SET_KEYMAP sets the key codes the touch bar positions send
+ * in each layer, for as long as the device stays open; closing it brings
+ * back the built-in keymap. Codes must be KEY_RESERVED (the position
+ * sends nothing) or listed in apple-ib-tb-keymap.h, else -EINVAL.
+ */
+
+#ifndef _APPLE_IB_TB_H
+#define _APPLE_IB_TB_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define APPLETB_RING_VERSION	1
+#define APPLETB_RING_ENTRIES	1024	/* power of two */
+
+#define APPLETB_EV_KEY		1	/* code: key, value: 1 down, 0 up */
+#define APPLETB_EV_CONTACT	2	/* code: contact id, value: touching */
+#define APPLETB_EV_SYNC		3	/* end of one report's contacts */
+
+struct appletb_ring_event {
+	__u64	time_ns;		/* CLOCK_MONOTONIC */
+	__u16	type;
+	__u16	code;
+	__s32	value;
+	__s32	x;			/* contacts only, device units */
+	__s32	y;
+};
+
+struct appletb_ring_header {
+	__u32	version;
+	__u32	entries;
+	__u32	entry_size;
+	__u32	dropped;
+	__u32	head __attribute__((aligned(64)));	/* kernel writes */
+	__u32	tail __attribute__((aligned(64)));	/* consumer writes */
+};
+
+struct appletb_ring {
+	struct appletb_ring_header hdr;
+	struct appletb_ring_event events[APPLETB_RING_ENTRIES]
+		__attribute__((aligned(64)));
+};
+
+#define APPLETB_RING_SIZE	sizeof(struct appletb_ring)
+
+#define APPLETB_LAYER_SPECIAL	0	/* media and brightness keys */
+#define APPLETB_LAYER_FKEYS	1	/* function keys */
+#define APPLETB_LAYERS		2
+#define APPLETB_POSITIONS	13	/* ESC, F1-F12, left to right */
+
+struct appletb_keymap {
+	__u16	codes[APPLETB_LAYERS][APPLETB_POSITIONS];
+};
+
+/* Argument: eventfd descriptor, or -1 to stop signalling */
+#define APPLETB_IOC_SET_EVENTFD	_IO('B', 0x01)
+#define APPLETB_IOC_SET_KEYMAP	_IOW('B', 0x02, struct appletb_keymap)
+
+#endif
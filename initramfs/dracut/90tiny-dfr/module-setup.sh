@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# dracut module: tiny-dfr in the initramfs
+#
+# Runs tiny-dfr -i until switch-root, so Esc and the function keys work at
+# the LUKS and emergency prompts. Only included when asked for, which the
+# installer does in /etc/dracut.conf.d/tiny-dfr.conf.
+#
+# SPDX-License-Identifier: GPL-2.0
+
+TINY_DFR_BINDIR=/usr/local/bin
+
+check() {
+    [[ -x $TINY_DFR_BINDIR/tiny-dfr-static || -x $TINY_DFR_BINDIR/tiny-dfr ]] || return 1
+    return 255
+}
+
+depends() {
+    return 0
+}
+
+installkernel() {
+    hostonly='' instmods apple_ibridge apple_ib_tb
+}
+
+install() {
+    local bin="$TINY_DFR_BINDIR/tiny-dfr-static"
+
+    # The dynamic build works too, dracut pulls in its libraries
+    [[ -x $bin ]] || bin="$TINY_DFR_BINDIR/tiny-dfr"
+    inst_binary "$bin" /usr/bin/tiny-dfr
+
+    if dracut_module_included "systemd"; then
+        inst_simple "$moddir/tiny-dfr-initrd.service" \
+            "$systemdsystemunitdir/tiny-dfr-initrd.service"
+        systemctl -q --root "$initdir" enable tiny-dfr-initrd.service
+    else
+        inst_hook pre-udev 90 "$moddir/tiny-dfr-start.sh"
+        inst_hook cleanup 99 "$moddir/tiny-dfr-stop.sh"
+    fi
+}
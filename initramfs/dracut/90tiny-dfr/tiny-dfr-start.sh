@@ -0,0 +1,6 @@
+#!/bin/sh
+# Start tiny-dfr for the prompts of the initramfs (dracut without systemd)
+
+modprobe -a -q apple_ibridge apple_ib_tb
+tiny-dfr -f -i >/dev/null 2>&1 &
+echo $! > /run/tiny-dfr.pid
@@ -0,0 +1,9 @@
+#!/bin/sh
+# Stop tiny-dfr before switch-root; it leaves its state in /run/tiny-dfr
+# for the full daemon
+
+if [ -f /run/tiny-dfr.pid ]; then
+    read -r pid < /run/tiny-dfr.pid
+    kill "$pid" 2>/dev/null && wait "$pid"
+    rm -f /run/tiny-dfr.pid
+fi
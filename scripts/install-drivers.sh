@@ -3,6 +3,7 @@
 # install-drivers.sh - Install and build Apple T1 drivers via DKMS
 #
 # This script handles:
+# - Installing prebuilt modules from the artifact cache (module-cache.sh)
 # - Copying driver source to DKMS source directory
 # - Building drivers with kernel
 # - Installing kernel modules
@@ -40,6 +41,9 @@ log_debug() {
     [[ "${VERBOSE:-0}" -eq 1 ]] && echo -e "${BLUE}[DEBUG]${NC} $*" >&2
 }
 
+# Prebuilt module artifacts, see module-cache.sh
+source "$SCRIPT_DIR/module-cache.sh"
+
 # Check if running as root
 check_root() {
     if [[ $EUID -ne 0 ]]; then
@@ -180,7 +184,9 @@ main() {
     
     # Install apple-ibridge driver
     log_info ""
-    if [[ $use_dkms -eq 1 ]]; then
+    if module_cache_install "apple-ibridge"; then
+        :
+    elif [[ $use_dkms -eq 1 ]]; then
         install_driver_dkms "apple-ibridge" "$PROJECT_ROOT/drivers/apple-ibridge-src" "1.0" || {
             log_error "Failed to install apple-ibridge via DKMS"
             return 1
@@ -195,7 +201,9 @@ main() {
     
     # Install apple-touchbar driver
     log_info ""
-    if [[ $use_dkms -eq 1 ]]; then
+    if module_cache_install "apple-touchbar"; then
+        :
+    elif [[ $use_dkms -eq 1 ]]; then
         install_driver_dkms "apple-touchbar" "$PROJECT_ROOT/drivers/apple-touchbar-src" "1.0" || {
             log_error "Failed to install apple-touchbar via DKMS"
             return 1
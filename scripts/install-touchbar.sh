@@ -4,6 +4,7 @@
 #
 # Orchestrates complete installation including:
 # - Kernel patch application with adaptive strategies
+# - Prebuilt driver modules from the artifact cache, keyed by kernel
 # - DKMS driver compilation for any kernel version
 # - Userspace tiny-dfr daemon build and installation
 # - systemd service integration
@@ -48,6 +49,7 @@ VERBOSE=0
 SKIP_KERNEL=0
 SKIP_DRIVERS=0
 SKIP_DAEMON=0
+INSTALL_INITRAMFS=0
 INSTALL_PREFIX="${INSTALL_PREFIX:-/usr/local}"
 
 # ============================================================================
@@ -84,6 +86,9 @@ die() {
     exit 1
 }
 
+# Prebuilt module artifacts, see module-cache.sh
+source "$SCRIPT_DIR/module-cache.sh"
+
 # ============================================================================
 # UTILITY FUNCTIONS
 # ============================================================================
@@ -263,6 +268,27 @@ install_drivers_dkms() {
         return 0
     fi
     
+    # Prebuilt artifacts need neither DKMS nor a compiler
+    local -a build=()
+    local driver dir
+    for driver in apple-ibridge apple-touchbar; do
+        if [[ $DRY_RUN -eq 1 ]]; then
+            if dir="$(module_cache_lookup "$driver" "$KERNEL_RELEASE")"; then
+                log_info "DRY RUN: Would install prebuilt $driver from $dir"
+                continue
+            fi
+        elif module_cache_install "$driver" "$KERNEL_RELEASE"; then
+            continue
+        fi
+        build+=("$driver")
+    done
+
+    if [[ ${#build[@]} -eq 0 ]]; then
+        log_info "Drivers installed from $MODULE_CACHE_DIR"
+        return 0
+    fi
+    log_info "No prebuilt ${build[*]} for $KERNEL_RELEASE, building with DKMS"
+
     # Check if DKMS is available
     if ! command -v dkms &>/dev/null; then
         log_error "DKMS not found. Install with:"
@@ -274,23 +300,15 @@ install_drivers_dkms() {
         return 1
     fi
     
-    # Install apple-ibridge driver
-    log_info "Installing apple-ibridge driver..."
-    local ibridge_src="${PROJECT_ROOT}/apple-ibridge"
-    if [[ -d "$ibridge_src" ]]; then
-        _install_single_driver "apple-ibridge" "$ibridge_src"
-    else
-        log_warn "apple-ibridge source not found"
-    fi
-    
-    # Install apple-touchbar driver
-    log_info "Installing apple-touchbar driver..."
-    local touchbar_src="${PROJECT_ROOT}/apple-touchbar"
-    if [[ -d "$touchbar_src" ]]; then
-        _install_single_driver "apple-touchbar" "$touchbar_src"
-    else
-        log_warn "apple-touchbar source not found"
-    fi
+    for driver in "${build[@]}"; do
+        log_info "Installing $driver driver..."
+        dir="$(module_cache_src_dir "$driver")"
+        if [[ -d "$dir" ]]; then
+            _install_single_driver "$driver" "$dir"
+        else
+            log_warn "$driver source not found"
+        fi
+    done
     
     log_info "Drivers installed successfully"
 }
@@ -379,6 +397,22 @@ install_udev_rules() {
     cp "$src_rules" "$dst_rules"
     chmod 644 "$dst_rules"
     
+    # The rules identify the iBridge through this hwdb entry
+    local src_hwdb="${PROJECT_ROOT}/udev/60-apple-touchbar.hwdb"
+    local dst_hwdb="/etc/udev/hwdb.d/60-apple-touchbar.hwdb"
+    
+    mkdir -p /etc/udev/hwdb.d
+    cp "$src_hwdb" "$dst_hwdb"
+    chmod 644 "$dst_hwdb"
+    
+    if command -v systemd-hwdb &>/dev/null; then
+        systemd-hwdb update
+    elif command -v udevadm &>/dev/null; then
+        udevadm hwdb --update
+    else
+        log_warn "Cannot rebuild hwdb, Touch Bar devices will not be matched"
+    fi
+    
     # Reload udev rules
     if command -v udevadm &>/dev/null; then
         udevadm control --reload
@@ -392,8 +426,8 @@ install_udev_rules() {
 install_systemd_service() {
     log_section "Installing systemd Service"
     
-    local src_service="${PROJECT_ROOT}/systemd/touchbar.service"
-    local dst_service="/etc/systemd/system/touchbar.service"
+    local src_service="${PROJECT_ROOT}/systemd/tiny-dfr.service"
+    local dst_service="/etc/systemd/system/tiny-dfr.service"
     
     if [[ ! -f "$src_service" ]]; then
         log_warn "systemd service not found: $src_service"
@@ -405,20 +439,98 @@ install_systemd_service() {
         return 0
     fi
     
+    # touchbar.service is now an alias of tiny-dfr.service
+    if [[ -f /etc/systemd/system/touchbar.service && \
+          ! -L /etc/systemd/system/touchbar.service ]]; then
+        command -v systemctl &>/dev/null && \
+            systemctl disable --now touchbar.service &>/dev/null
+        rm -f /etc/systemd/system/touchbar.service
+    fi
+    
     cp "$src_service" "$dst_service"
     chmod 644 "$dst_service"
     
-    # Enable and start service
+    # udev starts the service when the iBridge appears; start it now if
+    # the iBridge was already there before the unit existed
     if command -v systemctl &>/dev/null; then
         systemctl daemon-reload
-        systemctl enable touchbar.service
-        systemctl restart touchbar.service
-        log_info "systemd service installed and enabled"
+        systemctl enable tiny-dfr.service
+        if [[ -e /dev/apple-ibridge ]]; then
+            systemctl restart tiny-dfr.service
+        fi
+        log_info "systemd service installed, started by udev with the Touch Bar"
     else
         log_info "systemd service installed (systemctl not found)"
     fi
 }
 
+# Static tiny-dfr plus the dracut module or mkinitcpio hook that start it
+# from the initramfs. The initramfs is not regenerated here.
+install_initramfs_hooks() {
+    if [[ $INSTALL_INITRAMFS -eq 0 || $SKIP_DAEMON -eq 1 ]]; then
+        return 0
+    fi
+
+    log_section "Installing initramfs Hooks"
+
+    local daemon_src="${PROJECT_ROOT}/third_party/tiny-dfr"
+    local hooks_src="${PROJECT_ROOT}/initramfs"
+    local unit_src="${PROJECT_ROOT}/systemd/tiny-dfr-initrd.service"
+    local regenerate=""
+
+    if [[ $DRY_RUN -eq 1 ]]; then
+        log_debug "DRY RUN: Would build tiny-dfr-static and install initramfs hooks"
+        return 0
+    fi
+
+    log_info "Building static tiny-dfr..."
+    (cd "$daemon_src" && make -j"$(nproc)" static &&
+        make PREFIX="$INSTALL_PREFIX" install-static) ||
+        die "Failed to build static tiny-dfr"
+
+    # The mkinitcpio hook takes the unit from here; both hooks get the
+    # prefix substituted below
+    install -D -m 644 "$unit_src" "$INSTALL_PREFIX/lib/tiny-dfr/tiny-dfr-initrd.service"
+
+    if [[ -d /usr/lib/dracut/modules.d ]]; then
+        local moddir=/usr/lib/dracut/modules.d/90tiny-dfr
+
+        mkdir -p "$moddir"
+        sed "s|^TINY_DFR_BINDIR=.*|TINY_DFR_BINDIR=$INSTALL_PREFIX/bin|" \
+            "$hooks_src/dracut/90tiny-dfr/module-setup.sh" > "$moddir/module-setup.sh"
+        install -m 755 "$hooks_src/dracut/90tiny-dfr/tiny-dfr-start.sh" \
+            "$hooks_src/dracut/90tiny-dfr/tiny-dfr-stop.sh" "$moddir/"
+        install -m 644 "$unit_src" "$moddir/tiny-dfr-initrd.service"
+        chmod 755 "$moddir/module-setup.sh"
+
+        mkdir -p /etc/dracut.conf.d
+        echo 'add_dracutmodules+=" tiny-dfr "' > /etc/dracut.conf.d/tiny-dfr.conf
+
+        log_info "dracut module installed"
+        regenerate="dracut -f --regenerate-all"
+    fi
+
+    if [[ -d /etc/initcpio || -x /usr/bin/mkinitcpio ]]; then
+        mkdir -p /etc/initcpio/install /etc/initcpio/hooks
+        sed "s|^TINY_DFR_PREFIX=.*|TINY_DFR_PREFIX=$INSTALL_PREFIX|" \
+            "$hooks_src/mkinitcpio/install/tiny-dfr" > /etc/initcpio/install/tiny-dfr
+        install -m 644 "$hooks_src/mkinitcpio/hooks/tiny-dfr" /etc/initcpio/hooks/tiny-dfr
+
+        log_info "mkinitcpio hook installed"
+        if ! grep -qE '^HOOKS=.*\btiny-dfr\b' /etc/mkinitcpio.conf 2>/dev/null; then
+            log_warn "Add tiny-dfr to HOOKS in /etc/mkinitcpio.conf, before encrypt or sd-encrypt"
+        fi
+        regenerate="mkinitcpio -P"
+    fi
+
+    if [[ -z "$regenerate" ]]; then
+        log_warn "Neither dracut nor mkinitcpio found, no initramfs hook installed"
+        return 0
+    fi
+
+    log_info "Takes effect with the next initramfs, to rebuild it now: $regenerate"
+}
+
 # ============================================================================
 # VERIFICATION
 # ============================================================================
@@ -452,12 +564,15 @@ verify_installation() {
     fi
     
     # Check systemd service
-    if [[ -f /etc/systemd/system/touchbar.service ]]; then
+    if [[ -f /etc/systemd/system/tiny-dfr.service ]]; then
         log_info "systemd service installed"
-        if systemctl is-enabled touchbar.service &>/dev/null; then
-            log_info "systemd service enabled"
+        if systemctl is-active tiny-dfr.service &>/dev/null; then
+            log_info "systemd service running"
+        elif [[ -e /dev/apple-ibridge ]]; then
+            log_warn "Touch Bar present but systemd service not running"
+            ((issues++))
         else
-            log_warn "systemd service not enabled"
+            log_info "systemd service will start when the Touch Bar appears"
         fi
     else
         log_warn "systemd service not installed"
@@ -465,7 +580,8 @@ verify_installation() {
     fi
     
     # Check udev rules
-    if [[ -f /etc/udev/rules.d/99-apple-touchbar.rules ]]; then
+    if [[ -f /etc/udev/rules.d/99-apple-touchbar.rules && \
+          -f /etc/udev/hwdb.d/60-apple-touchbar.hwdb ]]; then
         log_info "udev rules installed"
     else
         log_warn "udev rules not installed"
@@ -496,6 +612,8 @@ OPTIONS:
     --skip-kernel          Skip kernel patch application
     --skip-drivers         Skip driver installation
     --skip-daemon          Skip daemon installation
+    --initramfs            Also run tiny-dfr from the initramfs (dracut or
+                           mkinitcpio), for the Touch Bar at LUKS prompts
     --prefix DIR           Installation prefix (default: /usr/local)
 
 EXAMPLES:
@@ -516,7 +634,8 @@ REQUIREMENTS:
     - Linux kernel 4.15+
     - Kernel headers installed
     - Build tools (gcc, make, patch)
-    - DKMS (for automatic kernel updates)
+    - DKMS (for automatic kernel updates), unless prebuilt modules for
+      the kernel are in \$MODULE_CACHE_DIR (see scripts/module-cache.sh)
 
 SUPPORTED DISTRIBUTIONS:
     - Ubuntu 18.04+
@@ -530,8 +649,8 @@ SUPPORTED DISTRIBUTIONS:
 TROUBLESHOOTING:
     1. Check kernel version: uname -r
     2. Verify modules loaded: lsmod | grep apple
-    3. Check daemon status: systemctl status touchbar
-    4. View daemon logs: journalctl -u touchbar -n 50
+    3. Check daemon status: systemctl status tiny-dfr
+    4. View daemon logs: journalctl -u tiny-dfr -n 50
 
 For more information, see: https://github.com/DeXeDoXv/t1-kernel-patches
 
@@ -575,6 +694,10 @@ main() {
                 SKIP_DAEMON=1
                 shift
                 ;;
+            --initramfs)
+                INSTALL_INITRAMFS=1
+                shift
+                ;;
             --prefix)
                 INSTALL_PREFIX="$2"
                 shift 2
@@ -598,6 +721,7 @@ main() {
     install_daemon
     install_udev_rules
     install_systemd_service
+    install_initramfs_hooks
     verify_installation
     
     log_section "Installation Complete"
@@ -610,13 +734,13 @@ main() {
     echo ""
     echo "  2. After reboot, verify the installation:"
     echo "     lsmod | grep apple"
-    echo "     systemctl status touchbar"
+    echo "     systemctl status tiny-dfr"
     echo ""
     echo "  3. Check the daemon logs:"
-    echo "     journalctl -u touchbar -n 50 -f"
+    echo "     journalctl -u tiny-dfr -n 50 -f"
     echo ""
     echo "Known limitations:"
-    echo "  - Touch Bar displays function keys only (no custom app rendering yet)"
+    echo "  - Per-app Touch Bar layouts need a focus helper for the compositor (see README)"
     echo "  - Ambient Light Sensor available via HID but not integrated with backlight"
     echo "  - Touch ID / Secure Enclave not implemented"
     echo ""
@@ -0,0 +1,321 @@
+#!/bin/bash
+#
+# module-cache.sh - Prebuilt Apple T1 driver module artifacts
+#
+# Builds apple-ibridge and apple-touchbar once per kernel and stores the
+# modules under a key of (kernel release, config hash, source hash), so
+# machines running the same kernel install them without compiling:
+#
+#   $MODULE_CACHE_DIR/<kernel release>/<driver>-<config hash>-<source hash>/
+#       <module>.ko
+#       MANIFEST
+#
+# The config hash covers only the options that change how the drivers are
+# built or whether they load (HID, USB, input, module versioning and
+# signing, compiler). It is taken from the kernel headers, or from
+# /boot/config-<release> when the headers are not installed, so targets
+# can look up artifacts without a build environment.
+#
+# MODULE_CACHE_DIR may be a shared mount (NFS, synced directory) that a
+# build host fills for every kernel in a rollout.
+#
+# Usage:
+#   module-cache.sh build [-k RELEASE]...   Build and store artifacts
+#   module-cache.sh install [-k RELEASE]    Install matching artifacts
+#   module-cache.sh key [-k RELEASE]        Print the artifact keys
+#
+# The installers source this file and fall back to DKMS when
+# module_cache_install finds no artifact.
+#
+# SPDX-License-Identifier: GPL-2.0
+
+MODULE_CACHE_DIR="${MODULE_CACHE_DIR:-/var/cache/apple-t1/modules}"
+
+_MC_PROJECT_ROOT="$(dirname "$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)")"
+
+# Options that affect the built modules; everything else is ignored
+readonly _MC_CONFIG_PATTERN='^CONFIG_(HID|USB|INPUT|MODVERSIONS|MODULE_SIG|MODULE_UNLOAD|CC_VERSION_TEXT|GCC_VERSION|CLANG_VERSION|RUSTC_VERSION|SMP|PREEMPT|64BIT|X86_64|LOCKDEP|DEBUG_LOCK_ALLOC|KASAN|RANDSTRUCT|CFI|RETPOLINE|MITIGATION_)[A-Z0-9_]*='
+
+if ! declare -F log_info >/dev/null; then
+    log_info() { echo -e "\033[0;32m[✓]\033[0m $*"; }
+    log_warn() { echo -e "\033[1;33m[!]\033[0m $*"; }
+    log_error() { echo -e "\033[0;31m[✗]\033[0m $*"; }
+    log_debug() {
+        [[ "${VERBOSE:-0}" -eq 1 ]] && echo -e "\033[0;34m[DEBUG]\033[0m $*" >&2
+        return 0
+    }
+fi
+
+# driver name -> "source dir:module name"
+_mc_driver() {
+    case "$1" in
+        apple-ibridge)
+            echo "$_MC_PROJECT_ROOT/drivers/apple-ibridge-src:apple_ibridge"
+            ;;
+        apple-touchbar)
+            echo "$_MC_PROJECT_ROOT/drivers/apple-touchbar-src:apple_ib_tb"
+            ;;
+        *)
+            return 1
+            ;;
+    esac
+}
+
+module_cache_src_dir() {
+    local info
+    info="$(_mc_driver "$1")" || return 1
+    echo "${info%%:*}"
+}
+
+_mc_module() {
+    local info
+    info="$(_mc_driver "$1")" || return 1
+    echo "${info##*:}"
+}
+
+_mc_sha() {
+    sha256sum | cut -c1-16
+}
+
+# Hash of the sources a driver is built from. apple-touchbar includes the
+# apple-ibridge header, so that is part of its key as well.
+module_cache_src_hash() {
+    local driver="$1"
+    local src
+    src="$(module_cache_src_dir "$driver")" || return 1
+
+    {
+        (cd "$src" && find . -maxdepth 1 -type f \
+            \( -name '*.c' -o -name '*.h' -o -name 'Makefile*' -o -name 'Kbuild' \) \
+            | LC_ALL=C sort | xargs sha256sum)
+        if [[ "$driver" == "apple-touchbar" ]]; then
+            (cd "$_MC_PROJECT_ROOT/drivers/apple-ibridge-src" && sha256sum apple-ibridge.h)
+        fi
+    } | _mc_sha
+}
+
+# Hash of the relevant kernel options for RELEASE
+module_cache_config_hash() {
+    local krel="$1"
+    local config
+
+    for config in "/lib/modules/$krel/build/include/config/auto.conf" \
+                  "/lib/modules/$krel/build/.config" \
+                  "/boot/config-$krel"; do
+        if [[ -r "$config" ]]; then
+            { grep -E "$_MC_CONFIG_PATTERN" "$config" || true; } \
+                | LC_ALL=C sort | _mc_sha
+            return 0
+        fi
+    done
+
+    log_debug "No kernel config found for $krel"
+    return 1
+}
+
+module_cache_key() {
+    local driver="$1"
+    local krel="$2"
+    local config_hash src_hash
+
+    config_hash="$(module_cache_config_hash "$krel")" || return 1
+    src_hash="$(module_cache_src_hash "$driver")" || return 1
+
+    echo "$krel/$driver-$config_hash-$src_hash"
+}
+
+# Print the artifact directory for DRIVER on RELEASE, fail if there is none
+module_cache_lookup() {
+    local driver="$1"
+    local krel="$2"
+    local key module dir
+
+    key="$(module_cache_key "$driver" "$krel")" || return 1
+    module="$(_mc_module "$driver")"
+    dir="$MODULE_CACHE_DIR/$key"
+
+    [[ -f "$dir/$module.ko" && -f "$dir/MANIFEST" ]] || return 1
+    echo "$dir"
+}
+
+# Install the cached DRIVER for RELEASE; returns 1 when there is no usable
+# artifact, so the caller can build it instead
+module_cache_install() {
+    local driver="$1"
+    local krel="${2:-$(uname -r)}"
+    local dir module vermagic dest
+
+    if [[ "${MODULE_CACHE:-1}" -eq 0 ]]; then
+        return 1
+    fi
+
+    if ! dir="$(module_cache_lookup "$driver" "$krel")"; then
+        log_debug "No cached $driver for $krel in $MODULE_CACHE_DIR"
+        return 1
+    fi
+
+    module="$(_mc_module "$driver")"
+    vermagic="$(modinfo -F vermagic "$dir/$module.ko" 2>/dev/null | awk '{print $1}')"
+    if [[ "$vermagic" != "$krel" ]]; then
+        log_warn "Cached $driver in $dir is for '${vermagic:-unknown}', not $krel"
+        return 1
+    fi
+
+    # Replace a DKMS build of the same module, depmod would pick either
+    if command -v dkms &>/dev/null &&
+       dkms status -m "$driver" -k "$krel" 2>/dev/null | grep -q installed; then
+        log_debug "Removing DKMS build of $driver for $krel"
+        dkms remove -m "$driver" -v "1.0" -k "$krel" 2>/dev/null || true
+    fi
+
+    dest="/lib/modules/$krel/updates/apple-t1"
+    mkdir -p "$dest"
+    install -m 0644 "$dir/$module.ko" "$dest/$module.ko"
+    depmod -a "$krel"
+
+    log_info "Installed prebuilt $driver from $dir"
+    return 0
+}
+
+# Build both drivers for RELEASE and store them. The sources are staged
+# side by side so apple-touchbar finds the apple-ibridge header and
+# symbols, as it would in the kernel tree.
+module_cache_build() {
+    local krel="$1"
+    local kdir="/lib/modules/$krel/build"
+    local stage rc=0
+
+    if [[ ! -d "$kdir" ]]; then
+        log_error "Kernel headers for $krel not found in $kdir"
+        return 1
+    fi
+
+    stage="$(mktemp -d)"
+    _mc_build_staged "$krel" "$kdir" "$stage" || rc=1
+    rm -rf "$stage"
+
+    return $rc
+}
+
+_mc_build_staged() {
+    local krel="$1"
+    local kdir="$2"
+    local stage="$3"
+    local driver src module key dir tmp
+
+    for driver in apple-ibridge apple-touchbar; do
+        src="$(module_cache_src_dir "$driver")"
+        module="$(_mc_module "$driver")"
+        key="$(module_cache_key "$driver" "$krel")" || return 1
+        dir="$MODULE_CACHE_DIR/$key"
+
+        mkdir -p "$stage/$driver"
+        cp -r "$src"/* "$stage/$driver/"
+
+        if [[ -f "$dir/$module.ko" ]]; then
+            log_info "$driver for $krel already cached ($key)"
+            # apple-touchbar still needs the apple-ibridge symbols
+            [[ "$driver" == "apple-ibridge" ]] || continue
+        fi
+
+        log_info "Building $driver for $krel..."
+        if ! (cd "$stage/$driver" &&
+              make -C "$kdir" M="$PWD" KCFLAGS="-I$stage" \
+                  KBUILD_EXTRA_SYMBOLS="$stage/apple-ibridge/Module.symvers" \
+                  modules >"$stage/$driver.log" 2>&1); then
+            log_error "Failed to build $driver for $krel"
+            tail -n 20 "$stage/$driver.log" >&2
+            return 1
+        fi
+
+        [[ -f "$dir/$module.ko" ]] && continue
+
+        # Publish atomically, a shared cache may be read concurrently
+        mkdir -p "$(dirname "$dir")"
+        tmp="$(mktemp -d "$dir.XXXXXX")"
+        install -m 0644 "$stage/$driver/$module.ko" "$tmp/$module.ko"
+        cat >"$tmp/MANIFEST" <<EOF
+driver=$driver
+module=$module
+kernel_release=$krel
+config_hash=$(module_cache_config_hash "$krel")
+source_hash=$(module_cache_src_hash "$driver")
+vermagic=$(modinfo -F vermagic "$tmp/$module.ko")
+built_on=$(uname -n)
+built_at=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+EOF
+        chmod 0755 "$tmp"
+        if ! mv -T "$tmp" "$dir" 2>/dev/null; then
+            rm -rf "$tmp"
+        fi
+
+        log_info "Stored $driver as $key"
+    done
+}
+
+_mc_usage() {
+    cat <<EOF
+Usage: $0 <build|install|key> [-k RELEASE]...
+
+Prebuilt module artifacts in \$MODULE_CACHE_DIR ($MODULE_CACHE_DIR).
+
+    build      Build apple-ibridge and apple-touchbar and store them
+    install    Install matching artifacts (exit 1 if any is missing)
+    key        Print the artifact key of each driver
+
+    -k RELEASE Kernel release, may be repeated (default: $(uname -r))
+EOF
+}
+
+module_cache_main() {
+    local cmd="${1:-}"
+    local releases=()
+    local krel driver rc=0
+
+    [[ $# -gt 0 ]] && shift
+    while [[ $# -gt 0 ]]; do
+        case "$1" in
+            -k|--kernel)
+                releases+=("$2")
+                shift 2
+                ;;
+            *)
+                _mc_usage
+                return 1
+                ;;
+        esac
+    done
+    [[ ${#releases[@]} -gt 0 ]] || releases=("$(uname -r)")
+
+    for krel in "${releases[@]}"; do
+        case "$cmd" in
+            build)
+                module_cache_build "$krel" || rc=1
+                ;;
+            install)
+                for driver in apple-ibridge apple-touchbar; do
+                    module_cache_install "$driver" "$krel" || rc=1
+                done
+                ;;
+            key)
+                for driver in apple-ibridge apple-touchbar; do
+                    module_cache_key "$driver" "$krel" || {
+                        log_warn "No kernel config found for $krel"
+                        rc=1
+                    }
+                done
+                ;;
+            *)
+                _mc_usage
+                return 1
+                ;;
+        esac
+    done
+
+    return $rc
+}
+
+if [[ "${BASH_SOURCE[0]}" == "$0" ]]; then
+    set -euo pipefail
+    module_cache_main "$@"
+fi
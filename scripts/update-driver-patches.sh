@@ -0,0 +1,177 @@
+#!/bin/bash
+#
+# update-driver-patches.sh - Regenerate the driver sources in kernel/patches
+#
+# The iBridge and Touch Bar patches add the drivers as new files under
+# drivers/hid. Their sources live in drivers/*-src, which DKMS builds; this
+# rewrites the new-file sections of the patches from those sources so the
+# two never drift apart. The Kconfig and Makefile hunks and the commit
+# messages are kept as they are.
+#
+# SPDX-License-Identifier: GPL-2.0
+
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(dirname "$SCRIPT_DIR")"
+PATCHES_DIR="$PROJECT_ROOT/kernel/patches"
+
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+NC='\033[0m'
+
+log_info() {
+    echo -e "${GREEN}[✓]${NC} $*"
+}
+
+log_error() {
+    echo -e "${RED}[✗]${NC} $*"
+}
+
+# <source in drivers/> <destination in the kernel tree>, per patch
+IBRIDGE_FILES=(
+    "apple-ibridge-src/apple-ibridge.c" "drivers/hid/apple-ibridge.c"
+    "apple-ibridge-src/apple-ibridge.h" "drivers/hid/apple-ibridge.h"
+)
+
+TOUCHBAR_FILES=(
+    "apple-touchbar-src/apple-ib-tb.c" "drivers/hid/apple-touchbar.c"
+    "apple-touchbar-src/apple-ib-tb.h" "drivers/hid/apple-ib-tb.h"
+    "apple-touchbar-src/apple-ib-tb-contact.h" "drivers/hid/apple-ib-tb-contact.h"
+    "apple-touchbar-src/apple-ib-tb-keymap.h" "drivers/hid/apple-ib-tb-keymap.h"
+    "apple-touchbar-src/apple-ib-tb-state.h" "drivers/hid/apple-ib-tb-state.h"
+)
+
+# Out of tree the touch bar finds the iBridge header in its own directory,
+# in drivers/hid the two sit side by side
+kernel_source() {
+    sed 's|#include "apple-ibridge/apple-ibridge.h"|#include "apple-ibridge.h"|' \
+        "$PROJECT_ROOT/drivers/$1"
+}
+
+# Print a git new-file section for <source> installed as <destination>
+new_file_section() {
+    local src="$1" dst="$2"
+    local lines blob
+
+    lines=$(kernel_source "$src" | wc -l)
+    blob=$(kernel_source "$src" | git hash-object --stdin)
+
+    echo "diff --git a/$dst b/$dst"
+    echo "new file mode 100644"
+    echo "index 0000000000000..${blob:0:13}"
+    echo "--- /dev/null"
+    echo "+++ b/$dst"
+    echo "@@ -0,0 +1,$lines @@"
+    kernel_source "$src" | sed 's/^/+/'
+}
+
+# Print the diffstat of the sections on stdin
+diffstat_of() {
+    awk '
+        /^diff --git / {
+            file = $4; sub(/^b\//, "", file)
+            files[++n] = file
+            next
+        }
+        /^(---|\+\+\+) / { next }
+        /^\+/ { add[file]++ }
+        /^-/ { del[file]++ }
+        END {
+            width = 0
+            for (i = 1; i <= n; i++) {
+                if (length(files[i]) > width)
+                    width = length(files[i])
+            }
+            for (i = 1; i <= n; i++) {
+                f = files[i]
+                a = add[f] + 0; d = del[f] + 0
+                bar = ""
+                for (j = 0; j < a && j < 40; j++) bar = bar "+"
+                for (j = 0; j < d && j < 40; j++) bar = bar "-"
+                printf " %-*s | %5d %s\n", width, f, a + d, bar
+                tadd += a; tdel += d
+            }
+            printf " %d files changed, %d insertions(+)", n, tadd
+            if (tdel)
+                printf ", %d deletions(-)", tdel
+            printf "\n"
+        }'
+}
+
+# Rewrite <patch> with the new-file sections of <files...>
+regenerate() {
+    local patch="$1"
+    shift
+    local files=("$@")
+    local body sections="" dsts=() i
+
+    for ((i = 0; i < ${#files[@]}; i += 2)); do
+        dsts+=("${files[i + 1]}")
+    done
+
+    # Hunks for everything else, up to the trailer
+    body=$(awk -v skip="${dsts[*]}" '
+        BEGIN { n = split(skip, s, " "); for (i = 1; i <= n; i++) drop["b/" s[i]] = 1 }
+        /^diff --git / { in_diff = 1; keep = !($4 in drop) }
+        /^--$/ && in_diff { exit }
+        in_diff && keep { print }
+    ' "$patch")
+
+    for ((i = 0; i < ${#files[@]}; i += 2)); do
+        sections+="$(new_file_section "${files[i]}" "${files[i + 1]}")"$'\n'
+    done
+
+    {
+        # Commit message up to the diffstat
+        sed -n '1,/^---$/p' "$patch"
+        printf '%s\n%s' "$body" "$sections" | diffstat_of
+        for ((i = 1; i < ${#files[@]}; i += 2)); do
+            echo " create mode 100644 ${files[i]}"
+        done
+        echo
+        echo "$body"
+        printf '%s' "$sections"
+        # Trailer
+        sed -n '/^--$/,$p' "$patch" | tail -n 2
+    }
+}
+
+# The patch that adds <Kconfig symbol>
+patch_adding() {
+    grep -l "^+config $1\$" "$PATCHES_DIR"/0*.patch
+}
+
+main() {
+    local check=0 failed=0
+    local patch out
+
+    if [[ "${1:-}" == "--check" ]]; then
+        check=1
+    fi
+
+    for entry in "HID_APPLE_IBRIDGE IBRIDGE_FILES" \
+                 "HID_APPLE_TOUCHBAR TOUCHBAR_FILES"; do
+        local symbol="${entry% *}"
+        local -n list="${entry#* }"
+
+        patch=$(patch_adding "$symbol")
+        out=$(regenerate "$patch" "${list[@]}")
+
+        if [[ $check -eq 1 ]]; then
+            if [[ "$out" == "$(cat "$patch")" ]]; then
+                log_info "$(basename "$patch") matches drivers/"
+            else
+                log_error "$(basename "$patch") is out of date, run $0"
+                failed=1
+            fi
+        else
+            echo "$out" > "$patch"
+            log_info "Regenerated $(basename "$patch")"
+        fi
+    done
+
+    return $failed
+}
+
+main "$@"
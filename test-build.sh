@@ -104,12 +104,19 @@ test_critical_files() {
     
     test_file_exists "$PROJECT_ROOT/scripts/install-touchbar.sh" "Main install script"
     test_file_exists "$PROJECT_ROOT/scripts/install-drivers.sh" "Driver install script"
+    test_file_exists "$PROJECT_ROOT/scripts/module-cache.sh" "Module artifact cache script"
     test_file_exists "$PROJECT_ROOT/scripts/detect-kernel-features.sh" "Feature detection script"
     test_file_exists "$PROJECT_ROOT/scripts/build-kernel.sh" "Kernel build script"
+    test_file_exists "$PROJECT_ROOT/scripts/update-driver-patches.sh" "Driver patch generator"
     
     test_file_exists "$PROJECT_ROOT/assets/extract-touchbar-assets.sh" "Asset extraction script"
     test_file_exists "$PROJECT_ROOT/udev/99-apple-touchbar.rules" "udev rules"
+    test_file_exists "$PROJECT_ROOT/udev/60-apple-touchbar.hwdb" "udev hwdb"
     test_file_exists "$PROJECT_ROOT/systemd/tiny-dfr.service" "systemd service"
+    test_file_exists "$PROJECT_ROOT/systemd/tiny-dfr-initrd.service" "initramfs systemd service"
+    test_file_exists "$PROJECT_ROOT/initramfs/dracut/90tiny-dfr/module-setup.sh" "dracut module"
+    test_file_exists "$PROJECT_ROOT/initramfs/mkinitcpio/install/tiny-dfr" "mkinitcpio install hook"
+    test_file_exists "$PROJECT_ROOT/initramfs/mkinitcpio/hooks/tiny-dfr" "mkinitcpio runtime hook"
     
     test_file_exists "$PROJECT_ROOT/third_party/tiny-dfr/tiny-dfr.c" "tiny-dfr source"
     test_file_exists "$PROJECT_ROOT/third_party/tiny-dfr/Makefile" "tiny-dfr Makefile"
@@ -123,8 +130,10 @@ test_script_permissions() {
     local scripts=(
         "$PROJECT_ROOT/scripts/install-touchbar.sh"
         "$PROJECT_ROOT/scripts/install-drivers.sh"
+        "$PROJECT_ROOT/scripts/module-cache.sh"
         "$PROJECT_ROOT/scripts/detect-kernel-features.sh"
         "$PROJECT_ROOT/scripts/build-kernel.sh"
+        "$PROJECT_ROOT/scripts/update-driver-patches.sh"
         "$PROJECT_ROOT/assets/extract-touchbar-assets.sh"
         "$PROJECT_ROOT/test-build.sh"
     )
@@ -145,8 +154,11 @@ test_shell_syntax() {
     local scripts=(
         "$PROJECT_ROOT/scripts/install-touchbar.sh"
         "$PROJECT_ROOT/scripts/install-drivers.sh"
+        "$PROJECT_ROOT/scripts/module-cache.sh"
         "$PROJECT_ROOT/scripts/detect-kernel-features.sh"
         "$PROJECT_ROOT/assets/extract-touchbar-assets.sh"
+        "$PROJECT_ROOT/initramfs/dracut/90tiny-dfr/module-setup.sh"
+        "$PROJECT_ROOT/initramfs/mkinitcpio/install/tiny-dfr"
     )
     
     for script in "${scripts[@]}"; do
@@ -186,10 +198,10 @@ test_udev_rules() {
         log_fail "udev rules missing SUBSYSTEM rules"
     fi
     
-    if grep -q "05ac" "$PROJECT_ROOT/udev/99-apple-touchbar.rules"; then
-        log_pass "udev rules contain Apple vendor ID (05ac)"
+    if grep -qi "v05ACp8600" "$PROJECT_ROOT/udev/60-apple-touchbar.hwdb"; then
+        log_pass "udev hwdb contains Apple iBridge ID (05ac:8600)"
     else
-        log_fail "udev rules missing Apple vendor ID"
+        log_fail "udev hwdb missing Apple iBridge ID"
     fi
 }
 
@@ -262,6 +274,55 @@ test_patch_format() {
     done
 }
 
+# The driver patches carry drivers/*-src, regenerated by
+# scripts/update-driver-patches.sh
+test_patch_sources() {
+    log_test "Patch Driver Sources"
+    
+    if "$PROJECT_ROOT/scripts/update-driver-patches.sh" --check >/dev/null; then
+        log_pass "Driver patches match drivers/"
+    else
+        log_fail "Driver patches are out of date with drivers/"
+    fi
+}
+
+# The state machine and contact assembly are shared with host tools, keep
+# them kernel-free
+test_host_sources() {
+    log_test "Host-Compilable Driver Sources"
+    
+    local headers=(
+        "$PROJECT_ROOT/drivers/apple-touchbar-src/apple-ib-tb-state.h"
+        "$PROJECT_ROOT/drivers/apple-touchbar-src/apple-ib-tb-contact.h"
+        "$PROJECT_ROOT/drivers/apple-touchbar-src/apple-ib-tb-keymap.h"
+    )
+    
+    for header in "${headers[@]}"; do
+        if echo '#include "'"$header"'"' | \
+           ${CC:-cc} -std=c99 -Wall -Wextra -Werror -fsyntax-only -x c - \
+           2>/dev/null; then
+            log_pass "Builds on host: $(basename "$header")"
+        else
+            log_fail "Not host-compilable: $(basename "$header")"
+        fi
+    done
+
+    # Scripted scenarios: transitions, timer arms, wakeups and USB writes,
+    # and the contacts assembled from report fields
+    local sim_dir="$PROJECT_ROOT/tools/tb-sim"
+    local output
+
+    if output=$(make -s -C "$sim_dir" test \
+                CFLAGS="-std=c99 -Wall -Wextra -Werror -O2" 2>&1); then
+        echo "$output" | grep "scenarios passed" | sed 's/^/    /'
+        log_pass "State machine and contact scenarios"
+    else
+        echo "$output" | grep -E "FAIL|error" | sed 's/^/    /'
+        log_fail "State machine or contact scenarios failed"
+    fi
+    make -s -C "$sim_dir" clean >/dev/null 2>&1
+}
+
 # Main test runner
 main() {
     echo -e "${BLUE}╔════════════════════════════════════════════════════════╗${NC}"
@@ -296,6 +357,12 @@ main() {
     test_patch_format
     echo ""
     
+    test_patch_sources
+    echo ""
+    
+    test_host_sources
+    echo ""
+    
     # Summary
     local total=$((TESTS_PASSED + TESTS_FAILED))
     echo -e "${BLUE}╔════════════════════════════════════════════════════════╗${NC}"
@@ -0,0 +1,847 @@
+/*
+ * config.c - Layout configuration, compiled cache and hot reload
+ *
+ * The text configuration is parsed and validated once into a compact
+ * binary image, which is written to "<config name>.cache" in the cache
+ * directory ($CACHE_DIRECTORY, set by the unit's CacheDirectory=, or
+ * /var/cache/tiny-dfr). Later starts map that image and use it in place,
+ * as long as it is newer than (and matches the size of) the text file.
+ * The image is in host byte order and is only meant for the machine that
+ * wrote it.
+ *
+ * Format of the text file:
+ *
+ *   # comment
+ *   [general]
+ *   layout = default         # layout shown at startup
+ *   dim_timeout = 5          # seconds
+ *   idle_timeout = 60        # seconds
+ *   brightness = 100         # percent
+ *   dim_brightness = 40      # percent
+ *   gamma = 2.2              # brightness curve exponent
+ *   fade_ms = 250
+ *
+ *   [layout default]
+ *   special = esc:ESC vol-:VOLUMEDOWN vol+:VOLUMEUP @clock:NONE
+ *   fkeys = esc:ESC F1:F1 F2:F2
+ *
+ *   [layout media]
+ *   apps = mpv vlc spotify   # shown while one of these has focus
+ *   special = esc:ESC prev:PREVIOUSSONG play:PLAYPAUSE next:NEXTSONG
+ *   fkeys = esc:ESC F1:F1 F2:F2
+ *
+ * Each key is "label:KEY", KEY being a key_names[] entry. The keys of a
+ * layer share the bar evenly, and each position the touch bar reports
+ * (ESC, F1-F12) sends the code of the key drawn over its centre: the
+ * layout on screen is loaded into apple-ib-tb as its keymap (events.c).
+ * A label of the form "@name" shows a widget (see widget.c) instead of
+ * text. NONE makes a key display-only. Apps are the app ids (Wayland) or
+ * WM_CLASS names (X11) reported on the focus socket, compared ignoring
+ * case; an app no layout lists gets the [general] layout.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <linux/input-event-codes.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tiny-dfr.h"
+
+#define CONFIG_MAGIC "TDFRCFG2"
+#define CONFIG_CACHE_DIR "/var/cache/tiny-dfr"
+#define CONFIG_MAX_LAYOUTS 64
+#define CONFIG_MAX_LABEL 15
+#define CONFIG_MAX_LINE 1024
+
+struct config_file_header {
+    char magic[8];
+    uint32_t size;
+    uint32_t nlayouts;
+    int64_t src_mtime_ns;
+    int64_t src_size;
+    uint32_t dim_timeout;
+    uint32_t idle_timeout;
+    uint32_t fade_ms;
+    uint32_t gamma_milli;
+    uint32_t brightness;
+    uint32_t dim_brightness;
+    uint32_t active_layout;
+    uint32_t strings_size;
+};
+
+struct config_file_key {
+    uint32_t label;
+    uint32_t code;
+};
+
+struct config_file_layout {
+    uint32_t name;
+    uint32_t apps;
+    uint32_t nkeys[DFR_LAYER_COUNT];
+    struct config_file_key keys[DFR_LAYER_COUNT][DFR_MAX_KEYS];
+};
+
+/* The codes apple-ib-tb lets a position send, by name without KEY_ */
+#define KEY_NAME(usage, code, label, repeat) { #code + 4, code },
+#define EXTRA_KEY_NAME(code, repeat) { #code + 4, code },
+
+static const struct {
+    const char *name;
+    uint16_t code;
+} key_names[] = {
+    { "NONE", KEY_RESERVED },
+    APPLETB_KEYMAP_FKEYS(KEY_NAME)
+    APPLETB_KEYMAP_SPECIAL(KEY_NAME)
+    APPLETB_KEYMAP_EXTRA(EXTRA_KEY_NAME)
+};
+
+static int64_t mtime_ns(const struct stat *st)
+{
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static int lookup_key(const char *name)
+{
+    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+        if (strcasecmp(key_names[i].name, name) == 0) {
+            return key_names[i].code;
+        }
+    }
+
+    return -1;
+}
+
+/* Compiler state: binary image under construction */
+struct config_builder {
+    struct config_file_header hdr;
+    struct config_file_layout layouts[CONFIG_MAX_LAYOUTS];
+    char *strings;
+    size_t strings_size;
+    size_t strings_alloc;
+    char active[64];
+};
+
+static long add_string(struct config_builder *b, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    if (b->strings_size + len > b->strings_alloc) {
+        size_t alloc = b->strings_alloc ? b->strings_alloc * 2 : 1024;
+        while (alloc < b->strings_size + len) {
+            alloc *= 2;
+        }
+
+        char *strings = realloc(b->strings, alloc);
+        if (!strings) {
+            return -1;
+        }
+        b->strings = strings;
+        b->strings_alloc = alloc;
+    }
+
+    memcpy(b->strings + b->strings_size, str, len);
+    b->strings_size += len;
+    return b->strings_size - len;
+}
+
+static char *trim(char *s)
+{
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+
+    return s;
+}
+
+static int parse_uint(const char *value, unsigned long max,
+                      unsigned long *out)
+{
+    char *end;
+
+    errno = 0;
+    unsigned long v = strtoul(value, &end, 10);
+    if (errno || end == value || *end || v > max) {
+        return -1;
+    }
+
+    *out = v;
+    return 0;
+}
+
+static int parse_general(struct config_builder *b, const char *key,
+                         const char *value)
+{
+    unsigned long v;
+
+    if (strcmp(key, "layout") == 0) {
+        if (strlen(value) >= sizeof(b->active)) {
+            return -1;
+        }
+        strcpy(b->active, value);
+        return 0;
+    }
+
+    if (strcmp(key, "gamma") == 0) {
+        char *end;
+        double gamma = strtod(value, &end);
+
+        if (end == value || *end || gamma < 0.1 || gamma > 5.0) {
+            return -1;
+        }
+        b->hdr.gamma_milli = (uint32_t)(gamma * 1000 + 0.5);
+        return 0;
+    }
+
+    if (strcmp(key, "dim_timeout") == 0) {
+        if (parse_uint(value, 86400, &v) < 0) {
+            return -1;
+        }
+        b->hdr.dim_timeout = v;
+    } else if (strcmp(key, "idle_timeout") == 0) {
+        if (parse_uint(value, 86400, &v) < 0) {
+            return -1;
+        }
+        b->hdr.idle_timeout = v;
+    } else if (strcmp(key, "brightness") == 0) {
+        if (parse_uint(value, 100, &v) < 0) {
+            return -1;
+        }
+        b->hdr.brightness = v;
+    } else if (strcmp(key, "dim_brightness") == 0) {
+        if (parse_uint(value, 100, &v) < 0) {
+            return -1;
+        }
+        b->hdr.dim_brightness = v;
+    } else if (strcmp(key, "fade_ms") == 0) {
+        if (parse_uint(value, 10000, &v) < 0) {
+            return -1;
+        }
+        b->hdr.fade_ms = v;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse "label:KEY label:KEY ..." into one layer of @layout */
+static int parse_layer(struct config_builder *b,
+                       struct config_file_layout *layout,
+                       enum dfr_layer layer, char *value)
+{
+    unsigned int n = 0;
+    char *save = NULL;
+
+    for (char *tok = strtok_r(value, " \t", &save); tok;
+         tok = strtok_r(NULL, " \t", &save)) {
+        char *sep = strrchr(tok, ':');
+
+        if (!sep || sep == tok || n >= DFR_MAX_KEYS) {
+            return -1;
+        }
+        *sep = '\0';
+
+        int code = lookup_key(sep + 1);
+        if (code < 0 || strlen(tok) > CONFIG_MAX_LABEL) {
+            return -1;
+        }
+
+        long label = add_string(b, tok);
+        if (label < 0) {
+            return -1;
+        }
+
+        layout->keys[layer][n].label = label;
+        layout->keys[layer][n].code = code;
+        n++;
+    }
+
+    if (n == 0) {
+        return -1;
+    }
+
+    layout->nkeys[layer] = n;
+    return 0;
+}
+
+/* Parse "app app ..." into a single-spaced list for @layout */
+static int parse_apps(struct config_builder *b,
+                      struct config_file_layout *layout, char *value)
+{
+    char list[CONFIG_MAX_LINE];
+    size_t len = 0;
+    char *save = NULL;
+
+    for (char *tok = strtok_r(value, " \t", &save); tok;
+         tok = strtok_r(NULL, " \t", &save)) {
+        if (len + strlen(tok) + 2 > sizeof(list) ||
+            strlen(tok) >= DFR_FOCUS_APP_MAX) {
+            return -1;
+        }
+        len += sprintf(list + len, len ? " %s" : "%s", tok);
+    }
+
+    if (len == 0) {
+        return -1;
+    }
+
+    long apps = add_string(b, list);
+    if (apps < 0) {
+        return -1;
+    }
+
+    layout->apps = apps;
+    return 0;
+}
+
+static int parse_config(struct config_builder *b, FILE *f, const char *path)
+{
+    struct config_file_layout *layout = NULL;
+    char line[CONFIG_MAX_LINE];
+    int lineno = 0;
+    bool general = false;
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+
+        char *s = trim(line);
+        if (*s == '\0') {
+            continue;
+        }
+
+        if (*s == '[') {
+            char *end = strchr(s, ']');
+            if (!end || end[1] != '\0') {
+                goto invalid;
+            }
+            *end = '\0';
+            s = trim(s + 1);
+
+            general = strcmp(s, "general") == 0;
+            layout = NULL;
+
+            if (!general) {
+                if (strncmp(s, "layout", 6) != 0 ||
+                    !isspace((unsigned char)s[6]) ||
+                    b->hdr.nlayouts >= CONFIG_MAX_LAYOUTS) {
+                    goto invalid;
+                }
+
+                long name = add_string(b, trim(s + 6));
+                if (name < 0) {
+                    goto invalid;
+                }
+
+                layout = &b->layouts[b->hdr.nlayouts++];
+                layout->name = name;
+            }
+            continue;
+        }
+
+        char *eq = strchr(s, '=');
+        if (!eq) {
+            goto invalid;
+        }
+        *eq = '\0';
+
+        char *key = trim(s);
+        char *value = trim(eq + 1);
+
+        if (general) {
+            if (parse_general(b, key, value) < 0) {
+                goto invalid;
+            }
+        } else if (layout && strcmp(key, "special") == 0) {
+            if (parse_layer(b, layout, DFR_LAYER_SPECIAL, value) < 0) {
+                goto invalid;
+            }
+        } else if (layout && strcmp(key, "fkeys") == 0) {
+            if (parse_layer(b, layout, DFR_LAYER_FKEYS, value) < 0) {
+                goto invalid;
+            }
+        } else if (layout && strcmp(key, "apps") == 0) {
+            if (parse_apps(b, layout, value) < 0) {
+                goto invalid;
+            }
+        } else {
+            goto invalid;
+        }
+    }
+
+    return 0;
+
+invalid:
+    syslog(LOG_ERR, "%s:%d: invalid configuration line", path, lineno);
+    return -1;
+}
+
+static int validate_config(struct config_builder *b, const char *path)
+{
+    bool found = b->active[0] == '\0';
+
+    if (b->hdr.nlayouts == 0) {
+        syslog(LOG_ERR, "%s: no layouts defined", path);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < b->hdr.nlayouts; i++) {
+        const char *name = b->strings + b->layouts[i].name;
+
+        for (int l = 0; l < DFR_LAYER_COUNT; l++) {
+            if (b->layouts[i].nkeys[l] == 0) {
+                syslog(LOG_ERR, "%s: layout '%s' is missing a layer",
+                       path, name);
+                return -1;
+            }
+        }
+
+        if (!found && strcmp(b->active, name) == 0) {
+            b->hdr.active_layout = i;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        syslog(LOG_ERR, "%s: layout '%s' not defined", path, b->active);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse and validate @path into a freshly allocated binary image */
+static void *compile_config(const char *path, const struct stat *st,
+                            size_t *size)
+{
+    struct config_builder *b;
+    void *image = NULL;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        syslog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    b = calloc(1, sizeof(*b));
+    if (!b) {
+        fclose(f);
+        return NULL;
+    }
+
+    memcpy(b->hdr.magic, CONFIG_MAGIC, sizeof(b->hdr.magic));
+    b->hdr.src_mtime_ns = mtime_ns(st);
+    b->hdr.src_size = st->st_size;
+    b->hdr.dim_timeout = 5;
+    b->hdr.idle_timeout = 60;
+    b->hdr.brightness = 100;
+    b->hdr.dim_brightness = 40;
+    b->hdr.gamma_milli = 2200;
+    b->hdr.fade_ms = 250;
+
+    if (add_string(b, "") < 0 || parse_config(b, f, path) < 0 ||
+        validate_config(b, path) < 0) {
+        goto out;
+    }
+
+    size_t layouts_size = b->hdr.nlayouts * sizeof(b->layouts[0]);
+
+    b->hdr.strings_size = b->strings_size;
+    b->hdr.size = sizeof(b->hdr) + layouts_size + b->strings_size;
+
+    image = malloc(b->hdr.size);
+    if (!image) {
+        goto out;
+    }
+
+    memcpy(image, &b->hdr, sizeof(b->hdr));
+    memcpy((char *)image + sizeof(b->hdr), b->layouts, layouts_size);
+    memcpy((char *)image + sizeof(b->hdr) + layouts_size, b->strings,
+           b->strings_size);
+    *size = b->hdr.size;
+
+out:
+    fclose(f);
+    free(b->strings);
+    free(b);
+    return image;
+}
+
+/* Where the compiled image of @path lives; false if the name is too long */
+static bool cache_path_of(const char *path, char *cache_path, size_t len)
+{
+    const char *dir = getenv("CACHE_DIRECTORY");
+    char copy[PATH_MAX];
+
+    if (!dir || !*dir) {
+        dir = CONFIG_CACHE_DIR;
+    }
+
+    if (snprintf(copy, sizeof(copy), "%s", path) >= (int)sizeof(copy)) {
+        return false;
+    }
+
+    return snprintf(cache_path, len, "%s/%s.cache", dir, basename(copy)) <
+           (int)len;
+}
+
+static void write_cache(const char *cache_path, const void *image, size_t size)
+{
+    char tmp[PATH_MAX], dir[PATH_MAX];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path) >= (int)sizeof(tmp)) {
+        return;
+    }
+
+    /* systemd creates it; started any other way, the first write does */
+    snprintf(dir, sizeof(dir), "%s", cache_path);
+    mkdir(dirname(dir), 0755);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_DEBUG, "Not caching compiled configuration: %s",
+               strerror(errno));
+        return;
+    }
+
+    if (write(fd, image, size) != (ssize_t)size || fsync(fd) < 0 ||
+        close(fd) < 0 || rename(tmp, cache_path) < 0) {
+        syslog(LOG_WARNING, "Failed to write %s: %s", cache_path,
+               strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* Map the cached image if it is intact and matches the text file */
+static void *map_cache(const char *cache_path, const struct stat *src,
+                       size_t *size)
+{
+    struct stat st;
+
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < sizeof(struct config_file_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct config_file_header *hdr = map;
+
+    if (memcmp(hdr->magic, CONFIG_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->size != (uint64_t)st.st_size ||
+        hdr->src_mtime_ns != mtime_ns(src) ||
+        hdr->src_size != src->st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return map;
+}
+
+/*
+ * Build a dfr_config whose layouts point straight into @image. Everything
+ * is bounds-checked, since the image may come from disk.
+ */
+static struct dfr_config *load_image(void *image, size_t size, bool mapped)
+{
+    const struct config_file_header *hdr = image;
+
+    if (hdr->nlayouts == 0 || hdr->nlayouts > CONFIG_MAX_LAYOUTS ||
+        hdr->active_layout >= hdr->nlayouts ||
+        sizeof(*hdr) + hdr->nlayouts * sizeof(struct config_file_layout) +
+            hdr->strings_size != size) {
+        return NULL;
+    }
+
+    const struct config_file_layout *layouts =
+        (const void *)((const char *)image + sizeof(*hdr));
+    const char *strings = (const char *)(layouts + hdr->nlayouts);
+
+    if (hdr->strings_size == 0 || strings[hdr->strings_size - 1] != '\0') {
+        return NULL;
+    }
+
+    struct dfr_config *config = calloc(1, sizeof(*config));
+    if (!config) {
+        return NULL;
+    }
+
+    config->layouts = calloc(hdr->nlayouts, sizeof(*config->layouts));
+    if (!config->layouts) {
+        free(config);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < hdr->nlayouts; i++) {
+        struct dfr_layout *layout = &config->layouts[i];
+
+        if (layouts[i].name >= hdr->strings_size ||
+            layouts[i].apps >= hdr->strings_size) {
+            goto invalid;
+        }
+        layout->name = strings + layouts[i].name;
+        layout->apps = strings + layouts[i].apps;
+
+        for (int l = 0; l < DFR_LAYER_COUNT; l++) {
+            if (layouts[i].nkeys[l] == 0 ||
+                layouts[i].nkeys[l] > DFR_MAX_KEYS) {
+                goto invalid;
+            }
+            layout->layers[l].nkeys = layouts[i].nkeys[l];
+
+            for (uint32_t k = 0; k < layouts[i].nkeys[l]; k++) {
+                const struct config_file_key *key = &layouts[i].keys[l][k];
+
+                if (key->label >= hdr->strings_size) {
+                    goto invalid;
+                }
+                layout->layers[l].keys[k].label = strings + key->label;
+                layout->layers[l].keys[k].code = key->code;
+            }
+        }
+    }
+
+    config->nlayouts = hdr->nlayouts;
+    config->active = &config->layouts[hdr->active_layout];
+    config->dim_timeout = hdr->dim_timeout;
+    config->idle_timeout = hdr->idle_timeout;
+    config->fade_ms = hdr->fade_ms;
+    config->gamma = hdr->gamma_milli / 1000.0;
+    config->brightness = hdr->brightness;
+    config->dim_brightness = hdr->dim_brightness;
+    config->image = image;
+    config->image_size = size;
+    config->mapped = mapped;
+    return config;
+
+invalid:
+    free(config->layouts);
+    free(config);
+    return NULL;
+}
+
+struct dfr_config *dfr_config_default(void)
+{
+    struct dfr_config *config = calloc(1, sizeof(*config));
+    if (!config) {
+        return NULL;
+    }
+
+    config->nlayouts = 1;
+    config->active = &dfr_default_layout;
+    config->dim_timeout = 5;
+    config->idle_timeout = 60;
+    config->fade_ms = 250;
+    config->gamma = 2.2;
+    config->brightness = 100;
+    config->dim_brightness = 40;
+    return config;
+}
+
+struct dfr_config *dfr_config_load(const char *path)
+{
+    char cache_path[PATH_MAX];
+    struct stat st;
+    size_t size;
+
+    if (stat(path, &st) < 0) {
+        if (errno == ENOENT) {
+            syslog(LOG_INFO, "No configuration at %s, using built-in layout",
+                   path);
+            return dfr_config_default();
+        }
+        syslog(LOG_ERR, "Failed to stat %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (!cache_path_of(path, cache_path, sizeof(cache_path))) {
+        return NULL;
+    }
+
+    void *image = map_cache(cache_path, &st, &size);
+    if (image) {
+        struct dfr_config *config = load_image(image, size, true);
+        if (config) {
+            syslog(LOG_DEBUG, "Loaded compiled configuration %s", cache_path);
+            return config;
+        }
+        munmap(image, size);
+    }
+
+    image = compile_config(path, &st, &size);
+    if (!image) {
+        return NULL;
+    }
+
+    write_cache(cache_path, image, size);
+
+    struct dfr_config *config = load_image(image, size, false);
+    if (!config) {
+        free(image);
+    }
+    return config;
+}
+
+/* Whether the single-spaced @list names @app */
+static bool list_has(const char *list, const char *app)
+{
+    size_t len = strlen(app);
+
+    while (*list) {
+        size_t n = strcspn(list, " ");
+
+        if (n == len && strncasecmp(list, app, n) == 0) {
+            return true;
+        }
+        list += n;
+        list += strspn(list, " ");
+    }
+
+    return false;
+}
+
+/* The first layout listing @app, or the [general] one */
+const struct dfr_layout *dfr_config_app_layout(const struct dfr_config *config,
+                                               const char *app)
+{
+    if (*app) {
+        for (unsigned int i = 0; i < config->nlayouts && config->layouts; i++) {
+            if (list_has(config->layouts[i].apps, app)) {
+                return &config->layouts[i];
+            }
+        }
+    }
+
+    return config->active;
+}
+
+void dfr_config_free(struct dfr_config *config)
+{
+    if (!config) {
+        return;
+    }
+
+    if (config->mapped) {
+        munmap(config->image, config->image_size);
+    } else {
+        free(config->image);
+    }
+
+    free(config->layouts);
+    free(config);
+}
+
+/* The watch on the configuration file, or on its directory while missing */
+static int config_wd = -1;
+
+/*
+ * (Re)watch @path itself. Editors that save by renaming a new file into
+ * place drop the link count of the old one (IN_ATTRIB) and then delete it,
+ * so every change ends in an event here, after which the watch moves to
+ * the file now at @path. While there is none, watch its directory for it
+ * to appear instead.
+ */
+static bool watch_config(int fd, const char *path)
+{
+    char dir[PATH_MAX];
+
+    int wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_ATTRIB |
+                                         IN_MOVE_SELF | IN_DELETE_SELF);
+    if (wd < 0 && errno == ENOENT &&
+        snprintf(dir, sizeof(dir), "%s", path) < (int)sizeof(dir)) {
+        wd = inotify_add_watch(fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO);
+    }
+    if (wd < 0) {
+        syslog(LOG_WARNING, "Cannot watch %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    /* the same inode keeps its watch */
+    if (config_wd >= 0 && config_wd != wd) {
+        inotify_rm_watch(fd, config_wd);
+    }
+    config_wd = wd;
+    return true;
+}
+
+int dfr_config_watch(const char *path)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        syslog(LOG_WARNING, "Configuration reload disabled: %s",
+               strerror(errno));
+        return -1;
+    }
+
+    if (!watch_config(fd, path)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Drain @fd; returns true if any event concerned @path */
+bool dfr_config_changed(int fd, const char *path)
+{
+    char copy[PATH_MAX];
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t n;
+
+    snprintf(copy, sizeof(copy), "%s", path);
+    const char *name = basename(copy);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const void *)p;
+
+            /* a directory watch sees every file in it, a file watch no names */
+            if (ev->wd == config_wd &&
+                (ev->len == 0 || strcmp(ev->name, name) == 0)) {
+                changed = true;
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+
+    /* the file may be another inode now, or have appeared */
+    if (changed) {
+        watch_config(fd, path);
+    }
+
+    return changed;
+}
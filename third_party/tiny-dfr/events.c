@@ -0,0 +1,149 @@
+/*
+ * events.c - Touch Bar input from the apple-ib-tb event ring
+ *
+ * /dev/appletb shares a ring of decoded contacts and key transitions with
+ * us. The kernel signals an eventfd once per input report; each wakeup
+ * then drains whatever has accumulated straight from the mapping, without
+ * a read() per report or any copying.
+ *
+ * The layout on screen is also loaded into the driver as its keymap, so
+ * the touch bar positions send the codes of the keys drawn over them.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "tiny-dfr.h"
+
+#define RING_DEVICE "/dev/appletb"
+
+/* Map the event ring and register an eventfd for it. Returns 0 or -1. */
+int dfr_events_open(struct dfr_events *ev)
+{
+    ev->dev_fd = open(RING_DEVICE, O_RDWR | O_CLOEXEC);
+    if (ev->dev_fd < 0) {
+        return -1;
+    }
+
+    ev->ring = mmap(NULL, APPLETB_RING_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, ev->dev_fd, 0);
+    if (ev->ring == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to map %s: %s", RING_DEVICE, strerror(errno));
+        goto err_close;
+    }
+
+    if (ev->ring->hdr.version != APPLETB_RING_VERSION ||
+        ev->ring->hdr.entries != APPLETB_RING_ENTRIES ||
+        ev->ring->hdr.entry_size != sizeof(struct appletb_ring_event)) {
+        syslog(LOG_ERR, "Unsupported event ring layout on %s", RING_DEVICE);
+        goto err_unmap;
+    }
+
+    ev->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ev->event_fd < 0) {
+        goto err_unmap;
+    }
+
+    if (ioctl(ev->dev_fd, APPLETB_IOC_SET_EVENTFD, ev->event_fd) < 0) {
+        syslog(LOG_ERR, "Failed to register eventfd: %s", strerror(errno));
+        close(ev->event_fd);
+        goto err_unmap;
+    }
+
+    ev->dropped = ev->ring->hdr.dropped;
+    syslog(LOG_INFO, "Using Touch Bar event ring %s", RING_DEVICE);
+    return 0;
+
+err_unmap:
+    munmap(ev->ring, APPLETB_RING_SIZE);
+err_close:
+    close(ev->dev_fd);
+    ev->dev_fd = -1;
+    return -1;
+}
+
+void dfr_events_close(struct dfr_events *ev)
+{
+    if (ev->dev_fd < 0) {
+        return;
+    }
+
+    munmap(ev->ring, APPLETB_RING_SIZE);
+    close(ev->event_fd);
+    close(ev->dev_fd);
+    ev->dev_fd = -1;
+}
+
+/*
+ * Hand every queued entry to @handle, then release them to the kernel in
+ * one go. Returns the number of entries consumed.
+ */
+unsigned int dfr_events_drain(struct dfr_events *ev, dfr_event_handler handle)
+{
+    struct appletb_ring_header *hdr = &ev->ring->hdr;
+    uint64_t count;
+
+    /* Reset the eventfd first, so a signal racing the drain is kept */
+    if (read(ev->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        syslog(LOG_WARNING, "Event ring eventfd: %s", strerror(errno));
+    }
+
+    uint32_t tail = hdr->tail;
+    uint32_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+    for (uint32_t i = tail; i != head; i++) {
+        handle(&ev->ring->events[i & (APPLETB_RING_ENTRIES - 1)]);
+    }
+
+    __atomic_store_n(&hdr->tail, head, __ATOMIC_RELEASE);
+
+    uint32_t dropped = __atomic_load_n(&hdr->dropped, __ATOMIC_RELAXED);
+    if (dropped != ev->dropped) {
+        syslog(LOG_WARNING, "Touch Bar event ring overflowed, %u events lost",
+               dropped - ev->dropped);
+        ev->dropped = dropped;
+    }
+
+    return head - tail;
+}
+
+/*
+ * Make each touch bar position send the code of the key of @layout drawn
+ * over its centre, in both layers.
+ */
+void dfr_events_set_keymap(struct dfr_events *ev,
+                           const struct dfr_layout *layout)
+{
+    static const enum dfr_layer layers[APPLETB_LAYERS] = {
+        [APPLETB_LAYER_SPECIAL] = DFR_LAYER_SPECIAL,
+        [APPLETB_LAYER_FKEYS] = DFR_LAYER_FKEYS,
+    };
+    struct appletb_keymap map;
+
+    if (ev->dev_fd < 0) {
+        return;
+    }
+
+    for (int l = 0; l < APPLETB_LAYERS; l++) {
+        const struct dfr_layer_def *layer = &layout->layers[layers[l]];
+
+        for (int p = 0; p < APPLETB_POSITIONS; p++) {
+            int x = (2 * p + 1) * DFR_WIDTH / (2 * APPLETB_POSITIONS);
+
+            map.codes[l][p] = layer->keys[dfr_key_at(layer, x)].code;
+        }
+    }
+
+    if (ioctl(ev->dev_fd, APPLETB_IOC_SET_KEYMAP, &map) < 0) {
+        syslog(LOG_WARNING, "Failed to load the keys of layout '%s': %s",
+               layout->name, strerror(errno));
+    }
+}
@@ -0,0 +1,155 @@
+/*
+ * fnkey.c - Fn key state from the built-in keyboard
+ *
+ * The keyboard is found the way apple-ib-tb finds it: the evdev node
+ * that reports KEY_FN. An event mask is installed on our file so the
+ * kernel drops everything but KEY_FN before it is queued; ordinary
+ * typing then never wakes the daemon, since empty SYN_REPORTs are not
+ * delivered either.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <sys/ioctl.h>
+
+#include "tiny-dfr.h"
+
+#define EVDEV_GLOB "/dev/input/event*"
+
+#define BITS_TO_BYTES(n) (((n) + 7) / 8)
+
+static bool test_bit(const uint8_t *bits, unsigned int bit)
+{
+    return bits[bit / 8] & (1 << (bit % 8));
+}
+
+static bool has_fn_key(int fd)
+{
+    uint8_t keys[BITS_TO_BYTES(KEY_CNT)] = { 0 };
+
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0) {
+        return false;
+    }
+
+    return test_bit(keys, KEY_FN);
+}
+
+/*
+ * Let only KEY_FN through; every other maskable event type is masked
+ * entirely. EV_SYN stays, empty reports are dropped by evdev anyway.
+ */
+static int set_fn_mask(int fd)
+{
+    static const unsigned int types[] = {
+        EV_KEY, EV_REL, EV_ABS, EV_MSC, EV_SW, EV_LED, EV_SND, EV_FF,
+    };
+    uint8_t codes[BITS_TO_BYTES(KEY_CNT)];
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        struct input_mask mask = {
+            .type = types[i],
+            .codes_size = sizeof(codes),
+            .codes_ptr = (uintptr_t)codes,
+        };
+
+        memset(codes, 0, sizeof(codes));
+        if (types[i] == EV_KEY) {
+            codes[KEY_FN / 8] |= 1 << (KEY_FN % 8);
+        }
+
+        if (ioctl(fd, EVIOCSMASK, &mask) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Open the keyboard carrying the Fn key, or return -1 if there is none */
+int dfr_fnkey_open(void)
+{
+    glob_t globbuf;
+    int found_fd = -1;
+
+    if (glob(EVDEV_GLOB, 0, NULL, &globbuf) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < globbuf.gl_pathc; i++) {
+        const char *path = globbuf.gl_pathv[i];
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+        if (fd < 0) {
+            continue;
+        }
+
+        if (!has_fn_key(fd)) {
+            close(fd);
+            continue;
+        }
+
+        if (set_fn_mask(fd) < 0) {
+            syslog(LOG_WARNING, "Cannot filter %s for KEY_FN (%s), "
+                   "every keystroke will wake the daemon", path,
+                   strerror(errno));
+        }
+
+        syslog(LOG_INFO, "Tracking Fn key on %s", path);
+        found_fd = fd;
+        break;
+    }
+
+    globfree(&globbuf);
+    return found_fd;
+}
+
+/* Current Fn state as the kernel sees it: 1 if held, 0 if not, -1 on error */
+int dfr_fnkey_state(int fd)
+{
+    uint8_t keys[BITS_TO_BYTES(KEY_CNT)] = { 0 };
+
+    if (ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) < 0) {
+        return -1;
+    }
+
+    return test_bit(keys, KEY_FN);
+}
+
+/*
+ * Drain queued events and update @pressed. A SYN_DROPPED means events
+ * were lost, so the state is read back from the kernel. Returns 0, or
+ * -1 if the device is gone.
+ */
+int dfr_fnkey_read(int fd, bool *pressed)
+{
+    struct input_event ev[16];
+    ssize_t n;
+
+    while ((n = read(fd, ev, sizeof(ev))) > 0) {
+        for (size_t i = 0; i < n / sizeof(ev[0]); i++) {
+            if (ev[i].type == EV_KEY && ev[i].code == KEY_FN) {
+                *pressed = ev[i].value != 0;
+            } else if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED) {
+                int state = dfr_fnkey_state(fd);
+
+                if (state < 0) {
+                    return -1;
+                }
+                *pressed = state;
+            }
+        }
+    }
+
+    if (n < 0 && errno != EAGAIN) {
+        return -1;
+    }
+
+    return 0;
+}
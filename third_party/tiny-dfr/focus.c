@@ -0,0 +1,107 @@
+/*
+ * focus.c - Focused application notifications
+ *
+ * The daemon cannot see windows, so a compositor or window manager helper
+ * tells it which application has focus, one datagram per change:
+ *
+ *   printf 'focus %s' "$app_id" | socat - UNIX-SENDTO:/run/tiny-dfr/focus
+ *
+ * Datagrams keep the socket connectionless, so helpers may come and go
+ * and one fd serves all of them. Only the latest notification queued is
+ * acted on; a burst of focus changes switches the layout once.
+ *
+ * Any local user may send: a notification only picks among the layouts
+ * the administrator configured.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "tiny-dfr.h"
+
+#define FOCUS_VERB "focus "
+
+int dfr_focus_open(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", DFR_FOCUS_SOCKET);
+
+    if (mkdir(DFR_RUN_DIR, 0755) < 0 && errno != EEXIST) {
+        goto err;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        goto err;
+    }
+
+    /* Left over from a previous run */
+    unlink(DFR_FOCUS_SOCKET);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(DFR_FOCUS_SOCKET, 0666) < 0) {
+        close(fd);
+        goto err;
+    }
+
+    return fd;
+
+err:
+    syslog(LOG_WARNING, "No focus socket %s: %s", DFR_FOCUS_SOCKET,
+           strerror(errno));
+    return -1;
+}
+
+void dfr_focus_close(int fd)
+{
+    if (fd < 0) {
+        return;
+    }
+
+    close(fd);
+    unlink(DFR_FOCUS_SOCKET);
+}
+
+/*
+ * Drain the socket and copy the app id of the latest well-formed
+ * notification into @app. Returns false if there was none. An empty app
+ * id (nothing focused) is valid and gets the [general] layout.
+ */
+bool dfr_focus_read(int fd, char *app, size_t size)
+{
+    char buf[sizeof(FOCUS_VERB) + DFR_FOCUS_APP_MAX];
+    bool found = false;
+    ssize_t n;
+
+    /* MSG_TRUNC: the full length, so cut off ids are not taken as real */
+    while ((n = recv(fd, buf, sizeof(buf) - 1, MSG_TRUNC)) >= 0) {
+        if ((size_t)n >= sizeof(buf)) {
+            continue;
+        }
+        buf[n] = '\0';
+        buf[strcspn(buf, "\r\n")] = '\0';
+
+        if (strncmp(buf, FOCUS_VERB, strlen(FOCUS_VERB)) != 0) {
+            continue;
+        }
+
+        const char *id = buf + strlen(FOCUS_VERB);
+        if (strlen(id) >= size || strchr(id, ' ')) {
+            continue;
+        }
+
+        strcpy(app, id);
+        found = true;
+    }
+
+    return found;
+}
@@ -0,0 +1,516 @@
+/*
+ * frame.c - Device frame conversion, per-layer frame caches and submission
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "tiny-dfr.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SSSE3_PATH 1
+#endif
+
+/* Pack pixels of row @y into device bytes [@b0, @b1) */
+static void convert_row(struct dfr_frame *frame,
+                        const struct dfr_surface *surface, int y,
+                        int b0, int b1)
+{
+    const uint8_t *src = surface->px[y];
+    uint8_t *dst = frame->px[y];
+
+    for (int b = b0; b < b1; b++) {
+        int x = b * 2;
+
+        if (x + 1 < DFR_WIDTH) {
+            dst[b] = (src[x] & 0xf0) | (src[x + 1] >> 4);
+        } else {
+            dst[b] = src[x] & 0xf0;
+        }
+    }
+}
+
+/* Device bytes covering @rect, rounded out to whole bytes */
+static void rect_bytes(const struct dfr_rect *rect, int *b0, int *b1)
+{
+    *b0 = rect->x / 2;
+    *b1 = (rect->x + rect->w + 1) / 2;
+}
+
+void dfr_convert_frame(struct dfr_frame *frame,
+                       const struct dfr_surface *surface)
+{
+    for (int y = 0; y < DFR_HEIGHT; y++) {
+        convert_row(frame, surface, y, 0, DFR_STRIDE);
+    }
+}
+
+/*
+ * Convert only @rect of @surface into @frame. Rect edges on odd pixels
+ * take their byte neighbour from @surface as well.
+ */
+void dfr_convert_rect(struct dfr_frame *frame,
+                      const struct dfr_surface *surface,
+                      const struct dfr_rect *rect)
+{
+    int b0, b1;
+
+    rect_bytes(rect, &b0, &b1);
+    for (int y = rect->y; y < rect->y + rect->h; y++) {
+        convert_row(frame, surface, y, b0, b1);
+    }
+}
+
+/*
+ * Brightness is a linear-light scale factor: each 4-bit level is decoded
+ * with @gamma, scaled, and encoded again. For a pure power curve that is
+ * a constant factor on the level, but it keeps fades perceptually even.
+ */
+void dfr_lut_build(struct dfr_lut *lut, double brightness, double gamma)
+{
+    if (brightness < 0) {
+        brightness = 0;
+    } else if (brightness > 100) {
+        brightness = 100;
+    }
+
+    for (int l = 0; l < 16; l++) {
+        double linear = pow(l / 15.0, gamma) * brightness / 100;
+        lut->level[l] = lrint(15 * pow(linear, 1 / gamma));
+    }
+
+    for (int b = 0; b < 256; b++) {
+        lut->byte[b] = lut->level[b >> 4] << 4 | lut->level[b & 0xf];
+    }
+}
+
+static void apply_bytes_scalar(uint8_t *dst, const uint8_t *src, size_t n,
+                               const struct dfr_lut *lut)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = lut->byte[src[i]];
+    }
+}
+
+#ifdef HAVE_SSSE3_PATH
+/* Both nibbles of 16 bytes at once, one pshufb per nibble */
+__attribute__((target("ssse3")))
+static void apply_bytes_ssse3(uint8_t *dst, const uint8_t *src, size_t n,
+                              const struct dfr_lut *lut)
+{
+    const __m128i lo_lut = _mm_loadu_si128((const __m128i *)lut->level);
+    const __m128i hi_lut = _mm_slli_epi16(lo_lut, 4);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_and_si128(v, mask);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+
+        v = _mm_or_si128(_mm_shuffle_epi8(hi_lut, hi),
+                         _mm_shuffle_epi8(lo_lut, lo));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+
+    apply_bytes_scalar(dst + i, src + i, n - i, lut);
+}
+#endif
+
+static void apply_bytes(uint8_t *dst, const uint8_t *src, size_t n,
+                        const struct dfr_lut *lut)
+{
+#ifdef HAVE_SSSE3_PATH
+    static int ssse3 = -1;
+
+    if (ssse3 < 0) {
+        ssse3 = __builtin_cpu_supports("ssse3");
+    }
+    if (ssse3) {
+        apply_bytes_ssse3(dst, src, n, lut);
+        return;
+    }
+#endif
+    apply_bytes_scalar(dst, src, n, lut);
+}
+
+/*
+ * Map @rect of @src through @lut into @dst, or the whole frame if @rect
+ * is NULL. This is the only per-frame cost of a fade.
+ */
+void dfr_lut_apply(struct dfr_frame *dst, const struct dfr_frame *src,
+                   const struct dfr_lut *lut, const struct dfr_rect *rect)
+{
+    int b0, b1;
+
+    if (!rect) {
+        apply_bytes(&dst->px[0][0], &src->px[0][0], sizeof(dst->px), lut);
+        return;
+    }
+
+    rect_bytes(rect, &b0, &b1);
+    for (int y = rect->y; y < rect->y + rect->h; y++) {
+        apply_bytes(&dst->px[y][b0], &src->px[y][b0], b1 - b0, lut);
+    }
+}
+
+void dfr_cache_init(struct dfr_layer_cache *cache,
+                    const struct dfr_layout *layout)
+{
+    cache->layout = layout;
+
+    for (int i = 0; i < DFR_LAYER_COUNT; i++) {
+        cache->valid[i] = false;
+    }
+}
+
+void dfr_cache_invalidate(struct dfr_layer_cache *cache, enum dfr_layer layer)
+{
+    cache->valid[layer] = false;
+}
+
+const struct dfr_frame *dfr_cache_get(struct dfr_layer_cache *cache,
+                                      enum dfr_layer layer)
+{
+    static struct dfr_surface scratch;
+
+    if (!cache->valid[layer]) {
+        dfr_render_layer(&scratch, &cache->layout->layers[layer]);
+        dfr_convert_frame(&cache->frames[layer], &scratch);
+        cache->valid[layer] = true;
+    }
+
+    return &cache->frames[layer];
+}
+
+/* The cache holding @layout, now the most recently used, or NULL */
+struct dfr_layer_cache *dfr_lru_find(struct dfr_layout_lru *lru,
+                                     const struct dfr_layout *layout)
+{
+    for (int i = 0; i < DFR_LAYOUT_SLOTS; i++) {
+        if (lru->used[i] && lru->slots[i].layout == layout) {
+            lru->used[i] = ++lru->clock;
+            return &lru->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Reuse the least recently used cache for @layout, never @keep (the one
+ * on screen). Its layers are rendered on first use like any other cache.
+ */
+struct dfr_layer_cache *dfr_lru_take(struct dfr_layout_lru *lru,
+                                     const struct dfr_layout *layout,
+                                     const struct dfr_layer_cache *keep)
+{
+    int victim = -1;
+
+    for (int i = 0; i < DFR_LAYOUT_SLOTS; i++) {
+        if (&lru->slots[i] != keep &&
+            (victim < 0 || lru->used[i] < lru->used[victim])) {
+            victim = i;
+        }
+    }
+
+    lru->used[victim] = ++lru->clock;
+    dfr_cache_init(&lru->slots[victim], layout);
+    return &lru->slots[victim];
+}
+
+/* Forget every layout but that of @keep, e.g. before its config is freed */
+void dfr_lru_drop(struct dfr_layout_lru *lru,
+                  const struct dfr_layer_cache *keep)
+{
+    for (int i = 0; i < DFR_LAYOUT_SLOTS; i++) {
+        if (&lru->slots[i] != keep) {
+            lru->used[i] = 0;
+        }
+    }
+}
+
+/* Returns 0, or a negative errno */
+static int write_report(int fd, int row, int chunk, const uint8_t *data,
+                        size_t len)
+{
+    uint8_t report[TOUCHBAR_REPORT_LENGTH] = { 0 };
+
+    report[0] = TOUCHBAR_REPORT_ID;
+    report[1] = row;
+    report[2] = chunk;
+    memcpy(&report[DFR_CHUNK_HEADER], data, len);
+
+    ssize_t n = write(fd, report, sizeof(report));
+    if (n < 0) {
+        return -errno;
+    }
+    if (n != sizeof(report)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static long ms_until_deadline(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return DFR_WRITE_DEADLINE_MS - (now.tv_sec - start->tv_sec) * 1000 -
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Send the chunks of @frame that differ from what the device shows,
+ * resuming at the cursor. Gives up between two writes if a newer frame
+ * was posted or the device changed. Returns 0, or a negative errno.
+ */
+static int send_frame(struct dfr_mailbox *mb, const struct dfr_frame *frame,
+                      int fd, unsigned int gen)
+{
+    for (int n = 0; n < DFR_FRAME_CHUNKS; n++) {
+        int y = mb->cursor / DFR_ROW_CHUNKS;
+        int c = mb->cursor % DFR_ROW_CHUNKS;
+        size_t off = (size_t)c * DFR_CHUNK_BYTES;
+        size_t len = DFR_STRIDE - off;
+
+        if (len > DFR_CHUNK_BYTES) {
+            len = DFR_CHUNK_BYTES;
+        }
+
+        if (mb->stale[y][c] || memcmp(&frame->px[y][off],
+                                      &mb->shown.px[y][off], len) != 0) {
+            pthread_mutex_lock(&mb->lock);
+            bool superseded = mb->full || mb->stopping || mb->gen != gen;
+            if (!superseded) {
+                mb->writing = true;
+                clock_gettime(CLOCK_MONOTONIC, &mb->write_start);
+            }
+            pthread_mutex_unlock(&mb->lock);
+
+            if (superseded) {
+                return 0;
+            }
+
+            int ret = write_report(fd, y, c, &frame->px[y][off], len);
+
+            pthread_mutex_lock(&mb->lock);
+            mb->writing = false;
+            mb->late = false;
+            pthread_mutex_unlock(&mb->lock);
+
+            if (ret < 0) {
+                return ret;
+            }
+
+            memcpy(&mb->shown.px[y][off], &frame->px[y][off], len);
+            mb->stale[y][c] = false;
+        }
+
+        mb->cursor = (mb->cursor + 1) % DFR_FRAME_CHUNKS;
+    }
+
+    return 0;
+}
+
+static void *writer(void *arg)
+{
+    struct dfr_mailbox *mb = arg;
+    unsigned int shown_gen = 0;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&mb->lock);
+
+    for (;;) {
+        while (!mb->stopping && !(mb->full && mb->fd >= 0)) {
+            pthread_cond_wait(&mb->wake, &mb->lock);
+        }
+        if (mb->stopping) {
+            break;
+        }
+
+        /* Take the frame, the other buffer receives the next post */
+        struct dfr_frame *frame = mb->slot;
+        mb->slot = frame == &mb->buf[0] ? &mb->buf[1] : &mb->buf[0];
+        mb->full = false;
+        mb->sending = true;
+
+        /* Our own reference: the main loop may close its fd any time */
+        unsigned int gen = mb->gen;
+        int fd = fcntl(mb->fd, F_DUPFD_CLOEXEC, 0);
+        int ret = fd < 0 ? -errno : 0;
+
+        pthread_mutex_unlock(&mb->lock);
+
+        if (gen != shown_gen) {
+            memset(mb->stale, true, sizeof(mb->stale));
+            mb->cursor = 0;
+            shown_gen = gen;
+        }
+
+        if (fd >= 0) {
+            ret = send_frame(mb, frame, fd, gen);
+            close(fd);
+        }
+
+        pthread_mutex_lock(&mb->lock);
+        mb->sending = false;
+        if (ret < 0 && gen == mb->gen && !mb->error) {
+            mb->error = -ret;
+        }
+        if (!mb->full || mb->error) {
+            if (write(mb->done_fd, &one, sizeof(one)) < 0) {
+                syslog(LOG_WARNING, "Failed to signal frame done: %s",
+                       strerror(errno));
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&mb->lock);
+    return NULL;
+}
+
+int dfr_mailbox_init(struct dfr_mailbox *mb)
+{
+    mb->slot = &mb->buf[0];
+    mb->fd = -1;
+    pthread_mutex_init(&mb->lock, NULL);
+    pthread_cond_init(&mb->wake, NULL);
+
+    mb->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mb->done_fd < 0) {
+        syslog(LOG_ERR, "Failed to create frame eventfd: %s",
+               strerror(errno));
+        return -1;
+    }
+
+    int err = pthread_create(&mb->thread, NULL, writer, mb);
+    if (err) {
+        syslog(LOG_ERR, "Failed to start frame writer: %s", strerror(err));
+        close(mb->done_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Waits for a write in progress, which a hung device may take a while on */
+void dfr_mailbox_shutdown(struct dfr_mailbox *mb)
+{
+    pthread_mutex_lock(&mb->lock);
+    mb->stopping = true;
+    pthread_cond_signal(&mb->wake);
+    pthread_mutex_unlock(&mb->lock);
+
+    pthread_join(mb->thread, NULL);
+    close(mb->done_fd);
+}
+
+/*
+ * Write to @fd from now on, -1 for none, and forget what the device
+ * shows, e.g. after it was (re)connected. Must be called before the old
+ * fd is closed. A write still in progress on the old device is abandoned
+ * and its outcome ignored.
+ */
+void dfr_mailbox_reset(struct dfr_mailbox *mb, int fd)
+{
+    pthread_mutex_lock(&mb->lock);
+    mb->fd = fd;
+    mb->gen++;
+    mb->full = false;
+    mb->error = 0;
+    mb->late = mb->writing; /* not ours to time any more */
+    pthread_mutex_unlock(&mb->lock);
+}
+
+/*
+ * Hand the frame composed in mb->pending over to the writer. Whatever of
+ * the previous frame was not sent yet is simply superseded.
+ */
+void dfr_mailbox_post(struct dfr_mailbox *mb)
+{
+    pthread_mutex_lock(&mb->lock);
+
+    mb->posted++;
+    if (mb->full || mb->sending) {
+        mb->replaced++;
+    }
+
+    memcpy(mb->slot, &mb->pending, sizeof(mb->pending));
+    mb->full = true;
+    pthread_cond_signal(&mb->wake);
+
+    pthread_mutex_unlock(&mb->lock);
+}
+
+/* Whether the last frame posted is not on the device yet */
+bool dfr_mailbox_busy(struct dfr_mailbox *mb)
+{
+    pthread_mutex_lock(&mb->lock);
+    bool busy = mb->full || mb->sending;
+    pthread_mutex_unlock(&mb->lock);
+
+    return busy;
+}
+
+/*
+ * Collect the writer's news for the main loop, draining @done_fd.
+ * Returns -1 if a write failed or has been stuck for longer than
+ * DFR_WRITE_DEADLINE_MS, after which the device should be reconnected.
+ */
+int dfr_mailbox_check(struct dfr_mailbox *mb)
+{
+    uint64_t count;
+    int ret = 0;
+
+    if (read(mb->done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        syslog(LOG_WARNING, "Failed to read frame eventfd: %s",
+               strerror(errno));
+    }
+
+    pthread_mutex_lock(&mb->lock);
+
+    if (mb->error) {
+        syslog(LOG_ERR, "Failed to write Touch Bar frame: %s",
+               strerror(mb->error));
+        mb->error = 0;
+        ret = -1;
+    } else if (mb->writing && !mb->late &&
+               ms_until_deadline(&mb->write_start) <= 0) {
+        syslog(LOG_ERR, "Touch Bar write stalled for more than %d ms",
+               DFR_WRITE_DEADLINE_MS);
+        mb->late = true;
+        mb->stalls++;
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&mb->lock);
+    return ret;
+}
+
+/* Poll timeout until the deadline of the write in progress, or -1 */
+int dfr_mailbox_timeout(struct dfr_mailbox *mb)
+{
+    long ms = -1;
+
+    pthread_mutex_lock(&mb->lock);
+    if (mb->writing && !mb->late) {
+        ms = ms_until_deadline(&mb->write_start) + 1;
+        if (ms < 0) {
+            ms = 0;
+        }
+    }
+    pthread_mutex_unlock(&mb->lock);
+
+    return ms;
+}
@@ -0,0 +1,138 @@
+/*
+ * handover.c - Early boot instance and its handover to the full daemon
+ *
+ * Started from the initramfs (-i), tiny-dfr has to make Esc and the
+ * function keys usable at a LUKS or emergency prompt. Drawing them is not
+ * enough, apple-ib-tb must report them too, so the driver is switched to
+ * its function keys mode for as long as the early instance runs.
+ *
+ * At switch-root the early instance is stopped and the full daemon starts
+ * once the real root is up. /run survives the switch, so the early
+ * instance leaves the driver mode to restore, the brightness and the last
+ * touch there, and the full daemon carries on from them instead of
+ * starting over at full brightness.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <glob.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tiny-dfr.h"
+
+#define FNMODE_GLOB "/sys/bus/hid/drivers/apple-ib-touchbar/*/fnmode"
+#define HANDOVER_PATH DFR_RUN_DIR "/handover"
+
+/* The fnmode attribute of the bound Touch Bar, or NULL */
+static FILE *open_fnmode(const char *mode)
+{
+    glob_t globbuf;
+    FILE *f = NULL;
+
+    if (glob(FNMODE_GLOB, 0, NULL, &globbuf) != 0) {
+        return NULL;
+    }
+
+    f = fopen(globbuf.gl_pathv[0], mode);
+    globfree(&globbuf);
+    return f;
+}
+
+/* Current apple-ib-tb fn mode, -1 if the driver is not bound */
+int dfr_fnmode_get(void)
+{
+    FILE *f = open_fnmode("r");
+    int mode;
+
+    if (!f) {
+        return -1;
+    }
+
+    if (fscanf(f, "%d", &mode) != 1) {
+        mode = -1;
+    }
+
+    fclose(f);
+    return mode;
+}
+
+int dfr_fnmode_set(int mode)
+{
+    FILE *f = open_fnmode("w");
+
+    if (!f) {
+        return -1;
+    }
+
+    fprintf(f, "%d\n", mode);
+    if (fclose(f) != 0) {
+        syslog(LOG_WARNING, "Failed to set fn mode %d: %s", mode,
+               strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Written next to the final name and renamed, never read half written */
+int dfr_handover_save(const struct dfr_handover *handover)
+{
+    const char *tmp = HANDOVER_PATH ".tmp";
+
+    if (mkdir(DFR_RUN_DIR, 0755) < 0 && errno != EEXIST) {
+        goto err;
+    }
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        goto err;
+    }
+
+    fprintf(f, "fnmode=%d\nlevel=%.3f\nlast_activity=%lld.%09ld\n",
+            handover->fnmode, handover->level,
+            (long long)handover->last_activity.tv_sec,
+            handover->last_activity.tv_nsec);
+
+    if (fclose(f) != 0 || rename(tmp, HANDOVER_PATH) < 0) {
+        unlink(tmp);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    syslog(LOG_WARNING, "Failed to write %s: %s", HANDOVER_PATH,
+           strerror(errno));
+    return -1;
+}
+
+/* Read and remove what the early instance left, if anything */
+bool dfr_handover_load(struct dfr_handover *handover)
+{
+    FILE *f = fopen(HANDOVER_PATH, "r");
+    long long sec;
+    long nsec;
+
+    if (!f) {
+        return false;
+    }
+
+    int n = fscanf(f, "fnmode=%d level=%lf last_activity=%lld.%ld",
+                   &handover->fnmode, &handover->level, &sec, &nsec);
+    fclose(f);
+    unlink(HANDOVER_PATH);
+
+    if (n != 4) {
+        syslog(LOG_WARNING, "Ignoring malformed %s", HANDOVER_PATH);
+        return false;
+    }
+
+    handover->last_activity.tv_sec = sec;
+    handover->last_activity.tv_nsec = nsec;
+    return true;
+}
@@ -0,0 +1,69 @@
+/*
+ * hotplug.c - hidraw hotplug from kernel uevents
+ *
+ * The T1 may drop off the bus across suspend or a driver reload. Rather
+ * than wait for the next periodic discovery, the daemon listens for the
+ * kernel announcing a new hidraw node and looks for the Touch Bar then.
+ * Only kernel uevents are read, so this works with or without udev.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+
+#include "tiny-dfr.h"
+
+int dfr_hotplug_open(void)
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = 1, /* kernel uevents */
+    };
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* "add@<devpath>" followed by NUL-separated KEY=value pairs */
+static bool is_hidraw_add(const char *msg, size_t len)
+{
+    if (len < 4 || strncmp(msg, "add@", 4) != 0) {
+        return false;
+    }
+
+    for (size_t pos = 0; pos < len; pos += strlen(msg + pos) + 1) {
+        if (strcmp(msg + pos, "SUBSYSTEM=hidraw") == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool dfr_hotplug_read(int fd)
+{
+    char buf[4096];
+    bool added = false;
+    ssize_t n;
+
+    while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        added |= is_hidraw_add(buf, n);
+    }
+
+    return added;
+}
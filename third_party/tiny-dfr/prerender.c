@@ -0,0 +1,198 @@
+/*
+ * prerender.c - Parallel layer rendering
+ *
+ * A layout is rendered as independent tiles, one per key, each covering
+ * whole device bytes of its layer's frame. Tiles of the layer to be shown
+ * first are queued first; the thread waiting for a layer helps with the
+ * queue until that layer is complete, so with one thread configured
+ * everything simply runs inline.
+ *
+ * Only one cache is rendered at a time, and the caller finishes it before
+ * returning to the main loop, so widgets and the cache are never touched
+ * by the main thread while workers run.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <pthread.h>
+#include <syslog.h>
+#include <string.h>
+
+#include "tiny-dfr.h"
+
+struct tile_job {
+    enum dfr_layer layer;
+    unsigned int key;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* jobs queued, or stopping */
+    pthread_cond_t done; /* a tile finished */
+    pthread_t threads[DFR_MAX_WORKERS];
+    unsigned int nthreads;
+    bool stop;
+
+    struct dfr_layer_cache *cache;
+    struct tile_job jobs[DFR_LAYER_COUNT * DFR_MAX_KEYS];
+    unsigned int next, njobs;
+    unsigned int pending[DFR_LAYER_COUNT];
+    bool queued[DFR_LAYER_COUNT];
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* One surface per layer; tiles of a layer write disjoint columns of it */
+static struct dfr_surface surfaces[DFR_LAYER_COUNT];
+
+static void run_tile(struct dfr_layer_cache *cache, const struct tile_job *job)
+{
+    struct dfr_rect tile;
+
+    dfr_render_key(&surfaces[job->layer], &cache->layout->layers[job->layer],
+                   job->key, &tile);
+    dfr_convert_rect(&cache->frames[job->layer], &surfaces[job->layer],
+                     &tile);
+}
+
+/* Called with pool.lock held, returns with it held */
+static void run_next(void)
+{
+    struct tile_job job = pool.jobs[pool.next++];
+    struct dfr_layer_cache *cache = pool.cache;
+
+    pthread_mutex_unlock(&pool.lock);
+    run_tile(cache, &job);
+    pthread_mutex_lock(&pool.lock);
+
+    pool.pending[job.layer]--;
+    pthread_cond_broadcast(&pool.done);
+}
+
+static void *worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&pool.lock);
+
+    while (!pool.stop) {
+        if (pool.next < pool.njobs) {
+            run_next();
+        } else {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/*
+ * Set up the pool for @threads threads in total, including the caller of
+ * dfr_prerender_wait(). Returns 0, or -1 if no worker could be started.
+ */
+int dfr_prerender_init(unsigned int threads)
+{
+    if (threads > DFR_MAX_WORKERS) {
+        threads = DFR_MAX_WORKERS;
+    }
+
+    for (unsigned int i = 1; i < threads; i++) {
+        int err = pthread_create(&pool.threads[pool.nthreads], NULL, worker,
+                                 NULL);
+        if (err) {
+            syslog(LOG_WARNING, "Failed to start render thread: %s",
+                   strerror(err));
+            break;
+        }
+        pool.nthreads++;
+    }
+
+    if (threads > 1 && pool.nthreads == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void dfr_prerender_shutdown(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (unsigned int i = 0; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    pool.nthreads = 0;
+}
+
+static void queue_layer(struct dfr_layer_cache *cache, enum dfr_layer layer)
+{
+    unsigned int nkeys = cache->layout->layers[layer].nkeys;
+    unsigned int ntiles = nkeys ? nkeys : 1;
+
+    if (cache->valid[layer]) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < ntiles; i++) {
+        pool.jobs[pool.njobs++] = (struct tile_job){ layer, i };
+    }
+    pool.pending[layer] = ntiles;
+    pool.queued[layer] = true;
+}
+
+/*
+ * Queue every layer of @cache that is not rendered yet, @first ahead of
+ * the rest. The previous cache must have been finished.
+ */
+void dfr_prerender_start(struct dfr_layer_cache *cache, enum dfr_layer first)
+{
+    pthread_mutex_lock(&pool.lock);
+
+    pool.cache = cache;
+    pool.next = pool.njobs = 0;
+    memset(pool.queued, 0, sizeof(pool.queued));
+
+    queue_layer(cache, first);
+    for (int i = 0; i < DFR_LAYER_COUNT; i++) {
+        if (i != (int)first) {
+            queue_layer(cache, i);
+        }
+    }
+
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Render or wait until @layer of @cache is complete, and mark it valid */
+void dfr_prerender_wait(struct dfr_layer_cache *cache, enum dfr_layer layer)
+{
+    pthread_mutex_lock(&pool.lock);
+
+    if (pool.cache == cache && pool.queued[layer]) {
+        while (pool.pending[layer] > 0) {
+            if (pool.next < pool.njobs) {
+                run_next();
+            } else {
+                pthread_cond_wait(&pool.done, &pool.lock);
+            }
+        }
+
+        pool.queued[layer] = false;
+        cache->valid[layer] = true;
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void dfr_prerender_finish(struct dfr_layer_cache *cache)
+{
+    for (int i = 0; i < DFR_LAYER_COUNT; i++) {
+        dfr_prerender_wait(cache, i);
+    }
+}
@@ -0,0 +1,261 @@
+/*
+ * render.c - Touch Bar layer rendering
+ *
+ * Layers are drawn into an 8-bit luminance surface: one button per key,
+ * labelled with a built-in 5x7 bitmap font scaled up to the bar height.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <string.h>
+#include <linux/input-event-codes.h>
+
+#include "tiny-dfr.h"
+
+#define KEY_GAP 8
+#define KEY_MARGIN 4
+#define KEY_BACKGROUND 0x30
+#define KEY_FOREGROUND 0xff
+#define FONT_SCALE 4
+
+#define GLYPH_WIDTH 5
+#define GLYPH_HEIGHT 7
+#define GLYPH_FIRST 0x20
+#define GLYPH_LAST 0x7e
+
+/* Column-major, bit 0 is the top row */
+static const uint8_t font5x7[GLYPH_LAST - GLYPH_FIRST + 1][GLYPH_WIDTH] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5f, 0x00, 0x00},
+    {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7f, 0x14, 0x7f, 0x14},
+    {0x24, 0x2a, 0x7f, 0x2a, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62},
+    {0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00},
+    {0x00, 0x1c, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1c, 0x00},
+    {0x08, 0x2a, 0x1c, 0x2a, 0x08}, {0x08, 0x08, 0x3e, 0x08, 0x08},
+    {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08},
+    {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},
+    {0x3e, 0x51, 0x49, 0x45, 0x3e}, {0x00, 0x42, 0x7f, 0x40, 0x00},
+    {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4b, 0x31},
+    {0x18, 0x14, 0x12, 0x7f, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39},
+    {0x3c, 0x4a, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+    {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1e},
+    {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},
+    {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14},
+    {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},
+    {0x32, 0x49, 0x79, 0x41, 0x3e}, {0x7e, 0x11, 0x11, 0x11, 0x7e},
+    {0x7f, 0x49, 0x49, 0x49, 0x36}, {0x3e, 0x41, 0x41, 0x41, 0x22},
+    {0x7f, 0x41, 0x41, 0x22, 0x1c}, {0x7f, 0x49, 0x49, 0x49, 0x41},
+    {0x7f, 0x09, 0x09, 0x01, 0x01}, {0x3e, 0x41, 0x41, 0x51, 0x32},
+    {0x7f, 0x08, 0x08, 0x08, 0x7f}, {0x00, 0x41, 0x7f, 0x41, 0x00},
+    {0x20, 0x40, 0x41, 0x3f, 0x01}, {0x7f, 0x08, 0x14, 0x22, 0x41},
+    {0x7f, 0x40, 0x40, 0x40, 0x40}, {0x7f, 0x02, 0x04, 0x02, 0x7f},
+    {0x7f, 0x04, 0x08, 0x10, 0x7f}, {0x3e, 0x41, 0x41, 0x41, 0x3e},
+    {0x7f, 0x09, 0x09, 0x09, 0x06}, {0x3e, 0x41, 0x51, 0x21, 0x5e},
+    {0x7f, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},
+    {0x01, 0x01, 0x7f, 0x01, 0x01}, {0x3f, 0x40, 0x40, 0x40, 0x3f},
+    {0x1f, 0x20, 0x40, 0x20, 0x1f}, {0x7f, 0x20, 0x18, 0x20, 0x7f},
+    {0x63, 0x14, 0x08, 0x14, 0x63}, {0x03, 0x04, 0x78, 0x04, 0x03},
+    {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7f, 0x41, 0x41, 0x00},
+    {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7f, 0x00},
+    {0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40},
+    {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78},
+    {0x7f, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20},
+    {0x38, 0x44, 0x44, 0x48, 0x7f}, {0x38, 0x54, 0x54, 0x54, 0x18},
+    {0x08, 0x7e, 0x09, 0x01, 0x02}, {0x08, 0x14, 0x54, 0x54, 0x3c},
+    {0x7f, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7d, 0x40, 0x00},
+    {0x20, 0x40, 0x44, 0x3d, 0x00}, {0x00, 0x7f, 0x10, 0x28, 0x44},
+    {0x00, 0x41, 0x7f, 0x40, 0x00}, {0x7c, 0x04, 0x18, 0x04, 0x78},
+    {0x7c, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38},
+    {0x7c, 0x14, 0x14, 0x14, 0x08}, {0x08, 0x14, 0x14, 0x18, 0x7c},
+    {0x7c, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},
+    {0x04, 0x3f, 0x44, 0x40, 0x20}, {0x3c, 0x40, 0x40, 0x20, 0x7c},
+    {0x1c, 0x20, 0x40, 0x20, 0x1c}, {0x3c, 0x40, 0x30, 0x40, 0x3c},
+    {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0c, 0x50, 0x50, 0x50, 0x3c},
+    {0x44, 0x64, 0x54, 0x4c, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00},
+    {0x00, 0x00, 0x7f, 0x00, 0x00}, {0x00, 0x41, 0x36, 0x08, 0x00},
+    {0x08, 0x04, 0x08, 0x10, 0x08},
+};
+
+#define DFR_KEYMAP_KEY(usage, code, label, repeat) { label, code },
+
+const struct dfr_layout dfr_default_layout = {
+    .name = "default",
+    .layers = {
+        [DFR_LAYER_SPECIAL] = {
+            .nkeys = APPLETB_KEYMAP_NKEYS(APPLETB_KEYMAP_SPECIAL),
+            .keys = { APPLETB_KEYMAP_SPECIAL(DFR_KEYMAP_KEY) },
+        },
+        [DFR_LAYER_FKEYS] = {
+            .nkeys = APPLETB_KEYMAP_NKEYS(APPLETB_KEYMAP_FKEYS),
+            .keys = { APPLETB_KEYMAP_FKEYS(DFR_KEYMAP_KEY) },
+        },
+    },
+};
+
+static void fill_rect(struct dfr_surface *s, int x, int y, int w, int h,
+                      uint8_t value)
+{
+    for (int row = y; row < y + h; row++) {
+        memset(&s->px[row][x], value, w);
+    }
+}
+
+static void draw_glyph(struct dfr_surface *s, int x, int y, char c,
+                       uint8_t value)
+{
+    if (c < GLYPH_FIRST || c > GLYPH_LAST) {
+        c = '?';
+    }
+
+    const uint8_t *glyph = font5x7[c - GLYPH_FIRST];
+
+    for (int col = 0; col < GLYPH_WIDTH; col++) {
+        for (int row = 0; row < GLYPH_HEIGHT; row++) {
+            if (glyph[col] & (1 << row)) {
+                fill_rect(s, x + col * FONT_SCALE, y + row * FONT_SCALE,
+                          FONT_SCALE, FONT_SCALE, value);
+            }
+        }
+    }
+}
+
+static void text_origin(const struct dfr_rect *key, int len, int *tx, int *ty)
+{
+    int advance = (GLYPH_WIDTH + 1) * FONT_SCALE;
+    int text_w = len * advance - FONT_SCALE;
+
+    /* Glyph cells start on a byte boundary of the device frame */
+    *tx = (key->x + (key->w - text_w) / 2) & ~1;
+    *ty = key->y + (key->h - GLYPH_HEIGHT * FONT_SCALE) / 2;
+}
+
+static int text_length(const struct dfr_rect *key, const char *text)
+{
+    int advance = (GLYPH_WIDTH + 1) * FONT_SCALE;
+    int len = strlen(text);
+    int max = (key->w - FONT_SCALE) / advance;
+
+    return len > max ? max : len;
+}
+
+void dfr_key_rect(const struct dfr_layer_def *layer, unsigned int index,
+                  struct dfr_rect *rect)
+{
+    int key_w = (DFR_WIDTH - KEY_GAP * (layer->nkeys - 1)) / layer->nkeys;
+
+    rect->x = index * (key_w + KEY_GAP);
+    rect->y = KEY_MARGIN;
+    rect->w = key_w;
+    rect->h = DFR_HEIGHT - 2 * KEY_MARGIN;
+}
+
+/* The key drawn over column @x, or left of the gap @x falls into */
+unsigned int dfr_key_at(const struct dfr_layer_def *layer, int x)
+{
+    struct dfr_rect rect;
+    unsigned int index;
+
+    for (index = layer->nkeys - 1; index > 0; index--) {
+        dfr_key_rect(layer, index, &rect);
+        if (x >= rect.x) {
+            break;
+        }
+    }
+
+    return index;
+}
+
+/*
+ * Draw @text on the key button @key. If @prev is what the button shows
+ * now and has the same length, only the glyph cells from the first to
+ * the last differing character are redrawn; otherwise the whole button
+ * is. The area touched is returned in @damage.
+ */
+void dfr_render_text(struct dfr_surface *surface, const struct dfr_rect *key,
+                     const char *text, const char *prev,
+                     struct dfr_rect *damage)
+{
+    int advance = (GLYPH_WIDTH + 1) * FONT_SCALE;
+    int len = text_length(key, text);
+    int first = 0, last = len - 1;
+    int tx, ty;
+
+    text_origin(key, len, &tx, &ty);
+
+    if (prev && text_length(key, prev) == len) {
+        while (first < len && text[first] == prev[first]) {
+            first++;
+        }
+        while (last > first && text[last] == prev[last]) {
+            last--;
+        }
+        if (first == len) {
+            *damage = (struct dfr_rect){ tx, ty, 0, 0 };
+            return;
+        }
+
+        *damage = (struct dfr_rect){
+            .x = tx + first * advance,
+            .y = ty,
+            .w = (last - first + 1) * advance,
+            .h = GLYPH_HEIGHT * FONT_SCALE,
+        };
+        fill_rect(surface, damage->x, damage->y, damage->w, damage->h,
+                  KEY_BACKGROUND);
+    } else {
+        *damage = *key;
+        fill_rect(surface, key->x, key->y, key->w, key->h, KEY_BACKGROUND);
+        first = 0;
+    }
+
+    for (int i = first; i <= last; i++) {
+        draw_glyph(surface, tx + i * advance, ty, text[i], KEY_FOREGROUND);
+    }
+}
+
+/*
+ * Render key @index of @layer into its tile: all rows of the columns from
+ * the key's left edge up to the next key's, rounded down to device bytes
+ * so tiles can be rendered and converted independently of each other.
+ * The tile is returned in @tile.
+ */
+void dfr_render_key(struct dfr_surface *surface,
+                    const struct dfr_layer_def *layer, unsigned int index,
+                    struct dfr_rect *tile)
+{
+    struct dfr_rect key, next, damage;
+
+    if (layer->nkeys == 0) {
+        *tile = (struct dfr_rect){ 0, 0, DFR_WIDTH, DFR_HEIGHT };
+        memset(surface, 0, sizeof(*surface));
+        return;
+    }
+
+    dfr_key_rect(layer, index, &key);
+
+    tile->x = index == 0 ? 0 : key.x & ~1;
+    tile->y = 0;
+    tile->h = DFR_HEIGHT;
+    if (index + 1 < layer->nkeys) {
+        dfr_key_rect(layer, index + 1, &next);
+        tile->w = (next.x & ~1) - tile->x;
+    } else {
+        tile->w = DFR_WIDTH - tile->x;
+    }
+
+    fill_rect(surface, tile->x, tile->y, tile->w, tile->h, 0);
+
+    const char *text = dfr_widget_text(&layer->keys[index]);
+    dfr_render_text(surface, &key, text ? text : layer->keys[index].label,
+                    NULL, &damage);
+}
+
+void dfr_render_layer(struct dfr_surface *surface,
+                      const struct dfr_layer_def *layer)
+{
+    struct dfr_rect tile;
+    unsigned int i = 0;
+
+    do {
+        dfr_render_key(surface, layer, i, &tile);
+    } while (++i < layer->nkeys);
+}
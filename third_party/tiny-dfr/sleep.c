@@ -0,0 +1,567 @@
+/*
+ * sleep.c - Suspend and resume notifications from systemd-logind
+ *
+ * Subscribes to logind's PrepareForSleep signal and holds a "delay"
+ * inhibitor lock, so the daemon parks the Touch Bar before the system
+ * freezes and hears about the resume as soon as logind does. The lock is
+ * dropped once the handler has parked everything and taken again after
+ * resume, for the next suspend.
+ *
+ * Rather than pulling in a D-Bus library, this speaks just enough of the
+ * protocol over the system bus socket: EXTERNAL authentication, unix fd
+ * passing (the lock is an fd), string-only method calls, and
+ * little-endian messages, which is all a T1 Mac ever sees.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "tiny-dfr.h"
+
+#define SYSTEM_BUS_PATH "/run/dbus/system_bus_socket"
+
+#define LOGIND_NAME "org.freedesktop.login1"
+#define LOGIND_PATH "/org/freedesktop/login1"
+#define LOGIND_MANAGER LOGIND_NAME ".Manager"
+
+#define SLEEP_MATCH                                                        \
+    "type='signal',sender='" LOGIND_NAME "',interface='" LOGIND_MANAGER   \
+    "',member='PrepareForSleep',path='" LOGIND_PATH "'"
+
+enum {
+    MSG_METHOD_CALL = 1,
+    MSG_METHOD_RETURN = 2,
+    MSG_ERROR = 3,
+    MSG_SIGNAL = 4,
+};
+
+enum {
+    FIELD_PATH = 1,
+    FIELD_INTERFACE = 2,
+    FIELD_MEMBER = 3,
+    FIELD_ERROR_NAME = 4,
+    FIELD_REPLY_SERIAL = 5,
+    FIELD_DESTINATION = 6,
+    FIELD_SENDER = 7,
+    FIELD_SIGNATURE = 8,
+    FIELD_UNIX_FDS = 9,
+};
+
+/* Outgoing message */
+struct msg {
+    uint8_t buf[1024];
+    size_t len;
+    bool overflow;
+};
+
+static void put_pad(struct msg *m, size_t align)
+{
+    while (m->len % align) {
+        if (m->len >= sizeof(m->buf)) {
+            m->overflow = true;
+            return;
+        }
+        m->buf[m->len++] = 0;
+    }
+}
+
+static void put_bytes(struct msg *m, const void *data, size_t n)
+{
+    if (m->len + n > sizeof(m->buf)) {
+        m->overflow = true;
+        return;
+    }
+    memcpy(m->buf + m->len, data, n);
+    m->len += n;
+}
+
+static void put_u8(struct msg *m, uint8_t v)
+{
+    put_bytes(m, &v, 1);
+}
+
+static void put_u32(struct msg *m, uint32_t v)
+{
+    put_pad(m, 4);
+    put_bytes(m, &v, 4);
+}
+
+/* A string or object path: length, bytes, NUL */
+static void put_str(struct msg *m, const char *s)
+{
+    put_u32(m, strlen(s));
+    put_bytes(m, s, strlen(s) + 1);
+}
+
+static void put_sig(struct msg *m, const char *sig)
+{
+    put_u8(m, strlen(sig));
+    put_bytes(m, sig, strlen(sig) + 1);
+}
+
+static void put_field(struct msg *m, uint8_t code, const char *sig,
+                      const char *value)
+{
+    put_pad(m, 8);
+    put_u8(m, code);
+    put_sig(m, sig);
+    if (sig[0] == 'g') {
+        put_sig(m, value);
+    } else {
+        put_str(m, value);
+    }
+}
+
+/*
+ * Call @member with string arguments and no reply flags. Returns the
+ * serial of the call, or 0 on error.
+ */
+static uint32_t call(struct dfr_sleep *watch, const char *dest,
+                     const char *path, const char *iface, const char *member,
+                     const char *const *args, unsigned int nargs)
+{
+    struct msg m = { .len = 0 };
+    char sig[8] = "";
+    uint32_t serial = ++watch->serial;
+
+    for (unsigned int i = 0; i < nargs && i < sizeof(sig) - 1; i++) {
+        sig[i] = 's';
+    }
+
+    put_bytes(&m, "l", 1);
+    put_u8(&m, MSG_METHOD_CALL);
+    put_u8(&m, 0);
+    put_u8(&m, 1);
+    put_u32(&m, 0); /* body length, below */
+    put_u32(&m, serial);
+    put_u32(&m, 0); /* header field array length, below */
+
+    put_field(&m, FIELD_PATH, "o", path);
+    put_field(&m, FIELD_DESTINATION, "s", dest);
+    put_field(&m, FIELD_INTERFACE, "s", iface);
+    put_field(&m, FIELD_MEMBER, "s", member);
+    if (nargs) {
+        put_field(&m, FIELD_SIGNATURE, "g", sig);
+    }
+
+    uint32_t fields = m.len - 16;
+    put_pad(&m, 8);
+    size_t body = m.len;
+
+    for (unsigned int i = 0; i < nargs; i++) {
+        put_str(&m, args[i]);
+    }
+
+    if (m.overflow) {
+        return 0;
+    }
+
+    uint32_t body_len = m.len - body;
+    memcpy(m.buf + 4, &body_len, 4);
+    memcpy(m.buf + 12, &fields, 4);
+
+    if (send(watch->bus_fd, m.buf, m.len, MSG_NOSIGNAL) != (ssize_t)m.len) {
+        return 0;
+    }
+
+    return serial;
+}
+
+/* Ask for the delay lock; the reply carries its fd */
+static void take_lock(struct dfr_sleep *watch)
+{
+    static const char *const args[] = {
+        "sleep", "tiny-dfr", "Park the Touch Bar for resume", "delay",
+    };
+
+    if (watch->lock_fd >= 0 || watch->lock_serial) {
+        return;
+    }
+
+    watch->lock_serial = call(watch, LOGIND_NAME, LOGIND_PATH,
+                              LOGIND_MANAGER, "Inhibit", args, 4);
+}
+
+static void release_lock(struct dfr_sleep *watch)
+{
+    if (watch->lock_fd >= 0) {
+        close(watch->lock_fd);
+        watch->lock_fd = -1;
+    }
+}
+
+/* Read one "\r\n"-terminated line of the authentication exchange */
+static int auth_line(int fd, char *line, size_t size)
+{
+    size_t len = 0;
+
+    while (len + 1 < size) {
+        ssize_t n = recv(fd, line + len, 1, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        if (line[len++] == '\n') {
+            line[len] = '\0';
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int auth_command(int fd, const char *command, const char *expect)
+{
+    char line[256];
+
+    if (send(fd, command, strlen(command), MSG_NOSIGNAL) !=
+        (ssize_t)strlen(command)) {
+        return -1;
+    }
+    if (!expect) {
+        return 0;
+    }
+    if (auth_line(fd, line, sizeof(line)) < 0 ||
+        strncmp(line, expect, strlen(expect)) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* EXTERNAL authentication as our uid, with fd passing */
+static int authenticate(int fd)
+{
+    char uid[16], hex[2 * sizeof(uid) + 1], command[64];
+    size_t n = snprintf(uid, sizeof(uid), "%u", (unsigned int)getuid());
+
+    for (size_t i = 0; i < n; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", (unsigned char)uid[i]);
+    }
+    snprintf(command, sizeof(command), "AUTH EXTERNAL %s\r\n", hex);
+
+    if (send(fd, "", 1, MSG_NOSIGNAL) != 1 ||
+        auth_command(fd, command, "OK ") < 0 ||
+        auth_command(fd, "NEGOTIATE_UNIX_FD\r\n", "AGREE_UNIX_FD") < 0 ||
+        auth_command(fd, "BEGIN\r\n", NULL) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int dfr_sleep_open(struct dfr_sleep *watch)
+{
+    static const char *const match[] = { SLEEP_MATCH };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    const char *bus = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+    /* Only the handshake blocks, and not for long */
+    struct timeval timeout = { .tv_sec = 1 };
+
+    *watch = (struct dfr_sleep){ .bus_fd = -1, .lock_fd = -1 };
+
+    /* Only plain unix:path= addresses are understood */
+    if (bus && strncmp(bus, "unix:path=", 10) == 0) {
+        bus += 10;
+    } else {
+        bus = SYSTEM_BUS_PATH;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%.*s",
+             (int)strcspn(bus, ","), bus);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        authenticate(fd) < 0) {
+        syslog(LOG_WARNING, "No system bus, suspend will not be tracked");
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    watch->bus_fd = fd;
+
+    if (!call(watch, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+              "org.freedesktop.DBus", "Hello", NULL, 0) ||
+        !call(watch, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+              "org.freedesktop.DBus", "AddMatch", match, 1)) {
+        dfr_sleep_close(watch);
+        return -1;
+    }
+
+    take_lock(watch);
+
+    return fd;
+}
+
+void dfr_sleep_close(struct dfr_sleep *watch)
+{
+    release_lock(watch);
+
+    for (unsigned int i = 0; i < watch->nfds; i++) {
+        close(watch->fds[i]);
+    }
+    watch->nfds = 0;
+
+    if (watch->bus_fd >= 0) {
+        close(watch->bus_fd);
+        watch->bus_fd = -1;
+    }
+}
+
+/* Bounds-checked reader over a received message */
+struct reader {
+    const uint8_t *msg;
+    size_t pos, end;
+    bool bad;
+};
+
+static void get_pad(struct reader *r, size_t align)
+{
+    r->pos = (r->pos + align - 1) / align * align;
+    if (r->pos > r->end) {
+        r->bad = true;
+    }
+}
+
+static uint32_t get_u32(struct reader *r)
+{
+    uint32_t v = 0;
+
+    get_pad(r, 4);
+    if (r->bad || r->pos + 4 > r->end) {
+        r->bad = true;
+        return 0;
+    }
+    memcpy(&v, r->msg + r->pos, 4);
+    r->pos += 4;
+    return v;
+}
+
+static const char *get_str(struct reader *r, size_t len)
+{
+    const char *s = (const char *)r->msg + r->pos;
+
+    if (r->bad || r->pos + len + 1 > r->end || s[len] != '\0') {
+        r->bad = true;
+        return "";
+    }
+    r->pos += len + 1;
+    return s;
+}
+
+/* The header fields this client cares about */
+struct header {
+    uint8_t type;
+    uint32_t reply_serial;
+    uint32_t unix_fds;
+    const char *interface;
+    const char *member;
+    const char *signature;
+};
+
+static bool parse_header(struct reader *r, uint32_t fields,
+                         struct header *h)
+{
+    size_t end = r->pos + fields;
+
+    while (!r->bad && r->pos < end) {
+        get_pad(r, 8);
+        if (r->pos + 2 > end) {
+            return false;
+        }
+
+        uint8_t code = r->msg[r->pos++];
+        uint8_t siglen = r->msg[r->pos++];
+        const char *sig = get_str(r, siglen);
+        const char *str = NULL;
+        uint32_t u = 0;
+
+        if (strcmp(sig, "s") == 0 || strcmp(sig, "o") == 0) {
+            uint32_t len = get_u32(r);
+            str = get_str(r, len);
+        } else if (strcmp(sig, "g") == 0) {
+            if (r->pos >= r->end) {
+                return false;
+            }
+            str = get_str(r, r->msg[r->pos++]);
+        } else if (strcmp(sig, "u") == 0) {
+            u = get_u32(r);
+        } else {
+            return false;
+        }
+
+        switch (code) {
+        case FIELD_INTERFACE:
+            h->interface = str;
+            break;
+        case FIELD_MEMBER:
+            h->member = str;
+            break;
+        case FIELD_SIGNATURE:
+            h->signature = str;
+            break;
+        case FIELD_REPLY_SERIAL:
+            h->reply_serial = u;
+            break;
+        case FIELD_UNIX_FDS:
+            h->unix_fds = u;
+            break;
+        }
+    }
+
+    return !r->bad && r->pos == end;
+}
+
+/*
+ * Act on one complete message. Fds arrive ahead of the message that
+ * carries them; each message claims its own and unclaimed ones are closed.
+ */
+static void handle_message(struct dfr_sleep *watch, const uint8_t *msg,
+                           size_t len, dfr_sleep_handler handle, void *data)
+{
+    struct reader r = { .msg = msg, .pos = 16, .end = len };
+    struct header h = { .type = msg[1] };
+    uint32_t fields;
+    int fd = -1;
+
+    memcpy(&fields, msg + 12, 4);
+    bool ok = parse_header(&r, fields, &h);
+
+    for (uint32_t i = 0; i < h.unix_fds && watch->nfds > 0; i++) {
+        if (fd < 0) {
+            fd = watch->fds[0];
+        } else {
+            close(watch->fds[0]);
+        }
+        memmove(watch->fds, watch->fds + 1,
+                --watch->nfds * sizeof(watch->fds[0]));
+    }
+
+    if (ok && h.reply_serial && h.reply_serial == watch->lock_serial) {
+        watch->lock_serial = 0;
+        if (h.type == MSG_METHOD_RETURN && fd >= 0) {
+            watch->lock_fd = fd;
+            fd = -1;
+        } else if (h.type == MSG_ERROR) {
+            syslog(LOG_WARNING, "logind refused a sleep delay lock");
+        }
+    }
+
+    if (ok && h.type == MSG_SIGNAL && h.member && h.interface &&
+        h.signature && strcmp(h.interface, LOGIND_MANAGER) == 0 &&
+        strcmp(h.member, "PrepareForSleep") == 0 &&
+        strcmp(h.signature, "b") == 0) {
+        get_pad(&r, 8);
+        bool suspending = get_u32(&r) != 0;
+
+        if (!r.bad) {
+            if (suspending) {
+                handle(true, data);
+                release_lock(watch);
+            } else {
+                take_lock(watch);
+                handle(false, data);
+            }
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static int receive(struct dfr_sleep *watch)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(watch->fds))];
+    } control;
+    struct iovec iov = {
+        .iov_base = watch->buf + watch->len,
+        .iov_len = sizeof(watch->buf) - watch->len,
+    };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n = recvmsg(watch->bus_fd, &mh, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    if (n == 0) {
+        return -1;
+    }
+    watch->len += n;
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        unsigned int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (unsigned int i = 0; i < count; i++) {
+            int fd;
+
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (watch->nfds < DFR_SLEEP_MAX_FDS) {
+                watch->fds[watch->nfds++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int dfr_sleep_dispatch(struct dfr_sleep *watch, dfr_sleep_handler handle,
+                       void *data)
+{
+    if (receive(watch) < 0) {
+        syslog(LOG_WARNING, "Lost the system bus, suspend no longer tracked");
+        dfr_sleep_close(watch);
+        return -1;
+    }
+
+    while (watch->len >= 16) {
+        uint32_t body, fields;
+
+        memcpy(&body, watch->buf + 4, 4);
+        memcpy(&fields, watch->buf + 12, 4);
+
+        size_t size = (16 + (size_t)fields + 7) / 8 * 8 + body;
+        if (watch->buf[0] != 'l' || size > sizeof(watch->buf)) {
+            syslog(LOG_WARNING, "Unexpected message on the system bus");
+            dfr_sleep_close(watch);
+            return -1;
+        }
+        if (size > watch->len) {
+            break;
+        }
+
+        handle_message(watch, watch->buf, size, handle, data);
+
+        watch->len -= size;
+        memmove(watch->buf, watch->buf + size, watch->len);
+    }
+
+    return 0;
+}
@@ -26,25 +26,129 @@
 #include <dirent.h>
 #include <glob.h>
 
+#include "tiny-dfr.h"
+
 #define PROGRAM_NAME "tiny-dfr"
 #define PROGRAM_VERSION "1.0.0"
 
-/* Apple T1 iBridge USB identifiers */
-#define APPLE_VENDOR_ID 0x05ac
-#define T1_DEVICE_ID 0x8600
-
-/* Touch Bar HID constants */
-#define TOUCHBAR_REPORT_ID 0xB0
-#define TOUCHBAR_REPORT_LENGTH 81
-
 /* Default paths */
 #define HIDRAW_GLOB "/dev/hidraw*"
 #define SYSFS_HID_PATH "/sys/bus/hid/devices"
+#define CONFIG_PATH "/etc/tiny-dfr.conf"
 
 static volatile sig_atomic_t running = 1;
 static int verbose = 0;
 static int foreground = 0;
 
+/*
+ * Early boot (-i): started from the initramfs with the built-in layout,
+ * function keys first, and state handed over to the full daemon at exit.
+ */
+static bool early_boot = false;
+static bool fkeys_first = false;
+static int saved_fnmode = -1;
+
+/* Left by the early instance, applied when the Touch Bar is attached */
+static struct dfr_handover handover;
+static bool handover_pending = false;
+
+static const char *config_path = CONFIG_PATH;
+static struct dfr_config *config;
+
+/*
+ * Layer state: cached frames, and what the device currently shows. The
+ * layouts shown last stay rendered in the LRU, so a focus change back to
+ * one of them is a pointer swap, and a new or reloaded layout is rendered
+ * off to the side and swapped in whole.
+ */
+static struct dfr_layout_lru layouts;
+static struct dfr_layer_cache *layer_cache;
+static enum dfr_layer current_layer = DFR_LAYER_SPECIAL;
+
+/* As last reported on the focus socket, "" for none */
+static char focused_app[DFR_FOCUS_APP_MAX];
+
+/*
+ * Frames on their way to the device: the cached layer frame mapped
+ * through the brightness LUT. @composed is set once the mailbox frame
+ * holds a full composition for the connected device.
+ */
+static struct dfr_mailbox mailbox;
+static bool composed = false;
+
+/* Decoded touch input from apple-ib-tb, if it offers the event ring */
+static struct dfr_events touch_events = { .dev_fd = -1 };
+
+/* Keyboard carrying the Fn key, filtered down to KEY_FN events */
+static int fn_fd = -1;
+static bool fn_pressed = false;
+
+/*
+ * Software brightness. The panel dims after dim_timeout seconds without
+ * touches and blanks after idle_timeout, fading over fade_ms each time.
+ * A fade step only rebuilds the LUT and maps the cached frame through it.
+ */
+#define FADE_FRAME_MS 16
+
+static struct {
+    double level, from, to; /* percent */
+    struct timespec start;
+    bool fading;
+    struct timespec last_activity;
+    struct dfr_lut lut;
+} backlight;
+
+/* Fade frame cost, from LUT build to last report written */
+static struct {
+    unsigned long count;
+    long total_us;
+    long max_us;
+} fade_stats;
+
+/* Layer switch latency, from request until the device took the frame */
+static struct {
+    unsigned long count;
+    long total_us;
+    long max_us;
+} switch_stats;
+
+/*
+ * Focus change latency, from the notification until the device took the
+ * whole frame of the new layout; apart for layouts the LRU still had.
+ */
+enum { FOCUS_RENDERED, FOCUS_CACHED };
+
+static struct {
+    struct timespec start;
+    bool pending;
+    int kind;
+    struct {
+        unsigned long count;
+        long total_us;
+        long max_us;
+    } stats[2];
+} focus_stats;
+
+/*
+ * Suspend, as told by logind. While suspended no timer runs; the fd and
+ * the composed frames are kept for the resume.
+ */
+static struct dfr_sleep sleep_watch = { .bus_fd = -1, .lock_fd = -1 };
+static bool suspended = false;
+
+/* Look for the Touch Bar now rather than at the next periodic discovery */
+static bool rediscover = false;
+
+/* Resume latency, from logind's resume signal until the frame was taken */
+static struct {
+    struct timespec start;
+    bool pending;
+    bool reattached;
+    unsigned long count;
+    long total_us;
+    long max_us;
+} resume_stats;
+
 void signal_handler(int sig)
 {
     running = 0;
@@ -58,6 +162,11 @@ void print_usage(const char *prog)
     fprintf(stderr, "  -h, --help           Show this help message\n");
     fprintf(stderr, "  -v, --verbose        Enable verbose output\n");
     fprintf(stderr, "  -f, --foreground     Run in foreground (don't daemonize)\n");
+    fprintf(stderr, "  -c FILE              Configuration file (default %s)\n",
+            CONFIG_PATH);
+    fprintf(stderr, "  -j N                 Render threads (default: online CPUs)\n");
+    fprintf(stderr, "  -i                   Early boot: built-in layout, function keys\n"
+                    "                       first, state handed over at exit\n");
     fprintf(stderr, "  -V, --version        Show version\n");
 }
 
@@ -81,14 +190,14 @@ int find_touchbar_device(void)
         
         /* Get device info */
         struct hidraw_devinfo devinfo;
-        if (ioctl(fd, HIDIOCGDEVINFO, &devinfo) < 0) {
+        if (ioctl(fd, HIDIOCGRAWINFO, &devinfo) < 0) {
             close(fd);
             continue;
         }
         
         /* Check if this is an Apple T1 device */
-        if (devinfo.vendor == APPLE_VENDOR_ID && 
-            devinfo.product == T1_DEVICE_ID) {
+        if ((uint16_t)devinfo.vendor == APPLE_VENDOR_ID && 
+            (uint16_t)devinfo.product == T1_IBRIDGE_ID) {
             
             if (verbose) {
                 syslog(LOG_DEBUG, "Found Apple T1 device at %s", path);
@@ -104,46 +213,541 @@ int find_touchbar_device(void)
     return found_fd;
 }
 
-int write_touchbar_frame(int fd, const uint8_t *frame, size_t len)
+static long elapsed_us(const struct timespec *start)
 {
-    if (len != TOUCHBAR_REPORT_LENGTH) {
-        syslog(LOG_WARNING, "Invalid Touch Bar frame size: %zu", len);
-        return -1;
-    }
-    
-    /* Send frame to device */
-    uint8_t report[TOUCHBAR_REPORT_LENGTH + 1];
-    report[0] = TOUCHBAR_REPORT_ID;
-    memcpy(&report[1], frame, len - 1);
-    
-    int ret = write(fd, report, sizeof(report));
-    if (ret < 0) {
-        syslog(LOG_ERR, "Failed to write Touch Bar frame: %s", strerror(errno));
-        return -1;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Compose the current layer through the brightness LUT and post it to
+ * the writer thread. Only @damage is recomposed (the whole frame if
+ * NULL). Write errors and stalls come back through dfr_mailbox_check().
+ */
+static void present(const struct dfr_rect *damage)
+{
+    const struct dfr_frame *frame = dfr_cache_get(layer_cache, current_layer);
+
+    if (!composed) {
+        damage = NULL;
     }
-    
-    return 0;
+
+    dfr_lut_apply(&mailbox.pending, frame, &backlight.lut, damage);
+    composed = true;
+
+    dfr_mailbox_post(&mailbox);
 }
 
-int handle_touchbar_events(int fd)
+/*
+ * Show @layer on the Touch Bar. The frame comes straight from the layer
+ * cache, and only the chunks that differ from what is on screen are sent.
+ */
+void show_layer(enum dfr_layer layer)
 {
-    struct pollfd pfd = {
-        .fd = fd,
-        .events = POLLIN,
-    };
-    
-    int ret = poll(&pfd, 1, 100);
-    if (ret < 0) {
-        syslog(LOG_ERR, "Poll error: %s", strerror(errno));
-        return -1;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    current_layer = layer;
+    present(NULL);
+
+    long us = elapsed_us(&start);
+
+    switch_stats.count++;
+    switch_stats.total_us += us;
+    if (us > switch_stats.max_us) {
+        switch_stats.max_us = us;
     }
-    
-    if (ret == 0) {
-        /* Timeout, no events */
+
+    if (verbose) {
+        syslog(LOG_DEBUG, "Layer %d posted in %ld us", layer, us);
+    }
+}
+
+static double brightness_target(double idle)
+{
+    if (config->idle_timeout && idle >= config->idle_timeout) {
         return 0;
     }
-    
-    if (pfd.revents & POLLIN) {
+    if (config->dim_timeout && idle >= config->dim_timeout) {
+        return config->dim_brightness;
+    }
+    return config->brightness;
+}
+
+/* Poll timeout until the next fade step or dim/idle deadline */
+static int brightness_timeout(void)
+{
+    if (backlight.fading) {
+        return FADE_FRAME_MS;
+    }
+
+    double idle = elapsed_us(&backlight.last_activity) / 1e6;
+    double next = -1;
+
+    if (config->dim_timeout && idle < config->dim_timeout) {
+        next = config->dim_timeout - idle;
+    } else if (config->idle_timeout && idle < config->idle_timeout) {
+        next = config->idle_timeout - idle;
+    }
+
+    return next < 0 ? -1 : (int)(next * 1000) + 1;
+}
+
+/* The sooner of two poll timeouts, where -1 means none */
+static int earliest(int a, int b)
+{
+    if (a < 0) {
+        return b;
+    }
+    return b < 0 || a < b ? a : b;
+}
+
+void touchbar_activity(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &backlight.last_activity);
+}
+
+/*
+ * Move the brightness toward its target for the current idle time. A
+ * frame is only sent when the quantized LUT actually changes.
+ */
+void update_brightness(int fd)
+{
+    double idle = elapsed_us(&backlight.last_activity) / 1e6;
+    double target = brightness_target(idle);
+    struct timespec start;
+
+    if (target != backlight.to) {
+        backlight.from = backlight.level;
+        backlight.to = target;
+        backlight.fading = true;
+        clock_gettime(CLOCK_MONOTONIC, &backlight.start);
+    }
+
+    if (!backlight.fading) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    double t = 1;
+    if (config->fade_ms) {
+        t = elapsed_us(&backlight.start) / (config->fade_ms * 1000.0);
+    }
+    if (t >= 1) {
+        t = 1;
+        backlight.fading = false;
+    }
+
+    backlight.level = backlight.from + (backlight.to - backlight.from) * t;
+
+    struct dfr_lut lut;
+    dfr_lut_build(&lut, backlight.level, config->gamma);
+    if (memcmp(lut.level, backlight.lut.level, sizeof(lut.level)) == 0) {
+        return;
+    }
+    backlight.lut = lut;
+
+    if (fd < 0 || !composed) {
+        return;
+    }
+
+    present(NULL);
+
+    long us = elapsed_us(&start);
+
+    fade_stats.count++;
+    fade_stats.total_us += us;
+    if (us > fade_stats.max_us) {
+        fade_stats.max_us = us;
+    }
+}
+
+/* The layer apple-ib-tb reports keys from: Fn flips the driver's mode */
+static enum dfr_layer fn_layer(void)
+{
+    return fn_pressed != fkeys_first ? DFR_LAYER_FKEYS : DFR_LAYER_SPECIAL;
+}
+
+/*
+ * Early boot: have the driver report function keys, keeping its mode for
+ * the full daemon to restore. Drawing them alone would make the bar lie.
+ */
+static void early_fnmode(void)
+{
+    int mode = dfr_fnmode_get();
+
+    if (mode < 0) {
+        syslog(LOG_WARNING, "apple-ib-tb not bound, showing its default keys");
+        return;
+    }
+
+    if (saved_fnmode < 0) {
+        saved_fnmode = mode;
+    }
+    fkeys_first = mode == DFR_FNMODE_FKEYS ||
+                  dfr_fnmode_set(DFR_FNMODE_FKEYS) == 0;
+}
+
+/*
+ * Follow the driver's fn mode, which may differ from one attach to the
+ * next (fnmode=1 on the command line, the driver reloaded). Taking over
+ * from the early instance, it is the mode about to be restored.
+ */
+static void follow_fnmode(void)
+{
+    int mode = handover_pending ? handover.fnmode : dfr_fnmode_get();
+
+    if (mode >= 0) {
+        fkeys_first = mode == DFR_FNMODE_FKEYS;
+    }
+}
+
+/* Bring up a freshly connected Touch Bar with every layer pre-rendered */
+void attach_touchbar(int fd)
+{
+    struct timespec start;
+
+    if (touch_events.dev_fd < 0) {
+        dfr_events_open(&touch_events);
+    }
+
+    if (early_boot) {
+        early_fnmode();
+    } else {
+        follow_fnmode();
+    }
+
+    if (fn_fd < 0) {
+        fn_fd = dfr_fnkey_open();
+    }
+    if (fn_fd >= 0) {
+        int state = dfr_fnkey_state(fn_fd);
+
+        fn_pressed = state > 0;
+    }
+    current_layer = fn_layer();
+
+    /* The visible layer goes out as soon as it is rendered */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    dfr_prerender_start(layer_cache, current_layer);
+    dfr_prerender_wait(layer_cache, current_layer);
+
+    dfr_mailbox_reset(&mailbox, fd);
+    composed = false;
+
+    /* Taking over from the early instance, the bar was never dark */
+    if (handover_pending) {
+        backlight.last_activity = handover.last_activity;
+    } else {
+        touchbar_activity();
+    }
+
+    show_layer(current_layer);
+    long first_us = elapsed_us(&start);
+
+    /* Only now, so the keys match the frame on screen */
+    dfr_events_set_keymap(&touch_events, layer_cache->layout);
+    if (handover_pending) {
+        handover_pending = false;
+        if (handover.fnmode >= 0) {
+            dfr_fnmode_set(handover.fnmode);
+        }
+        syslog(LOG_INFO, "Took over from the early boot instance");
+    }
+
+    dfr_prerender_finish(layer_cache);
+
+    if (verbose) {
+        syslog(LOG_DEBUG, "First frame after %ld us, all layers after %ld us",
+               first_us, elapsed_us(&start));
+    }
+}
+
+/* Follow Fn transitions: held shows the function keys */
+void handle_fn_key(int fd)
+{
+    if (dfr_fnkey_read(fn_fd, &fn_pressed) < 0) {
+        syslog(LOG_WARNING, "Lost the Fn key device");
+        close(fn_fd);
+        fn_fd = -1;
+        fn_pressed = false;
+    }
+
+    enum dfr_layer layer = fn_layer();
+    if (layer == current_layer) {
+        return;
+    }
+
+    touchbar_activity();
+    if (fd >= 0) {
+        show_layer(layer);
+    } else {
+        current_layer = layer;
+    }
+}
+
+/*
+ * Let @widget consume its update source. Its glyphs are redrawn into the
+ * cached frame of its layer, and if that layer is on screen only the
+ * chunks under the redrawn glyphs are sent.
+ */
+void update_widget(int fd, struct dfr_widget *widget)
+{
+    struct dfr_rect damage;
+
+    if (!dfr_widget_update(widget, layer_cache, &damage)) {
+        return;
+    }
+
+    if (fd < 0 || !composed || widget->layer != current_layer) {
+        return;
+    }
+
+    present(&damage);
+    if (verbose) {
+        syslog(LOG_DEBUG, "Widget '%s' updated", widget->type->name);
+    }
+}
+
+/* Run the widgets of @layout, and have the keys send what it shows */
+static void bind_layout(const struct dfr_layout *layout)
+{
+    dfr_widgets_bind(layout);
+    dfr_events_set_keymap(&touch_events, layout);
+}
+
+/*
+ * Recompile the configuration after it changed on disk and swap it in
+ * between frames. The new layout is rendered into a spare cache first,
+ * so the swap is a pointer assignment plus one frame submission; the
+ * Touch Bar fd stays open throughout, so no input is lost.
+ */
+void reload_config(int fd)
+{
+    struct dfr_config *next = dfr_config_load(config_path);
+    if (!next) {
+        syslog(LOG_WARNING, "Keeping previous configuration");
+        return;
+    }
+
+    const struct dfr_layout *layout = dfr_config_app_layout(next, focused_app);
+    struct dfr_layer_cache *spare = dfr_lru_take(&layouts, layout, layer_cache);
+
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    bind_layout(layout);
+    dfr_prerender_start(spare, current_layer);
+    dfr_prerender_wait(spare, current_layer);
+
+    /* The other cached layouts point into the old configuration */
+    layer_cache = spare;
+    dfr_lru_drop(&layouts, layer_cache);
+    dfr_config_free(config);
+    config = next;
+
+    /* Fade to the new brightness settings from wherever we are */
+    backlight.to = -1;
+
+    syslog(LOG_INFO, "Configuration reloaded, using layout '%s'",
+           layout->name);
+
+    if (fd >= 0) {
+        show_layer(current_layer);
+    }
+
+    dfr_prerender_finish(layer_cache);
+
+    if (verbose) {
+        syslog(LOG_DEBUG, "Layout '%s' rendered in %ld us",
+               layout->name, elapsed_us(&start));
+    }
+}
+
+/*
+ * Show the layout for the newly focused @app. A layout still in the LRU
+ * only needs its widgets redrawn, then the swap is a pointer assignment
+ * plus one frame submission; any other is rendered into the least
+ * recently used cache first, the visible layer ahead of the rest.
+ */
+void focus_app(int fd, const char *app)
+{
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snprintf(focused_app, sizeof(focused_app), "%s", app);
+
+    const struct dfr_layout *layout = dfr_config_app_layout(config, app);
+    if (layout == layer_cache->layout) {
+        return;
+    }
+
+    struct dfr_layer_cache *cache = dfr_lru_find(&layouts, layout);
+    int kind = cache ? FOCUS_CACHED : FOCUS_RENDERED;
+
+    /* Widgets run for the layout on screen only */
+    bind_layout(layout);
+
+    if (cache) {
+        dfr_widgets_refresh(cache);
+    } else {
+        cache = dfr_lru_take(&layouts, layout, layer_cache);
+        dfr_prerender_start(cache, current_layer);
+        dfr_prerender_wait(cache, current_layer);
+    }
+
+    layer_cache = cache;
+
+    if (fd >= 0) {
+        present(NULL);
+        focus_stats.start = start;
+        focus_stats.pending = true;
+        focus_stats.kind = kind;
+    }
+
+    if (kind == FOCUS_RENDERED) {
+        dfr_prerender_finish(cache);
+    }
+
+    if (verbose) {
+        syslog(LOG_DEBUG, "Focus on '%s', layout '%s' (%s)", app,
+               layout->name, kind == FOCUS_CACHED ? "cached" : "rendered");
+    }
+}
+
+/* Account for a focus change once the device holds the whole frame */
+static void focus_done(void)
+{
+    long us = elapsed_us(&focus_stats.start);
+    int kind = focus_stats.kind;
+
+    focus_stats.pending = false;
+    focus_stats.stats[kind].count++;
+    focus_stats.stats[kind].total_us += us;
+    if (us > focus_stats.stats[kind].max_us) {
+        focus_stats.stats[kind].max_us = us;
+    }
+
+    if (verbose) {
+        syslog(LOG_DEBUG, "Layout '%s' on the Touch Bar %ld us after the "
+               "focus change", layer_cache->layout->name, us);
+    }
+}
+
+void close_touchbar(int *fd)
+{
+    dfr_mailbox_reset(&mailbox, -1);
+    close(*fd);
+    *fd = -1;
+    dfr_events_close(&touch_events);
+
+    /* A reattach sends the frame for reasons of its own */
+    focus_stats.pending = false;
+}
+
+/* Whether @fd still reaches the Touch Bar, e.g. after a resume */
+static bool touchbar_alive(int fd)
+{
+    struct hidraw_devinfo devinfo;
+
+    return ioctl(fd, HIDIOCGRAWINFO, &devinfo) == 0 &&
+           (uint16_t)devinfo.vendor == APPLE_VENDOR_ID &&
+           (uint16_t)devinfo.product == T1_IBRIDGE_ID;
+}
+
+/*
+ * PrepareForSleep. Going down, stop the timers and leave the fd and the
+ * frames as they are. Coming back, show the current layer at full
+ * brightness straight away: on the same fd if it survived, otherwise as
+ * soon as the Touch Bar reappears.
+ */
+static void handle_sleep(bool suspending, void *data)
+{
+    int *fd = data;
+
+    if (suspending) {
+        suspended = true;
+        backlight.fading = false;
+        syslog(LOG_INFO, "Suspending, Touch Bar parked");
+        return;
+    }
+
+    suspended = false;
+    clock_gettime(CLOCK_MONOTONIC, &resume_stats.start);
+    resume_stats.pending = true;
+    resume_stats.reattached = false;
+
+    touchbar_activity();
+    backlight.level = backlight.to = brightness_target(0);
+    backlight.fading = false;
+    dfr_lut_build(&backlight.lut, backlight.level, config->gamma);
+
+    if (*fd >= 0 && !touchbar_alive(*fd)) {
+        syslog(LOG_INFO, "Touch Bar gone across suspend, reattaching");
+        close_touchbar(fd);
+    }
+
+    /* Whatever the device shows after resume is unknown, send it all */
+    if (*fd >= 0) {
+        dfr_mailbox_reset(&mailbox, *fd);
+        composed = false;
+        present(NULL);
+    }
+
+    if (*fd < 0) {
+        resume_stats.reattached = true;
+        rediscover = true;
+    }
+}
+
+/* Account for the resume once the device holds the whole frame */
+static void resume_done(void)
+{
+    long us = elapsed_us(&resume_stats.start);
+
+    resume_stats.pending = false;
+    resume_stats.count++;
+    resume_stats.total_us += us;
+    if (us > resume_stats.max_us) {
+        resume_stats.max_us = us;
+    }
+
+    syslog(LOG_INFO, "Touch Bar restored %ld us after resume (%s)", us,
+           resume_stats.reattached ? "reattached" : "same device");
+}
+
+static void handle_ring_event(const struct appletb_ring_event *ev)
+{
+    if (ev->type == APPLETB_EV_KEY ||
+        (ev->type == APPLETB_EV_CONTACT && ev->value)) {
+        touchbar_activity();
+    }
+}
+
+/* Drain the event ring; one wakeup covers any number of reports */
+void handle_ring_events(void)
+{
+    unsigned int n = dfr_events_drain(&touch_events, handle_ring_event);
+
+    if (verbose && n > 0) {
+        syslog(LOG_DEBUG, "Drained %u Touch Bar events", n);
+    }
+}
+
+/*
+ * Touch Bar hidraw node. Its reports are only read when the event ring
+ * is not available; otherwise it is just watched for errors and for
+ * room to write frames.
+ */
+int handle_touchbar_events(int fd, short revents)
+{
+    if (revents & POLLIN) {
         uint8_t buf[256];
         ssize_t n = read(fd, buf, sizeof(buf));
         
@@ -155,12 +759,16 @@ int handle_touchbar_events(int fd)
             return 0;
         }
         
+        if (n > 0) {
+            touchbar_activity();
+        }
+        
         if (verbose && n > 0) {
             syslog(LOG_DEBUG, "Received %zd bytes from Touch Bar", n);
         }
     }
     
-    if (pfd.revents & (POLLERR | POLLHUP)) {
+    if (revents & (POLLERR | POLLHUP)) {
         syslog(LOG_WARNING, "Touch Bar device error or disconnected");
         return -1;
     }
@@ -173,7 +781,9 @@ int main(int argc, char *argv[])
     int opt;
     
     /* Parse arguments */
-    while ((opt = getopt(argc, argv, "hvfV")) != -1) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    while ((opt = getopt(argc, argv, "hvfVc:j:i")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
@@ -184,6 +794,15 @@ int main(int argc, char *argv[])
             case 'f':
                 foreground = 1;
                 break;
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'j':
+                threads = atol(optarg);
+                break;
+            case 'i':
+                early_boot = true;
+                break;
             case 'V':
                 printf("%s v%s\n", PROGRAM_NAME, PROGRAM_VERSION);
                 return 0;
@@ -217,6 +836,54 @@ int main(int argc, char *argv[])
         }
     }
     
+    if (early_boot) {
+        /* No /etc to read yet; never blank the bar at a prompt */
+        config = dfr_config_default();
+        if (config) {
+            config->idle_timeout = 0;
+        }
+    } else {
+        config = dfr_config_load(config_path);
+        if (!config) {
+            syslog(LOG_ERR, "Invalid configuration, using built-in layout");
+            config = dfr_config_default();
+        }
+    }
+    if (!config) {
+        closelog();
+        return 1;
+    }
+    bind_layout(config->active);
+    layer_cache = dfr_lru_take(&layouts, config->active, NULL);
+    
+    if (dfr_mailbox_init(&mailbox) < 0) {
+        closelog();
+        return 1;
+    }
+
+    if (dfr_prerender_init(threads > 0 ? threads : 1) < 0) {
+        syslog(LOG_WARNING, "Rendering on the main thread only");
+    }
+    
+    backlight.level = backlight.to = config->brightness;
+    touchbar_activity();
+
+    /* Fade from where the early instance left the bar */
+    if (!early_boot && dfr_handover_load(&handover)) {
+        backlight.level = backlight.to = handover.level;
+        handover_pending = true;
+    }
+    dfr_lut_build(&backlight.lut, backlight.level, config->gamma);
+    
+    int config_fd = early_boot ? -1 : dfr_config_watch(config_path);
+    int focus_fd = early_boot ? -1 : dfr_focus_open();
+    int hotplug_fd = dfr_hotplug_open();
+
+    /* No logind in the initramfs */
+    if (!early_boot) {
+        dfr_sleep_open(&sleep_watch);
+    }
+
     syslog(LOG_INFO, "Initialization complete, waiting for Touch Bar device");
     
     /* Main event loop */
@@ -225,35 +892,232 @@ int main(int argc, char *argv[])
     
     while (running) {
         /* Attempt to find Touch Bar if not connected */
-        if (touchbar_fd < 0) {
+        if (touchbar_fd < 0 && !suspended) {
             time_t now = time(NULL);
             
-            /* Only attempt discovery every 5 seconds */
-            if (now - last_discovery >= 5) {
+            /* Only attempt discovery every 5 seconds, or on hotplug */
+            if (rediscover || now - last_discovery >= 5) {
                 touchbar_fd = find_touchbar_device();
                 last_discovery = now;
+                rediscover = false;
                 
                 if (touchbar_fd >= 0) {
                     syslog(LOG_INFO, "Touch Bar device connected");
+
+                    attach_touchbar(touchbar_fd);
                 }
             }
-            
-            sleep(1);
+        }
+        
+        enum {
+            PFD_TOUCHBAR, PFD_MAILBOX, PFD_EVENTS, PFD_CONFIG, PFD_FNKEY,
+            PFD_HOTPLUG, PFD_SLEEP, PFD_FOCUS, PFD_WIDGETS
+        };
+        short touchbar_events = touch_events.dev_fd < 0 ? POLLIN : 0;
+        struct pollfd pfds[PFD_WIDGETS + DFR_MAX_WIDGETS] = {
+            [PFD_TOUCHBAR] = { .fd = touchbar_fd, .events = touchbar_events },
+            [PFD_MAILBOX] = {
+                .fd = suspended ? -1 : mailbox.done_fd,
+                .events = POLLIN,
+            },
+            [PFD_EVENTS] = {
+                .fd = touch_events.dev_fd < 0 ? -1 : touch_events.event_fd,
+                .events = POLLIN,
+            },
+            [PFD_CONFIG] = { .fd = config_fd, .events = POLLIN },
+            [PFD_FNKEY] = { .fd = fn_fd, .events = POLLIN },
+            [PFD_HOTPLUG] = { .fd = hotplug_fd, .events = POLLIN },
+            [PFD_SLEEP] = { .fd = sleep_watch.bus_fd, .events = POLLIN },
+            [PFD_FOCUS] = { .fd = focus_fd, .events = POLLIN },
+        };
+        int npfds = PFD_WIDGETS;
+        struct dfr_widget *widget;
+        
+        while ((widget = dfr_widget_get(npfds - PFD_WIDGETS))) {
+            pfds[npfds].fd = widget->fd;
+            pfds[npfds].events = POLLIN;
+            npfds++;
+        }
+        
+        int timeout = 1000;
+        
+        if (suspended) {
+            timeout = -1;
+        } else if (touchbar_fd >= 0) {
+            timeout = earliest(brightness_timeout(),
+                               dfr_mailbox_timeout(&mailbox));
+        }
+        
+        int ret = poll(pfds, npfds, timeout);
+        if (ret < 0) {
+            if (errno != EINTR) {
+                syslog(LOG_ERR, "Poll error: %s", strerror(errno));
+                break;
+            }
             continue;
         }
         
+        /* First, so a resume puts the frame out before anything else */
+        if (pfds[PFD_SLEEP].revents) {
+            int polled_fd = touchbar_fd;
+
+            dfr_sleep_dispatch(&sleep_watch, handle_sleep, &touchbar_fd);
+
+            /*
+             * The Touch Bar was dropped across suspend: the revents below
+             * are for an fd that is closed now. Whatever else was pending
+             * is still there on the next poll.
+             */
+            if (touchbar_fd != polled_fd) {
+                continue;
+            }
+        }
+        
+        if ((pfds[PFD_HOTPLUG].revents & POLLIN) &&
+            dfr_hotplug_read(hotplug_fd)) {
+            if (touchbar_fd < 0) {
+                rediscover = true;
+            } else {
+                /* apple-ib-tb may bind after the iBridge node appeared */
+                if (!early_boot) {
+                    follow_fnmode();
+                } else if (!fkeys_first) {
+                    early_fnmode();
+                }
+                if (fn_layer() != current_layer) {
+                    show_layer(fn_layer());
+                }
+            }
+        }
+        
         /* Handle events from Touch Bar */
-        if (handle_touchbar_events(touchbar_fd) < 0) {
+        if (pfds[PFD_TOUCHBAR].revents &&
+            handle_touchbar_events(touchbar_fd,
+                                   pfds[PFD_TOUCHBAR].revents) < 0) {
             syslog(LOG_WARNING, "Touch Bar device error, reconnecting");
-            close(touchbar_fd);
-            touchbar_fd = -1;
+            close_touchbar(&touchbar_fd);
+        }
+        
+        /* The ring goes away with the Touch Bar, which may just have */
+        if ((pfds[PFD_EVENTS].revents & POLLIN) && touch_events.dev_fd >= 0) {
+            handle_ring_events();
+        }
+        
+        if (pfds[PFD_FNKEY].revents) {
+            handle_fn_key(touchbar_fd);
+        }
+        
+        for (int i = PFD_WIDGETS; i < npfds; i++) {
+            if (pfds[i].revents & POLLIN) {
+                update_widget(touchbar_fd, dfr_widget_get(i - PFD_WIDGETS));
+            }
+        }
+        
+        /* Like a reload, a focus change rebinds the widgets polled above */
+        if (pfds[PFD_FOCUS].revents & POLLIN) {
+            char app[DFR_FOCUS_APP_MAX];
+
+            if (dfr_focus_read(focus_fd, app, sizeof(app))) {
+                focus_app(suspended ? -1 : touchbar_fd, app);
+            }
+        }
+        
+        /* Last, as a reload rebinds the widgets polled above */
+        if ((pfds[PFD_CONFIG].revents & POLLIN) &&
+            dfr_config_changed(config_fd, config_path)) {
+            reload_config(touchbar_fd);
+        }
+        
+        if (suspended) {
             continue;
         }
+        
+        update_brightness(touchbar_fd);
+        
+        /* The writer went idle, a write failed, or one is stuck */
+        if (dfr_mailbox_check(&mailbox) < 0 && touchbar_fd >= 0) {
+            syslog(LOG_WARNING, "Touch Bar not accepting frames, reconnecting");
+            close_touchbar(&touchbar_fd);
+        }
+        
+        bool frame_out = touchbar_fd >= 0 && !dfr_mailbox_busy(&mailbox);
+
+        if (resume_stats.pending && frame_out && composed) {
+            resume_done();
+        }
+        
+        if (focus_stats.pending && frame_out) {
+            focus_done();
+        }
     }
     
+    /* Stopped at switch-root: the frame stays up for the full daemon */
+    if (early_boot && touchbar_fd >= 0) {
+        struct dfr_handover state = {
+            .fnmode = saved_fnmode,
+            .level = backlight.level,
+            .last_activity = backlight.last_activity,
+        };
+
+        dfr_handover_save(&state);
+    }
+
     if (touchbar_fd >= 0) {
-        close(touchbar_fd);
+        close_touchbar(&touchbar_fd);
+    }
+    
+    if (switch_stats.count > 0) {
+        syslog(LOG_INFO, "Layer switches: %lu, avg %ld us, max %ld us",
+               switch_stats.count, switch_stats.total_us / (long)switch_stats.count,
+               switch_stats.max_us);
+    }
+    
+    if (mailbox.posted > 0) {
+        syslog(LOG_INFO, "Frames: %lu posted, %lu replaced unsent, "
+               "%lu writes past the deadline", mailbox.posted,
+               mailbox.replaced, mailbox.stalls);
+    }
+    
+    if (fade_stats.count > 0) {
+        syslog(LOG_INFO, "Fade frames: %lu, avg %ld us, max %ld us",
+               fade_stats.count, fade_stats.total_us / (long)fade_stats.count,
+               fade_stats.max_us);
+    }
+    
+    for (int kind = FOCUS_RENDERED; kind <= FOCUS_CACHED; kind++) {
+        if (focus_stats.stats[kind].count > 0) {
+            syslog(LOG_INFO, "Focus changes to %s layouts: %lu, frame after "
+                   "avg %ld us, max %ld us",
+                   kind == FOCUS_CACHED ? "cached" : "new",
+                   focus_stats.stats[kind].count,
+                   focus_stats.stats[kind].total_us /
+                       (long)focus_stats.stats[kind].count,
+                   focus_stats.stats[kind].max_us);
+        }
+    }
+    
+    if (resume_stats.count > 0) {
+        syslog(LOG_INFO, "Resumes: %lu, Touch Bar restored after avg %ld us, "
+               "max %ld us", resume_stats.count,
+               resume_stats.total_us / (long)resume_stats.count,
+               resume_stats.max_us);
+    }
+    
+    if (config_fd >= 0) {
+        close(config_fd);
+    }
+    if (fn_fd >= 0) {
+        close(fn_fd);
+    }
+    if (hotplug_fd >= 0) {
+        close(hotplug_fd);
     }
+    dfr_focus_close(focus_fd);
+    dfr_sleep_close(&sleep_watch);
+    dfr_mailbox_shutdown(&mailbox);
+    dfr_prerender_shutdown();
+    dfr_widgets_unbind();
+    dfr_config_free(config);
     
     syslog(LOG_INFO, "%s shutting down", PROGRAM_NAME);
     closelog();
@@ -6,7 +6,14 @@
 #ifndef TINY_DFR_H
 #define TINY_DFR_H
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
+
+#include "apple-ib-tb.h"
+#include "apple-ib-tb-keymap.h"
 
 /* Apple USB identifiers */
 #define APPLE_VENDOR_ID 0x05ac
@@ -23,4 +30,338 @@ enum dfr_mode {
     DFR_MODE_EXPANDED = 2,
 };
 
+/* Touch Bar panel, in device pixels */
+#define DFR_WIDTH 2170
+#define DFR_HEIGHT 60
+
+/*
+ * Device frame format: 4-bit grayscale, two pixels per byte with the left
+ * pixel in the high nibble, row-major. A frame is sent as a series of
+ * TOUCHBAR_REPORT_ID reports, each carrying one chunk of one row:
+ *
+ *   [0] report id  [1] row  [2] chunk  [3..] DFR_CHUNK_BYTES of row data
+ */
+#define DFR_STRIDE ((DFR_WIDTH + 1) / 2)
+#define DFR_CHUNK_HEADER 3
+#define DFR_CHUNK_BYTES (TOUCHBAR_REPORT_LENGTH - DFR_CHUNK_HEADER)
+#define DFR_ROW_CHUNKS ((DFR_STRIDE + DFR_CHUNK_BYTES - 1) / DFR_CHUNK_BYTES)
+
+/* Composition surface, 8-bit luminance */
+struct dfr_surface {
+    uint8_t px[DFR_HEIGHT][DFR_WIDTH];
+};
+
+/* Frame in device format, ready to be sent */
+struct dfr_frame {
+    uint8_t px[DFR_HEIGHT][DFR_STRIDE];
+};
+
+/* Touch Bar layers, selected by the Fn key */
+enum dfr_layer {
+    DFR_LAYER_SPECIAL = 0,
+    DFR_LAYER_FKEYS = 1,
+    DFR_LAYER_COUNT,
+};
+
+#define DFR_MAX_KEYS APPLETB_KEYMAP_MAX_KEYS /* ESC, F1-F12 */
+
+struct dfr_key {
+    const char *label;
+    uint16_t code; /* linux input key code */
+};
+
+struct dfr_layer_def {
+    unsigned int nkeys;
+    struct dfr_key keys[DFR_MAX_KEYS];
+};
+
+struct dfr_layout {
+    const char *name;
+    const char *apps; /* space separated app ids it is shown for, or NULL */
+    struct dfr_layer_def layers[DFR_LAYER_COUNT];
+};
+
+/* Generated from the driver's keymap, see apple-ib-tb-keymap.h */
+extern const struct dfr_layout dfr_default_layout;
+
+/* Area of the panel, in device pixels */
+struct dfr_rect {
+    int x, y, w, h;
+};
+
+/* render.c */
+void dfr_key_rect(const struct dfr_layer_def *layer, unsigned int index,
+                  struct dfr_rect *rect);
+unsigned int dfr_key_at(const struct dfr_layer_def *layer, int x);
+void dfr_render_text(struct dfr_surface *surface, const struct dfr_rect *key,
+                     const char *text, const char *prev,
+                     struct dfr_rect *damage);
+void dfr_render_key(struct dfr_surface *surface,
+                    const struct dfr_layer_def *layer, unsigned int index,
+                    struct dfr_rect *tile);
+void dfr_render_layer(struct dfr_surface *surface,
+                      const struct dfr_layer_def *layer);
+
+/* frame.c */
+void dfr_convert_frame(struct dfr_frame *frame,
+                       const struct dfr_surface *surface);
+void dfr_convert_rect(struct dfr_frame *frame,
+                      const struct dfr_surface *surface,
+                      const struct dfr_rect *rect);
+
+/* Brightness mapping of the 4-bit levels, applied to cached frames */
+struct dfr_lut {
+    uint8_t level[16];
+    uint8_t byte[256]; /* both nibbles of a packed byte */
+};
+
+void dfr_lut_build(struct dfr_lut *lut, double brightness, double gamma);
+void dfr_lut_apply(struct dfr_frame *dst, const struct dfr_frame *src,
+                   const struct dfr_lut *lut, const struct dfr_rect *rect);
+
+/*
+ * Fully composed device frames for every layer of the active layout.
+ * A frame is rendered on first use and kept until its layer is
+ * invalidated, so switching layers never renders.
+ */
+struct dfr_layer_cache {
+    const struct dfr_layout *layout;
+    struct dfr_frame frames[DFR_LAYER_COUNT];
+    bool valid[DFR_LAYER_COUNT];
+};
+
+void dfr_cache_init(struct dfr_layer_cache *cache,
+                    const struct dfr_layout *layout);
+void dfr_cache_invalidate(struct dfr_layer_cache *cache, enum dfr_layer layer);
+const struct dfr_frame *dfr_cache_get(struct dfr_layer_cache *cache,
+                                      enum dfr_layer layer);
+
+/*
+ * Layer caches of the most recently shown layouts, so going back to one
+ * (on a focus change) is a pointer swap instead of a render.
+ */
+#define DFR_LAYOUT_SLOTS 4
+
+struct dfr_layout_lru {
+    struct dfr_layer_cache slots[DFR_LAYOUT_SLOTS];
+    uint64_t used[DFR_LAYOUT_SLOTS]; /* last use, 0 while empty */
+    uint64_t clock;
+};
+
+struct dfr_layer_cache *dfr_lru_find(struct dfr_layout_lru *lru,
+                                     const struct dfr_layout *layout);
+struct dfr_layer_cache *dfr_lru_take(struct dfr_layout_lru *lru,
+                                     const struct dfr_layout *layout,
+                                     const struct dfr_layer_cache *keep);
+void dfr_lru_drop(struct dfr_layout_lru *lru,
+                  const struct dfr_layer_cache *keep);
+
+/*
+ * prerender.c - Renders the tiles (one per key) of every layer of a cache
+ * on a pool of worker threads, so a new layout is ready in the time of
+ * its slowest tile rather than the sum of all of them.
+ */
+#define DFR_MAX_WORKERS 8
+
+int dfr_prerender_init(unsigned int threads);
+void dfr_prerender_shutdown(void);
+void dfr_prerender_start(struct dfr_layer_cache *cache, enum dfr_layer first);
+void dfr_prerender_wait(struct dfr_layer_cache *cache, enum dfr_layer layer);
+void dfr_prerender_finish(struct dfr_layer_cache *cache);
+
+/*
+ * Latest-wins handoff between composition and the device. hidraw writes
+ * are synchronous USB transfers whatever the fd flags say, so a writer
+ * thread does them: frames are composed into @pending and posted into a
+ * one-slot mailbox, where a newer frame replaces one not taken yet, and
+ * the writer sends the chunks that differ from what the device shows. It
+ * drops a frame half way when a newer one is posted, so a slow device
+ * never builds a backlog. The main loop enforces DFR_WRITE_DEADLINE_MS on
+ * every write and is told through @done_fd when the writer went idle.
+ */
+#define DFR_FRAME_CHUNKS (DFR_HEIGHT * DFR_ROW_CHUNKS)
+#define DFR_WRITE_DEADLINE_MS 500
+
+struct dfr_mailbox {
+    struct dfr_frame pending; /* main thread only */
+    int done_fd;              /* eventfd, readable when the writer idles */
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;   /* a frame was posted, or stopping */
+    pthread_t thread;
+    struct dfr_frame buf[2];
+    struct dfr_frame *slot; /* posted, not taken by the writer yet */
+    bool full;
+    bool sending;          /* the writer is working on a frame */
+    bool writing;          /* ... and is inside write() since @write_start */
+    bool late;             /* that write missed its deadline */
+    bool stopping;
+    int fd;                /* device, -1 if none */
+    unsigned int gen;      /* bumped by dfr_mailbox_reset() */
+    int error;             /* errno of a failed write, or 0 */
+    struct timespec write_start;
+
+    /* writer thread only */
+    struct dfr_frame shown;
+    bool stale[DFR_HEIGHT][DFR_ROW_CHUNKS]; /* @shown not known to match */
+    int cursor;
+
+    unsigned long posted;
+    unsigned long replaced; /* posted before the previous one was sent */
+    unsigned long stalls;   /* writes that missed their deadline */
+};
+
+int dfr_mailbox_init(struct dfr_mailbox *mb);
+void dfr_mailbox_shutdown(struct dfr_mailbox *mb);
+void dfr_mailbox_reset(struct dfr_mailbox *mb, int fd);
+void dfr_mailbox_post(struct dfr_mailbox *mb);
+bool dfr_mailbox_busy(struct dfr_mailbox *mb);
+int dfr_mailbox_check(struct dfr_mailbox *mb);
+int dfr_mailbox_timeout(struct dfr_mailbox *mb);
+
+/* events.c */
+struct dfr_events {
+    int dev_fd;
+    int event_fd; /* readable when the ring has new entries */
+    struct appletb_ring *ring;
+    uint32_t dropped;
+};
+
+int dfr_events_open(struct dfr_events *ev);
+void dfr_events_close(struct dfr_events *ev);
+typedef void (*dfr_event_handler)(const struct appletb_ring_event *ev);
+
+unsigned int dfr_events_drain(struct dfr_events *ev, dfr_event_handler handle);
+void dfr_events_set_keymap(struct dfr_events *ev,
+                           const struct dfr_layout *layout);
+
+/* fnkey.c */
+int dfr_fnkey_open(void);
+int dfr_fnkey_state(int fd);
+int dfr_fnkey_read(int fd, bool *pressed);
+
+/* hotplug.c */
+int dfr_hotplug_open(void);
+bool dfr_hotplug_read(int fd);
+
+/* Runtime state and sockets */
+#define DFR_RUN_DIR "/run/tiny-dfr"
+
+/*
+ * focus.c - A compositor or window manager helper reports the focused
+ * application as a datagram "focus <app-id>" on DFR_FOCUS_SOCKET.
+ */
+#define DFR_FOCUS_SOCKET DFR_RUN_DIR "/focus"
+#define DFR_FOCUS_APP_MAX 128
+
+int dfr_focus_open(void);
+void dfr_focus_close(int fd);
+bool dfr_focus_read(int fd, char *app, size_t size);
+
+/*
+ * sleep.c - logind PrepareForSleep. A delay lock is held while awake, so
+ * the handler runs before the system freezes; it is released once the
+ * handler returns and taken again on resume.
+ */
+#define DFR_SLEEP_MAX_FDS 4
+
+struct dfr_sleep {
+    int bus_fd;
+    int lock_fd;          /* delay inhibitor lock */
+    uint32_t serial;
+    uint32_t lock_serial; /* Inhibit() call awaiting its reply */
+    int fds[DFR_SLEEP_MAX_FDS]; /* received, not claimed by a message yet */
+    unsigned int nfds;
+    size_t len;
+    uint8_t buf[4096];
+};
+
+typedef void (*dfr_sleep_handler)(bool suspending, void *data);
+
+int dfr_sleep_open(struct dfr_sleep *watch);
+void dfr_sleep_close(struct dfr_sleep *watch);
+int dfr_sleep_dispatch(struct dfr_sleep *watch, dfr_sleep_handler handle,
+                       void *data);
+
+/*
+ * handover.c - The initramfs instance switches apple-ib-tb to function
+ * keys first and, when stopped at switch-root, leaves its state in /run
+ * for the full daemon, which puts the driver mode back.
+ */
+#define DFR_FNMODE_NORMAL 0
+#define DFR_FNMODE_FKEYS 1
+
+struct dfr_handover {
+    int fnmode;                    /* driver mode to restore */
+    double level;                  /* brightness, percent */
+    struct timespec last_activity; /* CLOCK_MONOTONIC */
+};
+
+int dfr_fnmode_get(void);
+int dfr_fnmode_set(int mode);
+int dfr_handover_save(const struct dfr_handover *handover);
+bool dfr_handover_load(struct dfr_handover *handover);
+
+/*
+ * widget.c - Keys labelled "@name" show live content instead of a label.
+ * Each widget waits on its own fd (a timerfd, an inotify watch, a socket)
+ * and only redraws the part of its button that changed.
+ */
+#define DFR_MAX_WIDGETS 8
+#define DFR_WIDGET_TEXT 16
+
+struct dfr_widget;
+
+struct dfr_widget_type {
+    const char *name;
+    /* Set up the update source and initial text, returns the fd or -1 */
+    int (*open)(struct dfr_widget *widget);
+    /* Called when the fd is readable, refreshes the text */
+    void (*update)(struct dfr_widget *widget);
+};
+
+struct dfr_widget {
+    const struct dfr_widget_type *type;
+    const struct dfr_layout *layout;
+    const struct dfr_key *key;
+    enum dfr_layer layer;
+    struct dfr_rect bounds;
+    int fd;
+    char text[DFR_WIDGET_TEXT];
+};
+
+unsigned int dfr_widgets_bind(const struct dfr_layout *layout);
+void dfr_widgets_unbind(void);
+struct dfr_widget *dfr_widget_get(unsigned int index);
+const char *dfr_widget_text(const struct dfr_key *key);
+bool dfr_widget_update(struct dfr_widget *widget,
+                       struct dfr_layer_cache *cache, struct dfr_rect *damage);
+void dfr_widgets_refresh(struct dfr_layer_cache *cache);
+
+/* config.c */
+struct dfr_config {
+    unsigned int nlayouts;
+    struct dfr_layout *layouts;
+    const struct dfr_layout *active;
+    unsigned int dim_timeout;  /* seconds */
+    unsigned int idle_timeout; /* seconds */
+    unsigned int fade_ms;
+    double gamma;
+    unsigned int brightness;     /* percent */
+    unsigned int dim_brightness; /* percent */
+
+    /* compiled image the layouts point into */
+    void *image;
+    size_t image_size;
+    bool mapped;
+};
+
+struct dfr_config *dfr_config_default(void);
+struct dfr_config *dfr_config_load(const char *path);
+const struct dfr_layout *dfr_config_app_layout(const struct dfr_config *config,
+                                               const char *app);
+void dfr_config_free(struct dfr_config *config);
+int dfr_config_watch(const char *path);
+bool dfr_config_changed(int fd, const char *path);
+
 #endif /* TINY_DFR_H */
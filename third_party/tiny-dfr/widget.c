@@ -0,0 +1,229 @@
+/*
+ * widget.c - Live Touch Bar keys
+ *
+ * A key labelled "@name" in a layout is bound to the widget type of that
+ * name, which provides the key's text and an fd to wait on for updates.
+ * When the text changes only the glyphs that differ are redrawn, straight
+ * into the cached frame of the widget's layer, and the redrawn area is
+ * handed back so just those chunks are sent to the device.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "tiny-dfr.h"
+
+static struct dfr_widget widgets[DFR_MAX_WIDGETS];
+static unsigned int nwidgets;
+
+/* Widgets only draw inside their own bounds, so one surface serves all */
+static struct dfr_surface scratch;
+
+/*
+ * Clock: HH:MM, updated by a timerfd that fires on every minute boundary.
+ * The timer is cancelled when the system clock is set, so it is re-armed
+ * against the new time.
+ */
+static int clock_arm(int fd)
+{
+    struct itimerspec its = {
+        .it_interval = { .tv_sec = 60 },
+        .it_value = { .tv_sec = (time(NULL) / 60 + 1) * 60 },
+    };
+
+    return timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                           &its, NULL);
+}
+
+static void clock_format(struct dfr_widget *widget)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    strftime(widget->text, sizeof(widget->text), "%H:%M", &tm);
+}
+
+static int clock_open(struct dfr_widget *widget)
+{
+    int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (clock_arm(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    clock_format(widget);
+    return fd;
+}
+
+static void clock_update(struct dfr_widget *widget)
+{
+    uint64_t expirations;
+
+    if (read(widget->fd, &expirations, sizeof(expirations)) < 0 &&
+        errno == ECANCELED) {
+        clock_arm(widget->fd);
+    }
+
+    clock_format(widget);
+}
+
+static const struct dfr_widget_type widget_types[] = {
+    { "clock", clock_open, clock_update },
+};
+
+static const struct dfr_widget_type *find_type(const char *name)
+{
+    for (size_t i = 0; i < sizeof(widget_types) / sizeof(widget_types[0]);
+         i++) {
+        if (strcmp(widget_types[i].name, name) == 0) {
+            return &widget_types[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Bind a widget to every "@name" key of @layout, replacing the widgets of
+ * the previous layout. Returns the number of widgets bound.
+ */
+unsigned int dfr_widgets_bind(const struct dfr_layout *layout)
+{
+    dfr_widgets_unbind();
+
+    for (int l = 0; l < DFR_LAYER_COUNT; l++) {
+        const struct dfr_layer_def *layer = &layout->layers[l];
+
+        for (unsigned int i = 0; i < layer->nkeys; i++) {
+            const char *label = layer->keys[i].label;
+
+            if (label[0] != '@') {
+                continue;
+            }
+
+            const struct dfr_widget_type *type = find_type(label + 1);
+            if (!type) {
+                syslog(LOG_WARNING, "Unknown widget '%s'", label + 1);
+                continue;
+            }
+
+            if (nwidgets == DFR_MAX_WIDGETS) {
+                syslog(LOG_WARNING, "Too many widgets, ignoring '%s'",
+                       label + 1);
+                continue;
+            }
+
+            struct dfr_widget *widget = &widgets[nwidgets];
+
+            memset(widget, 0, sizeof(*widget));
+            widget->type = type;
+            widget->layout = layout;
+            widget->key = &layer->keys[i];
+            widget->layer = l;
+            dfr_key_rect(layer, i, &widget->bounds);
+
+            widget->fd = type->open(widget);
+            if (widget->fd < 0) {
+                syslog(LOG_ERR, "Failed to start widget '%s': %s",
+                       type->name, strerror(errno));
+                continue;
+            }
+
+            nwidgets++;
+        }
+    }
+
+    return nwidgets;
+}
+
+void dfr_widgets_unbind(void)
+{
+    for (unsigned int i = 0; i < nwidgets; i++) {
+        close(widgets[i].fd);
+    }
+
+    nwidgets = 0;
+}
+
+struct dfr_widget *dfr_widget_get(unsigned int index)
+{
+    return index < nwidgets ? &widgets[index] : NULL;
+}
+
+/* Text to show on @key, or NULL if it has no widget */
+const char *dfr_widget_text(const struct dfr_key *key)
+{
+    for (unsigned int i = 0; i < nwidgets; i++) {
+        if (widgets[i].key == key) {
+            return widgets[i].text;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Handle a readable fd for @widget. If that changed what it shows and
+ * @cache holds a frame for its layer, the changed glyphs are redrawn into
+ * that frame and true is returned with the redrawn area in @damage.
+ *
+ * A cached frame always shows the widget text of the time it was drawn
+ * plus every update since, so the text before this update is exactly
+ * what the frame holds.
+ */
+bool dfr_widget_update(struct dfr_widget *widget,
+                       struct dfr_layer_cache *cache, struct dfr_rect *damage)
+{
+    char prev[DFR_WIDGET_TEXT];
+
+    memcpy(prev, widget->text, sizeof(prev));
+    widget->type->update(widget);
+
+    if (strcmp(prev, widget->text) == 0 || cache->layout != widget->layout ||
+        !cache->valid[widget->layer]) {
+        return false;
+    }
+
+    dfr_render_text(&scratch, &widget->bounds, widget->text, prev, damage);
+    if (damage->w == 0) {
+        return false;
+    }
+
+    dfr_convert_rect(&cache->frames[widget->layer], &scratch, damage);
+    return true;
+}
+
+/*
+ * Redraw every bound widget into @cache, whose frames show the widget
+ * text of whenever they were rendered, e.g. a cache swapped back in from
+ * the layout LRU.
+ */
+void dfr_widgets_refresh(struct dfr_layer_cache *cache)
+{
+    struct dfr_rect damage;
+
+    for (unsigned int i = 0; i < nwidgets; i++) {
+        struct dfr_widget *widget = &widgets[i];
+
+        if (cache->layout != widget->layout || !cache->valid[widget->layer]) {
+            continue;
+        }
+
+        dfr_render_text(&scratch, &widget->bounds, widget->text, NULL,
+                        &damage);
+        dfr_convert_rect(&cache->frames[widget->layer], &scratch, &damage);
+    }
+}
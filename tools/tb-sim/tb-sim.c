@@ -0,0 +1,476 @@
+/*
+ * tb-sim - Replay touch bar activity traces against dim/idle timeouts
+ *
+ * Runs recorded activity through the state machine apple-ib-tb uses
+ * (apple-ib-tb-state.h) on a simulated clock, once per candidate pair of
+ * dim and idle timeouts, and reports what each pair would have cost:
+ * time lit, timer wakeups, USB writes and how often the user met a dark
+ * touch bar.
+ *
+ * Traces are text, one event per line, "<ms> <kind>" with kind one of
+ * key, touch, pad, fn+ and fn-; '#' starts a comment. "tb-sim record"
+ * writes one from evdev devices, capturing what the driver's input
+ * handler sees: one line per input frame with activity.
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <sys/ioctl.h>
+
+#include "apple-ib-tb-state.h"
+
+#define MAX_GRID	16
+#define MAX_DEVICES	8
+
+enum activity {
+    ACT_KEY,        /* touch bar or keyboard key */
+    ACT_TOUCH,      /* touch bar contact */
+    ACT_PAD,        /* touchpad */
+    ACT_FN_DOWN,
+    ACT_FN_UP,
+};
+
+static const char *const activity_names[] = {
+    [ACT_KEY] = "key",
+    [ACT_TOUCH] = "touch",
+    [ACT_PAD] = "pad",
+    [ACT_FN_DOWN] = "fn+",
+    [ACT_FN_UP] = "fn-",
+};
+
+struct event {
+    unsigned long long ms;
+    enum activity kind;
+};
+
+static struct event *events;
+static size_t nevents;
+
+/* Simulated device: the clock, the armed deadline and what was sent */
+struct sim {
+    unsigned long long now;
+    unsigned long long armed;
+    unsigned long long since;       /* last display change */
+    unsigned int mode, disp;
+
+    unsigned long long lit_ms;      /* display on */
+    unsigned long long dim_ms;
+    unsigned long usb_writes;
+    unsigned long dark_wakes;       /* activity found the bar off */
+    unsigned long dim_wakes;
+};
+
+static unsigned long long sim_now(void *ctx)
+{
+    return ((struct sim *)ctx)->now;
+}
+
+static void sim_account(struct sim *sim)
+{
+    unsigned long long span = sim->now - sim->since;
+
+    if (sim->disp == APPLETB_SM_DISP_ON) {
+        sim->lit_ms += span;
+    } else if (sim->disp == APPLETB_SM_DISP_DIM) {
+        sim->dim_ms += span;
+    }
+    sim->since = sim->now;
+}
+
+/* apple-ib-tb sends the mode and the display state as separate requests */
+static void sim_output(void *ctx, unsigned int mode, unsigned int disp)
+{
+    struct sim *sim = ctx;
+
+    sim_account(sim);
+    sim->usb_writes += (mode != sim->mode) + (disp != sim->disp);
+    sim->mode = mode;
+    sim->disp = disp;
+}
+
+static void sim_arm(void *ctx, unsigned long long deadline)
+{
+    ((struct sim *)ctx)->armed = deadline;
+}
+
+static const struct appletb_sm_ops sim_ops = {
+    .now = sim_now,
+    .output = sim_output,
+    .arm = sim_arm,
+};
+
+/* Fire every deadline due up to @until */
+static void sim_advance(struct sim *sim, struct appletb_sm *sm,
+                        unsigned long long until)
+{
+    while (sim->armed && sim->armed <= until) {
+        sim->now = sim->armed;
+        sim->armed = 0;
+        appletb_sm_timer(sm);
+    }
+    sim->now = until;
+}
+
+struct result {
+    unsigned int dim, idle;
+    struct sim sim;
+    unsigned long wakeups;
+    unsigned long long total_ms;
+};
+
+static void simulate(struct result *res, unsigned int fn_mode)
+{
+    /* times start at 1, the state machine reserves 0 */
+    struct sim *sim = &res->sim;
+    struct appletb_sm sm;
+
+    memset(sim, 0, sizeof(*sim));
+    sim->now = sim->since = events[0].ms + 1;
+
+    appletb_sm_init(&sm, &sim_ops, sim, fn_mode, res->dim, res->idle);
+    sim->mode = sm.mode;
+    sim->disp = sm.disp;
+    appletb_sm_restart(&sm);
+
+    for (size_t i = 0; i < nevents; i++) {
+        sim_advance(sim, &sm, events[i].ms + 1);
+
+        if (sim->disp == APPLETB_SM_DISP_OFF) {
+            sim->dark_wakes++;
+        } else if (sim->disp == APPLETB_SM_DISP_DIM) {
+            sim->dim_wakes++;
+        }
+
+        switch (events[i].kind) {
+        case ACT_FN_DOWN:
+            appletb_sm_fn_key(&sm, true);
+            break;
+        case ACT_FN_UP:
+            appletb_sm_fn_key(&sm, false);
+            break;
+        default:
+            appletb_sm_activity(&sm);
+            break;
+        }
+    }
+
+    /* play out the tail so the last session goes dark as it would */
+    while (sim->armed) {
+        sim_advance(sim, &sm, sim->armed);
+    }
+    sim_account(sim);
+
+    res->wakeups = sm.wakeups;
+    res->total_ms = sim->now - (events[0].ms + 1);
+}
+
+static int parse_kind(const char *word, enum activity *kind)
+{
+    for (size_t i = 0; i < sizeof(activity_names) / sizeof(activity_names[0]);
+         i++) {
+        if (strcmp(word, activity_names[i]) == 0) {
+            *kind = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int load_trace(FILE *in, const char *name)
+{
+    size_t capacity = 0;
+    char line[128];
+    unsigned int lineno = 0;
+
+    while (fgets(line, sizeof(line), in)) {
+        unsigned long long ms;
+        char word[16];
+        enum activity kind;
+
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+        if (sscanf(line, "%llu %15s", &ms, word) != 2) {
+            if (strspn(line, " \t") != strlen(line)) {
+                fprintf(stderr, "%s:%u: expected \"<ms> <kind>\"\n", name,
+                        lineno);
+                return -1;
+            }
+            continue;
+        }
+
+        if (parse_kind(word, &kind) < 0) {
+            fprintf(stderr, "%s:%u: unknown activity '%s'\n", name, lineno,
+                    word);
+            return -1;
+        }
+
+        if (nevents > 0 && ms < events[nevents - 1].ms) {
+            fprintf(stderr, "%s:%u: time goes backwards\n", name, lineno);
+            return -1;
+        }
+
+        if (nevents == capacity) {
+            struct event *grown;
+
+            capacity = capacity ? capacity * 2 : 4096;
+            grown = realloc(events, capacity * sizeof(*events));
+            if (!grown) {
+                perror("realloc");
+                return -1;
+            }
+            events = grown;
+        }
+
+        events[nevents++] = (struct event){ ms, kind };
+    }
+
+    return 0;
+}
+
+/* "5,10,30" -> values; returns the count or -1 */
+static int parse_list(const char *arg, unsigned int *values)
+{
+    char *copy = strdup(arg);
+    char *save = NULL;
+    int n = 0;
+
+    if (!copy) {
+        return -1;
+    }
+
+    for (char *tok = strtok_r(copy, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *end;
+        unsigned long v = strtoul(tok, &end, 10);
+
+        if (*end != '\0' || n == MAX_GRID) {
+            free(copy);
+            return -1;
+        }
+        values[n++] = v;
+    }
+
+    free(copy);
+    return n;
+}
+
+static void print_results(const struct result *results, int n)
+{
+    printf("%6s %6s %8s %8s %8s %8s %8s %8s\n", "dim_s", "idle_s", "lit_%",
+           "dim_%", "wakeups", "usb_wr", "dark", "dimmed");
+
+    for (int i = 0; i < n; i++) {
+        const struct result *r = &results[i];
+        double total = r->total_ms ? (double)r->total_ms : 1.0;
+
+        printf("%6u %6u %8.1f %8.1f %8lu %8lu %8lu %8lu\n", r->dim, r->idle,
+               100.0 * r->sim.lit_ms / total, 100.0 * r->sim.dim_ms / total,
+               r->wakeups, r->sim.usb_writes, r->sim.dark_wakes,
+               r->sim.dim_wakes);
+    }
+}
+
+static volatile sig_atomic_t recording = 1;
+
+static void stop_recording(int sig)
+{
+    (void)sig;
+    recording = 0;
+}
+
+/*
+ * Print one trace line per input frame that had activity, classified the
+ * way apple-ib-tb's input handler would count it.
+ */
+static int record(int argc, char **argv)
+{
+    struct pollfd pfds[MAX_DEVICES];
+    enum activity kinds[MAX_DEVICES];
+    bool active[MAX_DEVICES] = { false };
+    int ndev = 0;
+    unsigned long long start = 0;
+
+    for (int i = 0; i < argc; i++) {
+        char *path = strchr(argv[i], '=');
+        int clock = CLOCK_MONOTONIC;
+
+        if (!path || ndev == MAX_DEVICES) {
+            fprintf(stderr, "Expected up to %d of "
+                    "bar|kbd|pad=/dev/input/eventN\n", MAX_DEVICES);
+            return 1;
+        }
+        *path++ = '\0';
+
+        if (strcmp(argv[i], "bar") == 0) {
+            kinds[ndev] = ACT_TOUCH;
+        } else if (strcmp(argv[i], "kbd") == 0) {
+            kinds[ndev] = ACT_KEY;
+        } else if (strcmp(argv[i], "pad") == 0) {
+            kinds[ndev] = ACT_PAD;
+        } else {
+            fprintf(stderr, "Unknown device class '%s'\n", argv[i]);
+            return 1;
+        }
+
+        pfds[ndev].fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        pfds[ndev].events = POLLIN;
+        if (pfds[ndev].fd < 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        ioctl(pfds[ndev].fd, EVIOCSCLOCKID, &clock);
+        ndev++;
+    }
+
+    signal(SIGINT, stop_recording);
+    signal(SIGTERM, stop_recording);
+    fprintf(stderr, "Recording, ^C to stop\n");
+
+    while (recording) {
+        if (poll(pfds, ndev, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return 1;
+        }
+
+        for (int d = 0; d < ndev; d++) {
+            struct input_event ev[64];
+            ssize_t n;
+
+            if (!(pfds[d].revents & POLLIN)) {
+                continue;
+            }
+
+            while ((n = read(pfds[d].fd, ev, sizeof(ev))) > 0) {
+                for (size_t i = 0; i < n / sizeof(ev[0]); i++) {
+                    unsigned long long ms = ev[i].input_event_sec * 1000ULL +
+                                            ev[i].input_event_usec / 1000;
+
+                    if (!start) {
+                        start = ms;
+                    }
+
+                    if (ev[i].type == EV_KEY && ev[i].code == KEY_FN) {
+                        printf("%llu %s\n", ms - start,
+                               activity_names[ev[i].value ? ACT_FN_DOWN :
+                                                            ACT_FN_UP]);
+                    } else if (ev[i].type == EV_KEY || ev[i].type == EV_ABS ||
+                               ev[i].type == EV_REL) {
+                        active[d] = true;
+                    } else if (ev[i].type == EV_SYN && active[d]) {
+                        printf("%llu %s\n", ms - start,
+                               activity_names[kinds[d]]);
+                        active[d] = false;
+                    }
+                }
+            }
+        }
+        fflush(stdout);
+    }
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d DIM,...] [-i IDLE,...] [-f MODE] [TRACE]\n",
+            prog);
+    fprintf(stderr, "       %s record bar|kbd|pad=/dev/input/eventN ...\n",
+            prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -d LIST   dim timeouts in seconds (default 5)\n");
+    fprintf(stderr, "  -i LIST   idle timeouts in seconds (default 60)\n");
+    fprintf(stderr, "  -f MODE   fnmode, 0 special keys, 1 F-keys "
+            "(default 0)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Every dim/idle pair is simulated, "
+            "0 disables a timeout.\n");
+    fprintf(stderr, "TRACE defaults to standard input.\n");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int dims[MAX_GRID] = { 5 }, idles[MAX_GRID] = { 60 };
+    int ndims = 1, nidles = 1;
+    unsigned int fn_mode = APPLETB_SM_FN_MODE_NORM;
+    struct result results[MAX_GRID * MAX_GRID];
+    const char *name = "<stdin>";
+    FILE *in = stdin;
+    int opt, n = 0;
+
+    if (argc > 1 && strcmp(argv[1], "record") == 0) {
+        return record(argc - 2, argv + 2);
+    }
+
+    while ((opt = getopt(argc, argv, "d:i:f:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            ndims = parse_list(optarg, dims);
+            break;
+        case 'i':
+            nidles = parse_list(optarg, idles);
+            break;
+        case 'f':
+            fn_mode = atoi(optarg) ? APPLETB_SM_FN_MODE_FKEYS :
+                                     APPLETB_SM_FN_MODE_NORM;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+
+        if (ndims <= 0 || nidles <= 0) {
+            fprintf(stderr, "Bad list '%s', at most %d numbers\n", optarg,
+                    MAX_GRID);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        name = argv[optind];
+        in = fopen(name, "r");
+        if (!in) {
+            fprintf(stderr, "%s: %s\n", name, strerror(errno));
+            return 1;
+        }
+    }
+
+    if (load_trace(in, name) < 0) {
+        return 1;
+    }
+
+    if (nevents == 0) {
+        fprintf(stderr, "%s: no activity\n", name);
+        return 1;
+    }
+
+    for (int d = 0; d < ndims; d++) {
+        for (int i = 0; i < nidles; i++) {
+            results[n].dim = dims[d];
+            results[n].idle = idles[i];
+            simulate(&results[n], fn_mode);
+            n++;
+        }
+    }
+
+    printf("# %s: %zu events over %.1f s\n", name, nevents,
+           (events[nevents - 1].ms - events[0].ms) / 1000.0);
+    print_results(results, n);
+
+    free(events);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * test-contacts - Replays touch bar report fields through contact assembly
+ *
+ * Feeds apple-ib-tb-contact.h the digitizer fields of scripted reports in
+ * the order hid-core delivers them, and checks the contacts the driver
+ * would push to the event ring and the multitouch device.
+ *
+ * Exits 0 if every scenario passes.
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "apple-ib-tb-contact.h"
+
+#define MAX_FIELDS      32
+#define MAX_CONTACTS    8
+
+enum op {
+    OP_END,
+    OP_FIELD,       /* @field of @collection is @value */
+    OP_REPORT,      /* the report ends */
+};
+
+struct field {
+    enum op op;
+    unsigned int field; /* APPLETB_CONTACT_* */
+    unsigned int collection;
+    int value;
+};
+
+#define ID(col, v)      { OP_FIELD, APPLETB_CONTACT_ID, col, v }
+#define TIP(col, v)     { OP_FIELD, APPLETB_CONTACT_TIP, col, v }
+#define X(col, v)       { OP_FIELD, APPLETB_CONTACT_X, col, v }
+#define Y(col, v)       { OP_FIELD, APPLETB_CONTACT_Y, col, v }
+#define REPORT          { OP_REPORT, 0, 0, 0 }
+
+struct scenario {
+    const char *name;
+    struct field fields[MAX_FIELDS];
+    struct appletb_contact expected[MAX_CONTACTS];
+    int nexpected;
+};
+
+/* One finger per collection, in the touch bar's descriptor order */
+#define FINGER(col, id, tip, x, y) \
+    TIP(col, tip), ID(col, id), X(col, x), Y(col, y)
+
+/* Every finger in the same collection */
+#define FLAT(id, tip, x, y)     FINGER(1, id, tip, x, y)
+
+static const struct scenario scenarios[] = {
+    {
+        "one finger",
+        {
+            FINGER(1, 3, 1, 100, 10),
+            REPORT,
+        },
+        { { 3, 1, 100, 10 } }, 1,
+    },
+    {
+        "two fingers, then the second lifts",
+        {
+            FINGER(1, 0, 1, 100, 10),
+            FINGER(2, 1, 1, 900, 12),
+            REPORT,
+            FINGER(1, 0, 1, 110, 10),
+            FINGER(2, 1, 0, 900, 12),
+            REPORT,
+        },
+        {
+            { 0, 1, 100, 10 }, { 1, 1, 900, 12 },
+            { 0, 1, 110, 10 }, { 1, 0, 900, 12 },
+        }, 4,
+    },
+    {
+        "two fingers, then the first lifts",
+        {
+            FINGER(1, 0, 1, 100, 10),
+            FINGER(2, 1, 1, 900, 12),
+            REPORT,
+            FINGER(1, 0, 0, 100, 10),
+            FINGER(2, 1, 1, 905, 12),
+            REPORT,
+        },
+        {
+            { 0, 1, 100, 10 }, { 1, 1, 900, 12 },
+            { 0, 0, 100, 10 }, { 1, 1, 905, 12 },
+        }, 4,
+    },
+    {
+        "two fingers in one collection, one lifts",
+        {
+            FLAT(0, 1, 100, 10),
+            FLAT(1, 0, 900, 12),
+            REPORT,
+        },
+        { { 0, 1, 100, 10 }, { 1, 0, 900, 12 } }, 2,
+    },
+    {
+        "nothing carries over into the next report",
+        {
+            FINGER(1, 0, 1, 100, 10),
+            REPORT,
+            REPORT,
+            ID(1, 2), X(1, 50),
+            REPORT,
+        },
+        { { 0, 1, 100, 10 }, { 2, 0, 50, 0 } }, 2,
+    },
+};
+
+static bool same(const struct appletb_contact *a,
+                 const struct appletb_contact *b)
+{
+    return a->id == b->id && a->tip == b->tip && a->x == b->x &&
+           a->y == b->y;
+}
+
+static bool run(const struct scenario *sc)
+{
+    struct appletb_contact_asm ca = { 0 };
+    struct appletb_contact got[MAX_CONTACTS], done;
+    int n = 0;
+    bool ok = true;
+
+    for (int i = 0; i < MAX_FIELDS && sc->fields[i].op != OP_END; i++) {
+        const struct field *f = &sc->fields[i];
+        bool completed;
+
+        if (f->op == OP_REPORT) {
+            completed = appletb_contact_end(&ca, &done);
+        } else {
+            completed = appletb_contact_field(&ca, f->collection, f->field,
+                                              f->value, &done);
+        }
+
+        if (completed && n < MAX_CONTACTS) {
+            got[n++] = done;
+        }
+    }
+
+    if (n != sc->nexpected) {
+        printf("FAIL: %s: %d contacts, expected %d\n", sc->name, n,
+               sc->nexpected);
+        ok = false;
+    }
+
+    for (int i = 0; i < n && i < sc->nexpected; i++) {
+        const struct appletb_contact *e = &sc->expected[i];
+
+        if (!same(&got[i], e)) {
+            printf("FAIL: %s: contact %d: id %u tip %d at %d,%d, "
+                   "expected id %u tip %d at %d,%d\n", sc->name, i + 1,
+                   got[i].id, got[i].tip, got[i].x, got[i].y,
+                   e->id, e->tip, e->x, e->y);
+            ok = false;
+        }
+    }
+
+    printf("%s: %s (%d contacts)\n", ok ? "ok" : "FAIL", sc->name, n);
+    return ok;
+}
+
+int main(void)
+{
+    size_t n = sizeof(scenarios) / sizeof(scenarios[0]);
+    size_t failed = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (!run(&scenarios[i])) {
+            failed++;
+        }
+    }
+
+    printf("%zu of %zu scenarios passed\n", n - failed, n);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * test-state - Scripted scenarios for the touch bar state machine
+ *
+ * Drives apple-ib-tb-state.h on a simulated clock through fixed activity
+ * scripts and checks, per scenario, the mode and display state along the
+ * way, and at the end the timer wakeups, timer arms and USB writes the
+ * driver would have made. Changes to the timeouts or to timer coalescing
+ * show up here as changed counts, without hardware.
+ *
+ * Exits 0 if every scenario passes.
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "apple-ib-tb-state.h"
+
+#define MAX_STEPS	16
+
+/* Simulated driver: the clock, the armed deadline and what was sent */
+struct sim {
+    unsigned long long now;
+    unsigned long long armed;
+    unsigned int mode, disp;
+
+    unsigned long arms;
+    unsigned long usb_writes;
+};
+
+static unsigned long long sim_now(void *ctx)
+{
+    return ((struct sim *)ctx)->now;
+}
+
+/* apple-ib-tb sends the mode and the display state as separate requests */
+static void sim_output(void *ctx, unsigned int mode, unsigned int disp)
+{
+    struct sim *sim = ctx;
+
+    sim->usb_writes += (mode != sim->mode) + (disp != sim->disp);
+    sim->mode = mode;
+    sim->disp = disp;
+}
+
+static void sim_arm(void *ctx, unsigned long long deadline)
+{
+    struct sim *sim = ctx;
+
+    sim->armed = deadline;
+    sim->arms++;
+}
+
+static const struct appletb_sm_ops sim_ops = {
+    .now = sim_now,
+    .output = sim_output,
+    .arm = sim_arm,
+};
+
+enum op {
+    OP_END,
+    OP_ADVANCE,     /* fire every deadline due up to @at */
+    OP_ACTIVITY,
+    OP_FN_DOWN,
+    OP_FN_UP,
+    OP_FN_MODE,     /* @a: APPLETB_SM_FN_MODE_* */
+    OP_TIMEOUTS,    /* @a: dim, @b: idle, seconds */
+    OP_RESTART,     /* e.g. resume: the timer was dropped */
+};
+
+struct step {
+    unsigned long long at;  /* ms, time moves forward to here first */
+    enum op op;
+    unsigned int a, b;
+    unsigned int mode, disp; /* expected afterwards, 0: not checked */
+};
+
+struct scenario {
+    const char *name;
+    unsigned int fn_mode;
+    unsigned int dim, idle;
+    struct step steps[MAX_STEPS];
+
+    /* expected totals */
+    unsigned long wakeups;
+    unsigned long arms;
+    unsigned long usb_writes;
+};
+
+#define NORM	APPLETB_SM_FN_MODE_NORM
+#define FKEYS	APPLETB_SM_FN_MODE_FKEYS
+#define FN	APPLETB_SM_MODE_FN
+#define SPCL	APPLETB_SM_MODE_SPCL
+#define OFF	APPLETB_SM_MODE_OFF
+#define ON	APPLETB_SM_DISP_ON
+#define DIM	APPLETB_SM_DISP_DIM
+#define DARK	APPLETB_SM_DISP_OFF
+
+/* Every scenario starts at 1000 ms with the driver's probe-time restart */
+static const struct scenario scenarios[] = {
+    {
+        "dims, then goes dark", NORM, 5, 10,
+        {
+            { 5999, OP_ADVANCE, 0, 0, SPCL, ON },
+            { 6000, OP_ADVANCE, 0, 0, SPCL, DIM },
+            { 11000, OP_ADVANCE, 0, 0, OFF, DARK },
+            { 60000, OP_ADVANCE, 0, 0, OFF, DARK },
+        },
+        .wakeups = 2, .arms = 2, .usb_writes = 3,
+    },
+    {
+        "touches while lit cost no timer updates", NORM, 5, 10,
+        {
+            { 2000, OP_ACTIVITY, 0, 0, SPCL, ON },
+            { 3000, OP_ACTIVITY, 0, 0, SPCL, ON },
+            { 4000, OP_ACTIVITY, 0, 0, SPCL, ON },
+            { 5000, OP_ACTIVITY, 0, 0, SPCL, ON },
+            /* fires early at 6000, re-armed for 10000 */
+            { 9999, OP_ADVANCE, 0, 0, SPCL, ON },
+            { 10000, OP_ADVANCE, 0, 0, SPCL, DIM },
+        },
+        .wakeups = 2, .arms = 3, .usb_writes = 1,
+    },
+    {
+        "a touch wakes a dark bar", NORM, 5, 10,
+        {
+            { 12000, OP_ADVANCE, 0, 0, OFF, DARK },
+            { 12000, OP_ACTIVITY, 0, 0, SPCL, ON },
+            { 16999, OP_ADVANCE, 0, 0, SPCL, ON },
+            { 17000, OP_ADVANCE, 0, 0, SPCL, DIM },
+        },
+        .wakeups = 3, .arms = 4, .usb_writes = 6,
+    },
+    {
+        "Fn flips the keys, no timeouts", NORM, 0, 0,
+        {
+            { 2000, OP_FN_DOWN, 0, 0, FN, ON },
+            { 3000, OP_FN_UP, 0, 0, SPCL, ON },
+            { 600000, OP_ADVANCE, 0, 0, SPCL, ON },
+        },
+        .wakeups = 0, .arms = 0, .usb_writes = 2,
+    },
+    {
+        "fn mode change while Fn is held", FKEYS, 0, 0,
+        {
+            { 1000, OP_ADVANCE, 0, 0, FN, ON },
+            { 2000, OP_FN_DOWN, 0, 0, SPCL, ON },
+            { 2500, OP_FN_MODE, NORM, 0, FN, ON },
+            { 3000, OP_FN_UP, 0, 0, SPCL, ON },
+        },
+        .wakeups = 0, .arms = 0, .usb_writes = 3,
+    },
+    {
+        "Fn wakes a dark bar into the function keys", NORM, 5, 10,
+        {
+            { 11000, OP_ADVANCE, 0, 0, OFF, DARK },
+            { 11500, OP_FN_DOWN, 0, 0, FN, ON },
+        },
+        .wakeups = 2, .arms = 3, .usb_writes = 5,
+    },
+    {
+        "shorter timeouts re-arm the timer", NORM, 60, 120,
+        {
+            { 2000, OP_TIMEOUTS, 5, 10, SPCL, ON },
+            { 7000, OP_ADVANCE, 0, 0, SPCL, DIM },
+            { 12000, OP_ADVANCE, 0, 0, OFF, DARK },
+        },
+        .wakeups = 2, .arms = 3, .usb_writes = 3,
+    },
+    {
+        "resume starts the timeouts over", NORM, 5, 10,
+        {
+            { 12000, OP_ADVANCE, 0, 0, OFF, DARK },
+            { 50000, OP_RESTART, 0, 0, SPCL, ON },
+            { 54999, OP_ADVANCE, 0, 0, SPCL, ON },
+            { 55000, OP_ADVANCE, 0, 0, SPCL, DIM },
+        },
+        .wakeups = 3, .arms = 4, .usb_writes = 6,
+    },
+};
+
+/* Fire every deadline due up to @until */
+static void sim_advance(struct sim *sim, struct appletb_sm *sm,
+                        unsigned long long until)
+{
+    while (sim->armed && sim->armed <= until) {
+        sim->now = sim->armed;
+        sim->armed = 0;
+        appletb_sm_timer(sm);
+    }
+    sim->now = until;
+}
+
+static bool check(const char *scenario, const char *what, int step,
+                  unsigned long expected, unsigned long got)
+{
+    if (expected == got) {
+        return true;
+    }
+
+    if (step >= 0) {
+        printf("FAIL: %s: step %d: %s %lu, expected %lu\n", scenario,
+               step + 1, what, got, expected);
+    } else {
+        printf("FAIL: %s: %s %lu, expected %lu\n", scenario, what, got,
+               expected);
+    }
+    return false;
+}
+
+static bool run(const struct scenario *sc)
+{
+    struct sim sim = { .now = 1000 };
+    struct appletb_sm sm;
+    bool ok = true;
+
+    appletb_sm_init(&sm, &sim_ops, &sim, sc->fn_mode, sc->dim, sc->idle);
+    sim.mode = sm.mode;
+    sim.disp = sm.disp;
+    appletb_sm_restart(&sm);
+
+    for (int i = 0; i < MAX_STEPS && sc->steps[i].op != OP_END; i++) {
+        const struct step *st = &sc->steps[i];
+
+        sim_advance(&sim, &sm, st->at);
+
+        switch (st->op) {
+        case OP_ACTIVITY:
+            appletb_sm_activity(&sm);
+            break;
+        case OP_FN_DOWN:
+        case OP_FN_UP:
+            appletb_sm_fn_key(&sm, st->op == OP_FN_DOWN);
+            break;
+        case OP_FN_MODE:
+            appletb_sm_set_fn_mode(&sm, st->a);
+            break;
+        case OP_TIMEOUTS:
+            appletb_sm_set_timeouts(&sm, st->a, st->b);
+            break;
+        case OP_RESTART:
+            sim.armed = 0;
+            appletb_sm_restart(&sm);
+            break;
+        default:
+            break;
+        }
+
+        if (st->mode) {
+            ok &= check(sc->name, "mode", i, st->mode, sim.mode);
+        }
+        if (st->disp) {
+            ok &= check(sc->name, "display", i, st->disp, sim.disp);
+        }
+    }
+
+    ok &= check(sc->name, "wakeups", -1, sc->wakeups, sm.wakeups);
+    ok &= check(sc->name, "timer arms", -1, sc->arms, sim.arms);
+    ok &= check(sc->name, "USB writes", -1, sc->usb_writes, sim.usb_writes);
+
+    printf("%s: %s (%lu wakeups, %lu arms, %lu USB writes)\n",
+           ok ? "ok" : "FAIL", sc->name, sm.wakeups, sim.arms,
+           sim.usb_writes);
+    return ok;
+}
+
+int main(void)
+{
+    size_t n = sizeof(scenarios) / sizeof(scenarios[0]);
+    size_t failed = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (!run(&scenarios[i])) {
+            failed++;
+        }
+    }
+
+    printf("%zu of %zu scenarios passed\n", n - failed, n);
+    return failed ? 1 : 0;
+}